@@ -5,69 +5,378 @@
  *
  * Released under the terms of the GNU GPL v2.0.
  */
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/sysmacros.h>
 #include <scsi/scsi.h>
 #include <scsi/sg.h>
 
 #include "libbsg.h"
+#include "libemu.h"
+#include "libpi.h"
 
-int open_bsg_dev(char *in)
+/*
+ * Transports other than the kernel claim their fds here, a table
+ * indexed by fd keeps the kernel path down to one check.
+ */
+#define BSG_MAX_FDS	4096
+
+static struct bsg_fd_transport {
+	const struct bsg_transport *t;
+	void *priv;
+} bsg_fd_transports[BSG_MAX_FDS];
+
+static inline struct bsg_fd_transport *bsg_fd_transport(int fd)
 {
-	int maj, min, err, fd = -1;
-	struct timeval t;
-	FILE *fp;
-	char buf[1024], *dev;
+	if (fd >= 0 && fd < BSG_MAX_FDS && bsg_fd_transports[fd].t)
+		return &bsg_fd_transports[fd];
+	return NULL;
+}
 
-	if (in[strlen(in) - 1] == '/')
-		in[strlen(in) - 1] = 0;
+int bsg_transport_register(int fd, const struct bsg_transport *t, void *priv)
+{
+	if (fd < 0 || fd >= BSG_MAX_FDS)
+		return -EMFILE;
 
-	dev = strrchr(in, '/');
-	if (!dev)
-		return -ENOENT;
+	bsg_fd_transports[fd].priv = priv;
+	bsg_fd_transports[fd].t = t;
+
+	return 0;
+}
+
+const char *bsg_transport_name(int fd)
+{
+	struct bsg_fd_transport *ft = bsg_fd_transport(fd);
+
+	return ft ? ft->t->name : "bsg";
+}
+
+/* returns the number of headers bsg took */
+int bsg_write(int fd, const struct sg_io_v4 *hdrs, int nr)
+{
+	struct bsg_fd_transport *ft = bsg_fd_transport(fd);
+	ssize_t ret;
+
+	if (ft)
+		return ft->t->write(ft->priv, hdrs, nr);
+
+	ret = write(fd, hdrs, sizeof(*hdrs) * nr);
+	if (ret < 0)
+		return -errno;
+
+	return ret / sizeof(*hdrs);
+}
+
+/* returns the number of completed headers read back */
+int bsg_read(int fd, struct sg_io_v4 *hdrs, int nr)
+{
+	struct bsg_fd_transport *ft = bsg_fd_transport(fd);
+	ssize_t ret;
+
+	if (ft)
+		return ft->t->read(ft->priv, hdrs, nr);
+
+	ret = read(fd, hdrs, sizeof(*hdrs) * nr);
+	if (ret < 0)
+		return -errno;
+
+	return ret / sizeof(*hdrs);
+}
+
+int bsg_sg_io(int fd, struct sg_io_v4 *hdr)
+{
+	struct bsg_fd_transport *ft = bsg_fd_transport(fd);
+
+	if (ft)
+		return ft->t->sg_io(ft->priv, hdr);
+
+	if (ioctl(fd, SG_IO, hdr))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * The major:minor of every bsg device, from one walk of sysfs. Opening
+ * a whole shelf shouldn't read a sysfs file per device.
+ */
+static struct bsg_node {
+	char name[NAME_MAX + 1];
+	dev_t devt;
+} *bsg_nodes;
+static int nr_bsg_nodes;
+static pthread_mutex_t bsg_nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int read_bsg_devt(const char *name, dev_t *devt)
+{
+	unsigned int maj, min;
+	char buf[PATH_MAX];
+	FILE *fp;
+	int ret = -ENODEV;
 
-	snprintf(buf, sizeof(buf), "/sys/class/bsg/%s/dev", dev);
+	snprintf(buf, sizeof(buf), "/sys/class/bsg/%s/dev", name);
 
 	fp = fopen(buf, "r");
 	if (!fp)
 		return -errno;
 
-	if (!fgets(buf, sizeof(buf), fp))
-		goto close_sysfs;
+	if (fgets(buf, sizeof(buf), fp) &&
+	    sscanf(buf, "%u:%u", &maj, &min) == 2) {
+		*devt = makedev(maj, min);
+		ret = 0;
+	}
 
-	if (sscanf(buf, "%d:%d", &maj, &min) != 2)
-		goto close_sysfs;
+	fclose(fp);
 
-	err = gettimeofday(&t, NULL);
-	if (err)
-		goto close_sysfs;
+	return ret;
+}
 
-	memset(buf, 0, sizeof(buf));
-	snprintf(buf, sizeof(buf), "/tmp/%lx%lx", t.tv_sec, t.tv_usec);
-	err = mknod(buf, S_IFCHR | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH,
-		    makedev(maj, min));
-	if (err)
-		goto close_sysfs;
+static int scan_bsg_nodes(void)
+{
+	struct bsg_node *nodes = NULL, *n;
+	struct dirent *d;
+	int nr = 0, max = 0;
+	DIR *dir;
+
+	dir = opendir("/sys/class/bsg");
+	if (!dir)
+		return -errno;
+
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+
+		if (nr == max) {
+			max = max ? max * 2 : 64;
+			n = realloc(nodes, sizeof(*nodes) * max);
+			if (!n) {
+				free(nodes);
+				closedir(dir);
+				return -ENOMEM;
+			}
+			nodes = n;
+		}
+
+		n = &nodes[nr];
+		snprintf(n->name, sizeof(n->name), "%s", d->d_name);
+		if (!read_bsg_devt(n->name, &n->devt))
+			nr++;
+	}
 
-	fd = open(buf, O_RDWR);
+	closedir(dir);
+
+	free(bsg_nodes);
+	bsg_nodes = nodes;
+	nr_bsg_nodes = nr;
+
+	return 0;
+}
+
+static int lookup_bsg_devt(const char *name, dev_t *devt)
+{
+	int i, ret = -ENOENT;
+
+	pthread_mutex_lock(&bsg_nodes_lock);
+	for (i = 0; i < nr_bsg_nodes; i++) {
+		if (!strcmp(bsg_nodes[i].name, name)) {
+			*devt = bsg_nodes[i].devt;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bsg_nodes_lock);
+
+	/* not scanned yet, or hot added since */
+	if (ret)
+		ret = read_bsg_devt(name, devt);
+
+	return ret;
+}
+
+static int open_chrdev(const char *path, dev_t devt)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR);
 	if (fd < 0)
-		fprintf(stderr, "can't open %s, %m\n", buf);
+		return -errno;
 
-	unlink(buf);
+	/* udev could name something else after our device */
+	if (fstat(fd, &st) || !S_ISCHR(st.st_mode) || st.st_rdev != devt) {
+		close(fd);
+		return -ENODEV;
+	}
 
-close_sysfs:
-	fclose(fp);
+	return fd;
+}
+
+/*
+ * No usable node in /dev, make a private one. The name is unique to
+ * the process and the call, and we try the next directory when a
+ * filesystem is read-only or mounted nodev.
+ */
+static int open_tmp_node(dev_t devt)
+{
+	const char *dirs[] = { getenv("TMPDIR"), "/dev/shm", "/tmp", "/var/tmp" };
+	static unsigned long seq;
+	char path[PATH_MAX];
+	int i, fd = -ENOENT;
+
+	for (i = 0; i < (int) (sizeof(dirs) / sizeof(dirs[0])); i++) {
+		if (!dirs[i])
+			continue;
+
+		snprintf(path, sizeof(path), "%s/bsg-%d-%lu", dirs[i],
+			 getpid(), __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+		if (mknod(path, S_IFCHR | S_IRUSR | S_IWUSR, devt)) {
+			fd = -errno;
+			continue;
+		}
+
+		fd = open(path, O_RDWR);
+		if (fd < 0)
+			fd = -errno;
+		unlink(path);
+
+		if (fd >= 0)
+			break;
+	}
+
+	return fd;
+}
+
+/* what open_bsg_dev() takes */
+int is_bsg_dev(const char *name)
+{
+	return !strncmp(name, EMU_PREFIX, strlen(EMU_PREFIX)) ||
+		!strncmp(name, "/dev/bsg/", 9) ||
+		strstr(name, "/sys/class/bsg/");
+}
+
+int open_bsg_dev(char *in)
+{
+	char path[PATH_MAX];
+	const char *name;
+	dev_t devt;
+	int ret;
+
+	if (!strncmp(in, EMU_PREFIX, strlen(EMU_PREFIX)))
+		return emu_open(in + strlen(EMU_PREFIX));
+
+	if (in[strlen(in) - 1] == '/')
+		in[strlen(in) - 1] = 0;
+
+	name = strrchr(in, '/');
+	name = name ? name + 1 : in;
+	if (!*name)
+		return -ENOENT;
+
+	ret = lookup_bsg_devt(name, &devt);
+	if (ret)
+		return ret;
+
+	/* /dev/bsg/<name> itself, or what udev created */
+	if (strchr(in, '/') && strncmp(in, "/sys/", 5)) {
+		ret = open_chrdev(in, devt);
+		if (ret >= 0)
+			return ret;
+	}
+
+	snprintf(path, sizeof(path), "/dev/bsg/%s", name);
+	ret = open_chrdev(path, devt);
+	if (ret >= 0 || ret == -EACCES || ret == -EPERM)
+		return ret;
+
+	return open_tmp_node(devt);
+}
+
+void close_bsg_dev(int fd)
+{
+	struct bsg_fd_transport *ft = bsg_fd_transport(fd);
+	const struct bsg_transport *t;
+
+	if (!ft) {
+		close(fd);
+		return;
+	}
+
+	/* the fd number can be reused as soon as the transport closes it */
+	t = ft->t;
+	ft->t = NULL;
+	t->close(ft->priv);
+}
+
+struct bsg_open_work {
+	char **names;
+	int *fds;
+	int nr;
+	int next;
+};
+
+static void *open_bsg_worker(void *arg)
+{
+	struct bsg_open_work *work = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+	       work->nr)
+		work->fds[i] = open_bsg_dev(work->names[i]);
+
+	return NULL;
+}
+
+#define BSG_OPEN_THREADS	16
+
+/*
+ * Open nr devices, one sysfs walk for all of them and the opens in
+ * parallel since a device can take a while to answer. fds[i] gets the
+ * fd or -errno for names[i]; returns 0 if all of them opened.
+ */
+int open_bsg_devs(char **names, int nr, int *fds)
+{
+	struct bsg_open_work work = {
+		.names = names,
+		.fds = fds,
+		.nr = nr,
+	};
+	pthread_t threads[BSG_OPEN_THREADS];
+	int i, nr_threads, ret = 0;
+
+	pthread_mutex_lock(&bsg_nodes_lock);
+	scan_bsg_nodes();
+	pthread_mutex_unlock(&bsg_nodes_lock);
+
+	nr_threads = nr < BSG_OPEN_THREADS ? nr : BSG_OPEN_THREADS;
+	for (i = 1; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, open_bsg_worker, &work))
+			break;
+	nr_threads = i;
+
+	open_bsg_worker(&work);
 
-	return fd >=0 ? fd : -errno;
+	for (i = 1; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < nr; i++)
+		if (fds[i] < 0 && !ret)
+			ret = fds[i];
+
+	return ret;
 }
 
 void setup_sgv4_hdr(struct sg_io_v4 *hdr, unsigned char *scb, int scb_len,
@@ -90,13 +399,532 @@ void setup_sgv4_hdr(struct sg_io_v4 *hdr, unsigned char *scb, int scb_len,
 }
 
 void setup_rw_scb(unsigned char *scb, int scb_len, unsigned char cmd,
-		  unsigned long len, unsigned long offset)
+		  uint64_t len, uint64_t offset, unsigned int block_size)
 {
 	memset(scb, 0, scb_len);
 
 	scb[0] = cmd;
-	scb[7] = (unsigned char)(((len / SECTOR_SIZE) >> 8) & 0xff);
-	scb[8] = (unsigned char)((len / SECTOR_SIZE) & 0xff);
+	put_be32(&scb[2], offset / block_size);
+	put_be16(&scb[7], len / block_size);
+}
+
+void setup_rw_scb16(unsigned char *scb, unsigned char cmd,
+		    uint64_t len, uint64_t offset, unsigned int block_size)
+{
+	memset(scb, 0, 16);
 
-	*((uint32_t *) &scb[2]) = htonl(offset / SECTOR_SIZE);
+	scb[0] = cmd;
+	put_be64(&scb[2], offset / block_size);
+	put_be32(&scb[10], len / block_size);
+}
+
+/*
+ * READ/WRITE(10) while the LBA and the length fit, (16) otherwise.
+ * scb has to hold RW_CDB_MAX bytes, returns the CDB length.
+ */
+int setup_rw_cdb(unsigned char *scb, int write, uint64_t len, uint64_t offset,
+		 unsigned int block_size)
+{
+	uint64_t lba = offset / block_size, blocks = len / block_size;
+
+	if (lba <= 0xffffffffULL && blocks <= 0xffff) {
+		setup_rw_scb(scb, 10, write ? WRITE_10 : READ_10, len, offset,
+			     block_size);
+		return 10;
+	}
+
+	setup_rw_scb16(scb, write ? WRITE_16 : READ_16, len, offset,
+		       block_size);
+	return 16;
+}
+
+/*
+ * READ/WRITE with RDPROTECT/WRPROTECT 1: the tuples go along with the
+ * data and the device checks them all. Type 2 takes the 32 byte
+ * commands only and types 1 and 3 don't, so it is (16) for those. len
+ * is the data, without the tuples.
+ */
+int setup_rw_pi_cdb(unsigned char *scb, int write, uint64_t len,
+		    uint64_t offset, unsigned int block_size, int pi_type)
+{
+	uint64_t lba = offset / block_size;
+
+	if (pi_type != 2) {
+		setup_rw_scb16(scb, write ? WRITE_16 : READ_16, len, offset,
+			       block_size);
+		scb[1] = 1 << 5;
+		return 16;
+	}
+
+	memset(scb, 0, 32);
+	scb[0] = VARIABLE_LENGTH_CMD;
+	scb[7] = 0x18; /* Additional CDB length */
+	put_be16(&scb[8], write ? WRITE_32 : READ_32);
+	scb[10] = 1 << 5;
+	put_be64(&scb[12], lba);
+	put_be32(&scb[20], lba);	/* expected initial ref tag */
+	put_be32(&scb[28], len / block_size);
+
+	return 32;
+}
+
+static int read_capacity16(int fd, struct bsg_capacity *cap)
+{
+	unsigned char scb[16], sense[32], buf[32];
+	struct sg_io_v4 hdr;
+	int ret;
+
+	memset(scb, 0, sizeof(scb));
+	memset(buf, 0, sizeof(buf));
+
+	scb[0] = SERVICE_ACTION_IN_16;
+	scb[1] = SAI_READ_CAPACITY_16;
+	put_be32(&scb[10], sizeof(buf));
+
+	setup_sgv4_hdr(&hdr, scb, sizeof(scb), sense, sizeof(sense),
+		       (char *)buf, sizeof(buf), NULL, 0);
+
+	ret = bsg_sg_io(fd, &hdr);
+	if (ret)
+		return ret;
+
+	if (hdr.driver_status || hdr.transport_status || hdr.device_status ||
+	    (int)sizeof(buf) - hdr.din_resid < 16)
+		return -EIO;
+
+	cap->nr_blocks = get_be64(&buf[0]) + 1;
+	cap->block_size = get_be32(&buf[8]);
+	cap->phys_block_size = cap->block_size << (buf[13] & 0xf);
+	cap->lowest_aligned = get_be16(&buf[14]) & 0x3fff;
+	cap->lbpme = !!(buf[14] & 0x80);
+	cap->lbprz = !!(buf[14] & 0x40);
+	if (buf[12] & 0x01)		/* PROT_EN */
+		cap->pi_type = ((buf[12] >> 1) & 0x7) + 1;
+
+	return 0;
+}
+
+static int read_capacity10(int fd, struct bsg_capacity *cap)
+{
+	unsigned char scb[10], sense[32], buf[8];
+	struct sg_io_v4 hdr;
+	int ret;
+
+	memset(scb, 0, sizeof(scb));
+	memset(buf, 0, sizeof(buf));
+
+	scb[0] = READ_CAPACITY;
+
+	setup_sgv4_hdr(&hdr, scb, sizeof(scb), sense, sizeof(sense),
+		       (char *)buf, sizeof(buf), NULL, 0);
+
+	ret = bsg_sg_io(fd, &hdr);
+	if (ret)
+		return ret;
+
+	if (sgv4_rsp_check(&hdr))
+		return -EIO;
+
+	/* 0xffffffff means that the device needs READ CAPACITY(16) */
+	if (get_be32(&buf[0]) == 0xffffffff)
+		return -EOVERFLOW;
+
+	cap->nr_blocks = (uint64_t)get_be32(&buf[0]) + 1;
+	cap->block_size = get_be32(&buf[4]);
+	cap->phys_block_size = cap->block_size;
+
+	return 0;
+}
+
+/* WRITE SAME(16) of nr_blocks from one block of data out */
+void setup_write_same16_scb(unsigned char *scb, uint64_t lba,
+			    uint32_t nr_blocks, int unmap)
+{
+	memset(scb, 0, 16);
+
+	scb[0] = WRITE_SAME_16;
+	if (unmap)
+		scb[1] = 0x08;
+	put_be64(&scb[2], lba);
+	put_be32(&scb[10], nr_blocks);
+}
+
+/*
+ * UNMAP of one range. param has to hold UNMAP_PARAM_LEN bytes,
+ * returns the CDB length.
+ */
+int setup_unmap(unsigned char *scb, unsigned char *param, uint64_t lba,
+		uint32_t nr_blocks)
+{
+	memset(scb, 0, 10);
+	memset(param, 0, UNMAP_PARAM_LEN);
+
+	scb[0] = UNMAP;
+	put_be16(&scb[7], UNMAP_PARAM_LEN);
+
+	put_be16(&param[0], UNMAP_PARAM_LEN - 2);
+	put_be16(&param[2], 16);
+	put_be64(&param[8], lba);
+	put_be32(&param[16], nr_blocks);
+
+	return 10;
+}
+
+/*
+ * READ CAPACITY(16) first since it's the only one that works past
+ * 2TiB and reports the physical block size; fall back to (10) for
+ * devices that don't support it.
+ */
+int bsg_read_capacity(int fd, struct bsg_capacity *cap)
+{
+	int ret;
+
+	memset(cap, 0, sizeof(*cap));
+
+	ret = read_capacity16(fd, cap);
+	if (ret)
+		ret = read_capacity10(fd, cap);
+	if (ret)
+		return ret;
+
+	if (!cap->block_size || (cap->block_size & (cap->block_size - 1)) ||
+	    cap->block_size % SECTOR_SIZE)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* returns the page length the device reported */
+int bsg_inquiry_vpd(int fd, int page, unsigned char *buf, int len)
+{
+	unsigned char scb[6], sense[32];
+	struct sg_io_v4 hdr;
+	int ret;
+
+	memset(scb, 0, sizeof(scb));
+	memset(buf, 0, len);
+
+	scb[0] = INQUIRY;
+	scb[1] = 0x01;
+	scb[2] = page;
+	put_be16(&scb[3], len);
+
+	setup_sgv4_hdr(&hdr, scb, sizeof(scb), sense, sizeof(sense),
+		       (char *)buf, len, NULL, 0);
+
+	ret = bsg_sg_io(fd, &hdr);
+	if (ret)
+		return ret;
+
+	if (hdr.driver_status || hdr.transport_status || hdr.device_status ||
+	    len - (int)hdr.din_resid < 4 || buf[1] != page)
+		return -EIO;
+
+	return get_be16(&buf[2]) + 4;
+}
+
+/*
+ * Both pages are optional; a device without them gets plain WRITE
+ * SAME and no UNMAP.
+ */
+int bsg_read_lbp(int fd, struct bsg_lbp *lbp)
+{
+	unsigned char buf[64];
+	int ret;
+
+	memset(lbp, 0, sizeof(*lbp));
+
+	ret = bsg_inquiry_vpd(fd, VPD_LB_PROVISIONING, buf, sizeof(buf));
+	if (ret >= 6) {
+		lbp->lbpu = !!(buf[5] & 0x80);
+		lbp->lbpws = !!(buf[5] & 0x40);
+	}
+
+	ret = bsg_inquiry_vpd(fd, VPD_BLOCK_LIMITS, buf, sizeof(buf));
+	if (ret >= 44) {
+		lbp->max_unmap_lbas = get_be32(&buf[20]);
+		lbp->unmap_gran = get_be32(&buf[28]);
+		if (buf[32] & 0x80)
+			lbp->unmap_align = get_be32(&buf[32]) & 0x7fffffff;
+		lbp->max_ws_len = get_be64(&buf[36]);
+	}
+
+	return 0;
+}
+
+int bsg_queue_init(struct bsg_queue *q, int fd, int depth, int flags)
+{
+	struct bsg_req *req;
+	int i, fl;
+
+	memset(q, 0, sizeof(*q));
+
+	fl = fcntl(fd, F_GETFL);
+	if (fl < 0)
+		return -errno;
+
+	q->fd = fd;
+	q->depth = depth;
+	q->flags = flags;
+	q->nonblock = !!(fl & O_NONBLOCK);
+
+	q->reqs = calloc(depth, sizeof(*q->reqs));
+	q->free_reqs = calloc(depth, sizeof(*q->free_reqs));
+	q->sq = calloc(depth, sizeof(*q->sq));
+	q->cq = calloc(depth, sizeof(*q->cq));
+	if (!q->reqs || !q->free_reqs || !q->sq || !q->cq) {
+		bsg_queue_exit(q);
+		return -ENOMEM;
+	}
+
+	for (i = depth - 1; i >= 0; i--) {
+		req = &q->reqs[i];
+		req->tag = i;
+		setup_sgv4_hdr(&req->hdr, req->cdb, 0, req->sense,
+			       sizeof(req->sense), NULL, 0, NULL, 0);
+		req->hdr.usr_ptr = (unsigned long) req;
+		bsg_put_req(q, req);
+	}
+
+	return 0;
+}
+
+void bsg_queue_exit(struct bsg_queue *q)
+{
+	free(q->reqs);
+	free(q->free_reqs);
+	free(q->sq);
+	free(q->cq);
+	q->reqs = NULL;
+	q->free_reqs = NULL;
+	q->sq = q->cq = NULL;
+}
+
+/* the CDB is expected in req->cdb already */
+void bsg_req_prep(struct bsg_req *req, int cdb_len, char *din, int din_len,
+		  char *dout, int dout_len)
+{
+	struct sg_io_v4 *hdr = &req->hdr;
+
+	hdr->request_len = cdb_len;
+	hdr->din_xfer_len = din_len;
+	hdr->din_xferp = (unsigned long) din;
+	hdr->dout_xfer_len = dout_len;
+	hdr->dout_xferp = (unsigned long) dout;
+	hdr->flags = BSG_FLAG_Q_AT_TAIL;
+}
+
+void bsg_req_prep_rw(struct bsg_req *req, int write, char *buf, int len,
+		     uint64_t offset, unsigned int block_size)
+{
+	int cdb_len = setup_rw_cdb(req->cdb, write, len, offset, block_size);
+
+	if (write)
+		bsg_req_prep(req, cdb_len, NULL, 0, buf, len);
+	else
+		bsg_req_prep(req, cdb_len, buf, len, NULL, 0);
+}
+
+void bsg_req_prep_rw_pi(struct bsg_req *req, int write, char *buf, int len,
+			uint64_t offset, unsigned int block_size, int pi_type)
+{
+	int cdb_len = setup_rw_pi_cdb(req->cdb, write, len, offset,
+				      block_size, pi_type);
+	int xfer_len = pi_xfer_len(len, block_size);
+
+	if (write)
+		bsg_req_prep(req, cdb_len, NULL, 0, buf, xfer_len);
+	else
+		bsg_req_prep(req, cdb_len, buf, xfer_len, NULL, 0);
+}
+
+/* nothing is sent until bsg_queue_submit() */
+void bsg_queue_rq(struct bsg_queue *q, struct bsg_req *req)
+{
+	req->flags |= BSG_REQ_INFLIGHT;
+	q->sq[q->queued++] = req->hdr;
+}
+
+/*
+ * Send the queued headers with one write(). bsg may take only some of
+ * them; the rest stay queued for the next call. Returns the number
+ * sent.
+ */
+int bsg_queue_submit(struct bsg_queue *q)
+{
+	int ret, sent;
+
+	if (!q->queued)
+		return 0;
+
+	q->submit_calls++;
+
+	ret = bsg_write(q->fd, q->sq, q->queued);
+	if (ret < 0) {
+		if (ret == -EAGAIN && q->inflight)
+			return 0;
+		return ret;
+	}
+
+	sent = ret;
+	q->queued -= sent;
+	q->inflight += sent;
+	if (q->queued)
+		memmove(q->sq, q->sq + sent, sizeof(*q->sq) * q->queued);
+
+	return sent;
+}
+
+/*
+ * Read back completions and call the done callbacks. On a non-blocking
+ * fd this drains whatever is done, which edge-triggered pollers need;
+ * on a blocking one bsg waits for everything in flight.
+ */
+int bsg_queue_reap(struct bsg_queue *q)
+{
+	struct bsg_req *req;
+	int i, ret, nr, asked, done = 0;
+
+	while (q->inflight) {
+		q->reap_calls++;
+
+		asked = q->inflight;
+		ret = bsg_read(q->fd, q->cq, asked);
+		if (ret < 0) {
+			if (ret == -EAGAIN)
+				break;
+			if (ret == -EINTR)
+				continue;
+			return ret;
+		}
+		if (!ret)
+			break;
+
+		nr = ret;
+		q->inflight -= nr;
+		done += nr;
+
+		for (i = 0; i < nr; i++) {
+			req = (struct bsg_req *) (unsigned long) q->cq[i].usr_ptr;
+			req->hdr = q->cq[i];
+			req->flags &= ~BSG_REQ_INFLIGHT;
+			if (req->done)
+				req->done(q, req);
+		}
+
+		if (nr < asked || !q->nonblock)
+			break;
+	}
+
+	return done;
+}
+
+/*
+ * Run one request synchronously, with SG_IO when the queue was set up
+ * with BSG_QUEUE_SGIO. The result is in req->hdr; the return value is
+ * only about the syscalls.
+ */
+int bsg_queue_exec(struct bsg_queue *q, struct bsg_req *req)
+{
+	struct pollfd pfd;
+	int ret;
+
+	if (q->flags & BSG_QUEUE_SGIO)
+		return bsg_sg_io(q->fd, &req->hdr);
+
+	bsg_queue_rq(q, req);
+
+	while (req->flags & BSG_REQ_INFLIGHT) {
+		ret = bsg_queue_submit(q);
+		if (ret < 0)
+			return ret;
+
+		ret = bsg_queue_reap(q);
+		if (ret < 0)
+			return ret;
+
+		if (!ret && q->nonblock && (req->flags & BSG_REQ_INFLIGHT)) {
+			pfd.fd = q->fd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, -1);
+		}
+	}
+
+	return 0;
+}
+
+#define HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+/*
+ * Allocate nr_slots buffers of slot_size bytes, each aligned to align
+ * (a power of two, 0 means the page size). With BSG_ARENA_HUGEPAGE we
+ * try hugetlbfs first and fall back to transparent hugepages.
+ */
+int bsg_arena_init(struct bsg_arena *a, int nr_slots, size_t slot_size,
+		   size_t align, int flags)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE), len, off;
+	char *p;
+
+	memset(a, 0, sizeof(*a));
+
+	if (!align)
+		align = page_size;
+	if (align & (align - 1))
+		return -EINVAL;
+
+	a->nr_slots = nr_slots;
+	a->slot_size = (slot_size + align - 1) & ~(align - 1);
+	a->flags = flags & ~BSG_ARENA_HUGETLB;
+
+	len = a->slot_size * nr_slots;
+
+	if (flags & BSG_ARENA_HUGEPAGE) {
+		a->map_len = (len + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+		a->map = mmap(NULL, a->map_len, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (a->map != MAP_FAILED) {
+			a->flags |= BSG_ARENA_HUGETLB;
+			page_size = HUGEPAGE_SIZE;
+		}
+
+		if (align < HUGEPAGE_SIZE)
+			align = HUGEPAGE_SIZE;
+	}
+
+	if (!(a->flags & BSG_ARENA_HUGETLB)) {
+		a->map_len = len + (align > page_size ? align : 0);
+		a->map = mmap(NULL, a->map_len, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (a->map == MAP_FAILED)
+			return -errno;
+
+		if (flags & BSG_ARENA_HUGEPAGE)
+			madvise(a->map, a->map_len, MADV_HUGEPAGE);
+	}
+
+	off = (align - ((unsigned long)a->map & (align - 1))) & (align - 1);
+	a->base = a->map + off;
+
+	if (flags & BSG_ARENA_MLOCK) {
+		if (mlock(a->map, a->map_len)) {
+			int err = -errno;
+
+			bsg_arena_exit(a);
+			return err;
+		}
+	}
+
+	if (flags & (BSG_ARENA_PREFAULT | BSG_ARENA_MLOCK))
+		for (p = a->map; p < a->map + a->map_len; p += page_size)
+			*(volatile char *)p = 0;
+
+	return 0;
+}
+
+void bsg_arena_exit(struct bsg_arena *a)
+{
+	if (a->map && a->map != MAP_FAILED)
+		munmap(a->map, a->map_len);
+	a->map = NULL;
 }
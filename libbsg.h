@@ -1,18 +1,291 @@
 #ifndef __LIBBSG_H
 #define __LIBBSG_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "bsg.h"
 
 #define SECTOR_SIZE 512
 
+#ifndef READ_16
+#define READ_16 0x88
+#endif
+
+#ifndef WRITE_16
+#define WRITE_16 0x8a
+#endif
+
+#ifndef SERVICE_ACTION_IN_16
+#define SERVICE_ACTION_IN_16 0x9e
+#endif
+
+#ifndef WRITE_SAME_16
+#define WRITE_SAME_16 0x93
+#endif
+
+#ifndef UNMAP
+#define UNMAP 0x42
+#endif
+
+#ifndef XDWRITEREAD_10
+#define XDWRITEREAD_10 0x53
+#endif
+
+#ifndef VARIABLE_LENGTH_CMD
+#define VARIABLE_LENGTH_CMD 0x7f
+#endif
+
+#ifndef SYNCHRONIZE_CACHE_16
+#define SYNCHRONIZE_CACHE_16 0x91
+#endif
+
+/* service actions of VARIABLE_LENGTH_CMD */
+#define XDWRITEREAD_32 0x0007
+#define READ_32 0x0009
+#define WRITE_32 0x000b
+
+#define SAI_READ_CAPACITY_16 0x10
+
+/* SAM status, the scsi.h ones are shifted right by one */
+#define SAM_STAT_CHECK_CONDITION 0x02
+
+#define VPD_BLOCK_LIMITS	0xb0
+#define VPD_LB_PROVISIONING	0xb2
+
+/* UNMAP parameter list with a single block descriptor */
+#define UNMAP_PARAM_LEN	24
+
+/* big enough for any CDB setup_rw_cdb() builds */
+#define RW_CDB_MAX 16
+
+#define BSG_CDB_MAX	32
+#define BSG_SENSE_LEN	32
+
+#define BSG_ARENA_HUGEPAGE	0x1	/* back the arena with 2MB pages */
+#define BSG_ARENA_MLOCK		0x2	/* mlock the arena */
+#define BSG_ARENA_PREFAULT	0x4	/* touch every page at init */
+#define BSG_ARENA_HUGETLB	0x8	/* [o] got hugetlbfs pages, not THP */
+
+struct bsg_capacity {
+	uint64_t nr_blocks;
+	uint32_t block_size;		/* logical */
+	uint32_t phys_block_size;
+	uint64_t lowest_aligned;	/* first LBA on a physical boundary */
+	int lbpme;			/* thin provisioned */
+	int lbprz;			/* unmapped blocks read as zeros */
+	int pi_type;			/* T10 PI type 1-3, 0 without PI */
+};
+
+/* logical block provisioning, from the B0h and B2h VPD pages */
+struct bsg_lbp {
+	int lbpu;			/* UNMAP */
+	int lbpws;			/* WRITE SAME(16) with UNMAP */
+	uint32_t max_unmap_lbas;	/* 0 if unknown */
+	uint32_t unmap_gran;		/* 0 if unknown */
+	uint32_t unmap_align;		/* 0 unless UGAVALID */
+	uint64_t max_ws_len;		/* 0 if unknown */
+};
+
+/* one I/O buffer per outstanding slot */
+struct bsg_arena {
+	char *map;
+	size_t map_len;
+	char *base;
+	size_t slot_size;
+	int nr_slots;
+	int flags;
+};
+
+struct bsg_queue;
+struct bsg_req;
+
+/* called from bsg_queue_reap(), the request belongs to the callee */
+typedef void (bsg_done_fn)(struct bsg_queue *q, struct bsg_req *req);
+
+#define BSG_REQ_INFLIGHT	0x1
+
+/*
+ * One command slot of a queue. The constant parts of hdr are set up
+ * once by bsg_queue_init(), bsg_req_prep() only fills in what changes
+ * per command. On completion hdr holds the response.
+ */
+struct bsg_req {
+	struct sg_io_v4 hdr;
+	unsigned char cdb[BSG_CDB_MAX];
+	unsigned char sense[BSG_SENSE_LEN];
+	bsg_done_fn *done;
+	void *priv;
+	int tag;		/* index in the queue, 0 .. depth - 1 */
+	unsigned int flags;
+};
+
+#define BSG_QUEUE_SGIO		0x1	/* bsg_queue_exec() uses SG_IO */
+
+/*
+ * A bounded set of requests on one bsg fd. Requests are tagged with
+ * usr_ptr, queued ones go out together with one write(), and
+ * completions are read in bulk. Nothing is allocated after init.
+ */
+struct bsg_queue {
+	int fd;
+	int depth;
+	int flags;
+	int nonblock;
+
+	struct bsg_req *reqs;
+	struct bsg_req **free_reqs;
+	int nr_free;
+
+	/* queued headers waiting for bsg_queue_submit() */
+	struct sg_io_v4 *sq;
+	int queued;
+	int inflight;
+	/* responses, separate so callbacks can queue while we reap */
+	struct sg_io_v4 *cq;
+
+	unsigned long long submit_calls;
+	unsigned long long reap_calls;
+};
+
+/*
+ * Where the commands for an fd go. The ops mirror write(), read() and
+ * ioctl(SG_IO) on a bsg fd but count headers and return -errno. fds
+ * nobody registered go to the kernel.
+ */
+struct bsg_transport {
+	const char *name;
+	int (*write)(void *priv, const struct sg_io_v4 *hdrs, int nr);
+	int (*read)(void *priv, struct sg_io_v4 *hdrs, int nr);
+	int (*sg_io)(void *priv, struct sg_io_v4 *hdr);
+	void (*close)(void *priv);	/* closes the fd too */
+};
+
+extern int bsg_transport_register(int fd, const struct bsg_transport *t,
+				  void *priv);
+extern const char *bsg_transport_name(int fd);
+
+extern int bsg_write(int fd, const struct sg_io_v4 *hdrs, int nr);
+extern int bsg_read(int fd, struct sg_io_v4 *hdrs, int nr);
+extern int bsg_sg_io(int fd, struct sg_io_v4 *hdr);
+
+extern int is_bsg_dev(const char *name);
 extern int open_bsg_dev(char *in_file);
+extern int open_bsg_devs(char **names, int nr, int *fds);
+extern void close_bsg_dev(int fd);
 
 extern void setup_sgv4_hdr(struct sg_io_v4 *hdr, unsigned char *scb, int scb_len,
 			   unsigned char *sense, int sense_len,
 			   char *rbuf, int rlen, char *wbuf, int wlen);
 
+/* 10 byte CDB, the LBA and the length have to fit */
 extern void setup_rw_scb(unsigned char *scb, int scb_len, unsigned char cmd,
-			 unsigned long len, unsigned long offset);
+			 uint64_t len, uint64_t offset,
+			 unsigned int block_size);
+extern void setup_rw_scb16(unsigned char *scb, unsigned char cmd,
+			   uint64_t len, uint64_t offset,
+			   unsigned int block_size);
+extern int setup_rw_cdb(unsigned char *scb, int write, uint64_t len,
+			uint64_t offset, unsigned int block_size);
+extern int setup_rw_pi_cdb(unsigned char *scb, int write, uint64_t len,
+			   uint64_t offset, unsigned int block_size,
+			   int pi_type);
+
+extern void setup_write_same16_scb(unsigned char *scb, uint64_t lba,
+				   uint32_t nr_blocks, int unmap);
+extern int setup_unmap(unsigned char *scb, unsigned char *param,
+		       uint64_t lba, uint32_t nr_blocks);
+
+extern int bsg_read_capacity(int fd, struct bsg_capacity *cap);
+extern int bsg_inquiry_vpd(int fd, int page, unsigned char *buf, int len);
+extern int bsg_read_lbp(int fd, struct bsg_lbp *lbp);
+
+extern int bsg_queue_init(struct bsg_queue *q, int fd, int depth, int flags);
+extern void bsg_queue_exit(struct bsg_queue *q);
+extern void bsg_req_prep(struct bsg_req *req, int cdb_len, char *din,
+			 int din_len, char *dout, int dout_len);
+extern void bsg_req_prep_rw(struct bsg_req *req, int write, char *buf,
+			    int len, uint64_t offset,
+			    unsigned int block_size);
+extern void bsg_req_prep_rw_pi(struct bsg_req *req, int write, char *buf,
+			       int len, uint64_t offset,
+			       unsigned int block_size, int pi_type);
+extern void bsg_queue_rq(struct bsg_queue *q, struct bsg_req *req);
+extern int bsg_queue_submit(struct bsg_queue *q);
+extern int bsg_queue_reap(struct bsg_queue *q);
+extern int bsg_queue_exec(struct bsg_queue *q, struct bsg_req *req);
+
+/* NULL when depth requests are in use */
+static inline struct bsg_req *bsg_get_req(struct bsg_queue *q)
+{
+	if (!q->nr_free)
+		return NULL;
+	return q->free_reqs[--q->nr_free];
+}
+
+static inline void bsg_put_req(struct bsg_queue *q, struct bsg_req *req)
+{
+	q->free_reqs[q->nr_free++] = req;
+}
+
+/* requests queued or in flight */
+static inline int bsg_queue_busy(struct bsg_queue *q)
+{
+	return q->queued + q->inflight;
+}
+
+extern int bsg_arena_init(struct bsg_arena *a, int nr_slots, size_t slot_size,
+			  size_t align, int flags);
+extern void bsg_arena_exit(struct bsg_arena *a);
+
+static inline char *bsg_arena_slot(struct bsg_arena *a, int i)
+{
+	return a->base + (size_t)i * a->slot_size;
+}
+
+static inline void put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v);
+}
+
+static inline void put_be64(unsigned char *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+static inline uint16_t get_be16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t)get_be16(p) << 16) | get_be16(p + 2);
+}
+
+static inline uint64_t get_be64(const unsigned char *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/* an I/O that doesn't cover whole physical blocks turns into a RMW */
+static inline int bsg_phys_misaligned(struct bsg_capacity *cap,
+				      uint64_t len, uint64_t offset)
+{
+	uint64_t mask = cap->phys_block_size - 1;
+
+	offset -= cap->lowest_aligned * cap->block_size;
+
+	return (offset & mask) || (len & mask);
+}
 
 static inline int sgv4_rsp_check(struct sg_io_v4 *hdr)
 {
@@ -23,4 +296,20 @@ static inline int sgv4_rsp_check(struct sg_io_v4 *hdr)
 		return 0;
 }
 
+/* the sense key of a CHECK CONDITION, -1 without sense data */
+static inline int sgv4_sense_key(struct sg_io_v4 *hdr)
+{
+	unsigned char *sense = (unsigned char *) (unsigned long) hdr->response;
+
+	if (hdr->device_status != SAM_STAT_CHECK_CONDITION ||
+	    hdr->response_len < 3)
+		return -1;
+
+	/* descriptor format keeps it in byte 1, fixed in byte 2 */
+	if ((sense[0] & 0x7f) >= 0x72)
+		return sense[1] & 0x0f;
+
+	return sense[2] & 0x0f;
+}
+
 #endif
@@ -0,0 +1,235 @@
+/*
+ * buffer scanning functions
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "libbuf.h"
+
+#ifdef __x86_64__
+static int use_avx2;
+
+static void __attribute__((constructor)) buf_init(void)
+{
+	use_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+static int buf_is_zero_sw(const unsigned char *p, size_t len)
+{
+	uint64_t v, acc = 0;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&v, p + i, 8);
+		acc |= v;
+		/* bail out early on data, every 512 bytes */
+		if ((i & 511) == 504 && acc)
+			return 0;
+	}
+
+	for (; i < len; i++)
+		acc |= p[i];
+
+	return !acc;
+}
+
+#ifdef __x86_64__
+/* SSE2 is part of x86_64, so this is the baseline */
+static int buf_is_zero_sse2(const unsigned char *p, size_t len)
+{
+	__m128i a, zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		a = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((__m128i *)(p + i)),
+				     _mm_loadu_si128((__m128i *)(p + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((__m128i *)(p + i + 32)),
+				     _mm_loadu_si128((__m128i *)(p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) != 0xffff)
+			return 0;
+	}
+
+	return buf_is_zero_sw(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int buf_is_zero_avx2(const unsigned char *p, size_t len)
+{
+	__m256i a;
+	size_t i;
+
+	for (i = 0; i + 128 <= len; i += 128) {
+		a = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256((__m256i *)(p + i)),
+					_mm256_loadu_si256((__m256i *)(p + i + 32))),
+			_mm256_or_si256(_mm256_loadu_si256((__m256i *)(p + i + 64)),
+					_mm256_loadu_si256((__m256i *)(p + i + 96))));
+		if (!_mm256_testz_si256(a, a))
+			return 0;
+	}
+
+	return buf_is_zero_sse2(p + i, len - i);
+}
+#endif
+
+int buf_is_zero(const void *buf, size_t len)
+{
+#ifdef __x86_64__
+	if (use_avx2)
+		return buf_is_zero_avx2(buf, len);
+	return buf_is_zero_sse2(buf, len);
+#else
+	return buf_is_zero_sw(buf, len);
+#endif
+}
+
+static void buf_xor_sw(unsigned char *d, const unsigned char *s, size_t len)
+{
+	uint64_t a, b;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&a, d + i, 8);
+		memcpy(&b, s + i, 8);
+		a ^= b;
+		memcpy(d + i, &a, 8);
+	}
+
+	for (; i < len; i++)
+		d[i] ^= s[i];
+}
+
+static int buf_xor_equal_sw(const unsigned char *a, const unsigned char *b,
+			    const unsigned char *c, size_t len)
+{
+	uint64_t x, y, z, acc = 0;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		memcpy(&z, c + i, 8);
+		acc |= x ^ y ^ z;
+	}
+
+	for (; i < len; i++)
+		acc |= a[i] ^ b[i] ^ c[i];
+
+	return !acc;
+}
+
+#ifdef __x86_64__
+static void buf_xor_sse2(unsigned char *d, const unsigned char *s, size_t len)
+{
+	__m128i *dp, *sp;
+	size_t i, j;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		dp = (__m128i *)(d + i);
+		sp = (__m128i *)(s + i);
+		for (j = 0; j < 4; j++)
+			_mm_storeu_si128(dp + j,
+				_mm_xor_si128(_mm_loadu_si128(dp + j),
+					      _mm_loadu_si128(sp + j)));
+	}
+
+	buf_xor_sw(d + i, s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void buf_xor_avx2(unsigned char *d, const unsigned char *s, size_t len)
+{
+	__m256i *dp, *sp;
+	size_t i, j;
+
+	for (i = 0; i + 128 <= len; i += 128) {
+		dp = (__m256i *)(d + i);
+		sp = (__m256i *)(s + i);
+		for (j = 0; j < 4; j++)
+			_mm256_storeu_si256(dp + j,
+				_mm256_xor_si256(_mm256_loadu_si256(dp + j),
+						 _mm256_loadu_si256(sp + j)));
+	}
+
+	buf_xor_sse2(d + i, s + i, len - i);
+}
+
+static int buf_xor_equal_sse2(const unsigned char *a, const unsigned char *b,
+			      const unsigned char *c, size_t len)
+{
+	__m128i acc = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		acc = _mm_or_si128(acc, _mm_xor_si128(
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(a + i)),
+				      _mm_loadu_si128((__m128i *)(b + i))),
+			_mm_loadu_si128((__m128i *)(c + i))));
+		acc = _mm_or_si128(acc, _mm_xor_si128(
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(a + i + 16)),
+				      _mm_loadu_si128((__m128i *)(b + i + 16))),
+			_mm_loadu_si128((__m128i *)(c + i + 16))));
+	}
+
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+	    0xffff)
+		return 0;
+
+	return buf_xor_equal_sw(a + i, b + i, c + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int buf_xor_equal_avx2(const unsigned char *a, const unsigned char *b,
+			      const unsigned char *c, size_t len)
+{
+	__m256i acc = _mm256_setzero_si256();
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		acc = _mm256_or_si256(acc, _mm256_xor_si256(
+			_mm256_xor_si256(_mm256_loadu_si256((__m256i *)(a + i)),
+					 _mm256_loadu_si256((__m256i *)(b + i))),
+			_mm256_loadu_si256((__m256i *)(c + i))));
+		acc = _mm256_or_si256(acc, _mm256_xor_si256(
+			_mm256_xor_si256(_mm256_loadu_si256((__m256i *)(a + i + 32)),
+					 _mm256_loadu_si256((__m256i *)(b + i + 32))),
+			_mm256_loadu_si256((__m256i *)(c + i + 32))));
+	}
+
+	if (!_mm256_testz_si256(acc, acc))
+		return 0;
+
+	return buf_xor_equal_sse2(a + i, b + i, c + i, len - i);
+}
+#endif
+
+void buf_xor(void *dst, const void *src, size_t len)
+{
+#ifdef __x86_64__
+	if (use_avx2)
+		buf_xor_avx2(dst, src, len);
+	else
+		buf_xor_sse2(dst, src, len);
+#else
+	buf_xor_sw(dst, src, len);
+#endif
+}
+
+int buf_xor_equal(const void *a, const void *b, const void *c, size_t len)
+{
+#ifdef __x86_64__
+	if (use_avx2)
+		return buf_xor_equal_avx2(a, b, c, len);
+	return buf_xor_equal_sse2(a, b, c, len);
+#else
+	return buf_xor_equal_sw(a, b, c, len);
+#endif
+}
@@ -0,0 +1,16 @@
+#ifndef __LIBBUF_H
+#define __LIBBUF_H
+
+#include <stddef.h>
+
+/* 1 if all len bytes of buf are zero */
+extern int buf_is_zero(const void *buf, size_t len);
+
+/* dst ^= src */
+extern void buf_xor(void *dst, const void *src, size_t len);
+
+/* 1 if a ^ b is c, checks an XOR result without a scratch buffer */
+extern int buf_xor_equal(const void *a, const void *b, const void *c,
+			 size_t len);
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ * checksum functions
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#include "libcrc.h"
+
+#define CRC32C_POLY 0x82f63b78	/* reflected 0x1edc6f41 */
+#define T10DIF_POLY 0x8bb7
+
+static uint32_t crc32c_table[8][256];
+static uint16_t t10dif_table[8][256];
+static int use_sse42;
+static int use_pclmul;
+
+/* x^n mod the T10-DIF polynomial, the folding constants */
+static uint64_t t10dif_xmod(int n)
+{
+	uint32_t r = 1;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x10000 | T10DIF_POLY;
+	}
+
+	return r;
+}
+
+static uint64_t t10dif_k[4];
+
+static void __attribute__((constructor)) crc_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+
+	for (i = 0; i < 256; i++) {
+		c = i << 8;
+		for (j = 0; j < 8; j++)
+			c = (c << 1) ^ (c & 0x8000 ? T10DIF_POLY : 0);
+		t10dif_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			t10dif_table[j][i] = (t10dif_table[j - 1][i] << 8) ^
+				t10dif_table[0][t10dif_table[j - 1][i] >> 8];
+
+	/* folding 512 bits and 128 bits at a time, see crc_t10dif_pcl() */
+	t10dif_k[0] = t10dif_xmod(512);
+	t10dif_k[1] = t10dif_xmod(512 + 64);
+	t10dif_k[2] = t10dif_xmod(128);
+	t10dif_k[3] = t10dif_xmod(128 + 64);
+
+#ifdef __x86_64__
+	use_sse42 = __builtin_cpu_supports("sse4.2");
+	use_pclmul = __builtin_cpu_supports("pclmul") &&
+		__builtin_cpu_supports("ssse3");
+#endif
+}
+
+/* slicing-by-8, on the raw (not inverted) crc */
+static uint32_t crc32c_sw(uint32_t c, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		v ^= c;
+		c = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		c = (c >> 8) ^ crc32c_table[0][(c ^ *p++) & 0xff];
+
+	return c;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t c, const unsigned char *p, size_t len)
+{
+	uint64_t c64 = c, v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c64 = _mm_crc32_u64(c64, v);
+		p += 8;
+		len -= 8;
+	}
+
+	c = c64;
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+
+	return c;
+}
+
+/*
+ * The crc32 instruction has a latency of three cycles but a
+ * throughput of one, so four independent blocks keep it busy.
+ */
+__attribute__((target("sse4.2")))
+static void crc32c_hw_x4(const unsigned char *p, size_t stride, size_t len,
+			 uint32_t *crc)
+{
+	uint64_t c0 = ~0U, c1 = ~0U, c2 = ~0U, c3 = ~0U, v0, v1, v2, v3;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&v0, p + i, 8);
+		memcpy(&v1, p + stride + i, 8);
+		memcpy(&v2, p + 2 * stride + i, 8);
+		memcpy(&v3, p + 3 * stride + i, 8);
+		c0 = _mm_crc32_u64(c0, v0);
+		c1 = _mm_crc32_u64(c1, v1);
+		c2 = _mm_crc32_u64(c2, v2);
+		c3 = _mm_crc32_u64(c3, v3);
+	}
+
+	crc[0] = ~crc32c_hw(c0, p + i, len - i);
+	crc[1] = ~crc32c_hw(c1, p + stride + i, len - i);
+	crc[2] = ~crc32c_hw(c2, p + 2 * stride + i, len - i);
+	crc[3] = ~crc32c_hw(c3, p + 3 * stride + i, len - i);
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#ifdef __x86_64__
+	if (use_sse42)
+		return ~crc32c_hw(~crc, buf, len);
+#endif
+	return ~crc32c_sw(~crc, buf, len);
+}
+
+void crc32c_blocks(const void *buf, size_t stride, size_t len, int nr,
+		   uint32_t *crc)
+{
+	const unsigned char *p = buf;
+	int i = 0;
+
+#ifdef __x86_64__
+	if (use_sse42)
+		for (; i + 4 <= nr; i += 4)
+			crc32c_hw_x4(p + i * stride, stride, len, crc + i);
+#endif
+	for (; i < nr; i++)
+		crc[i] = crc32c(0, p + i * stride, len);
+}
+
+/* slicing-by-8, the crc goes into the first two bytes */
+static uint16_t crc_t10dif_sw(uint16_t c, const unsigned char *p, size_t len)
+{
+	while (len >= 8) {
+		c = t10dif_table[7][p[0] ^ (c >> 8)] ^
+			t10dif_table[6][p[1] ^ (c & 0xff)] ^
+			t10dif_table[5][p[2]] ^
+			t10dif_table[4][p[3]] ^
+			t10dif_table[3][p[4]] ^
+			t10dif_table[2][p[5]] ^
+			t10dif_table[1][p[6]] ^
+			t10dif_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		c = (c << 8) ^ t10dif_table[0][(c >> 8) ^ *p++];
+
+	return c;
+}
+
+#ifdef __x86_64__
+__attribute__((target("pclmul,ssse3")))
+static __m128i t10dif_fold(__m128i x, __m128i k, __m128i data)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+					   _mm_clmulepi64_si128(x, k, 0x00)),
+			     data);
+}
+
+/*
+ * Carry-less multiply folding. The data is taken 128 bits at a time
+ * as big endian numbers, first byte on top, and a 128 bit remainder X
+ * followed by n bits of data becomes
+ *
+ *	X_hi * (x^(n+64) mod P) + X_lo * (x^n mod P) + data
+ *
+ * which is congruent and still fits in 128 bits. Four remainders run
+ * 512 bits apart, then fold into one, and the table code reduces the
+ * last 128 bits and the tail.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint16_t crc_t10dif_pcl(uint16_t crc, const unsigned char *p,
+			       size_t len)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+					   11, 12, 13, 14, 15);
+	__m128i x0, x1, x2, x3, k;
+	unsigned char rem[16];
+
+#define T10DIF_LOAD(off) \
+	_mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(p + (off))), bswap)
+
+	x0 = T10DIF_LOAD(0);
+	x1 = T10DIF_LOAD(16);
+	x2 = T10DIF_LOAD(32);
+	x3 = T10DIF_LOAD(48);
+	x0 = _mm_xor_si128(x0, _mm_slli_si128(_mm_cvtsi32_si128(crc), 14));
+	p += 64;
+	len -= 64;
+
+	k = _mm_set_epi64x(t10dif_k[1], t10dif_k[0]);
+	while (len >= 64) {
+		x0 = t10dif_fold(x0, k, T10DIF_LOAD(0));
+		x1 = t10dif_fold(x1, k, T10DIF_LOAD(16));
+		x2 = t10dif_fold(x2, k, T10DIF_LOAD(32));
+		x3 = t10dif_fold(x3, k, T10DIF_LOAD(48));
+		p += 64;
+		len -= 64;
+	}
+
+	k = _mm_set_epi64x(t10dif_k[3], t10dif_k[2]);
+	x0 = t10dif_fold(x0, k, x1);
+	x0 = t10dif_fold(x0, k, x2);
+	x0 = t10dif_fold(x0, k, x3);
+	while (len >= 16) {
+		x0 = t10dif_fold(x0, k, T10DIF_LOAD(0));
+		p += 16;
+		len -= 16;
+	}
+#undef T10DIF_LOAD
+
+	_mm_storeu_si128((__m128i *) rem, _mm_shuffle_epi8(x0, bswap));
+
+	return crc_t10dif_sw(crc_t10dif_sw(0, rem, 16), p, len);
+}
+#endif
+
+uint16_t crc_t10dif(uint16_t crc, const void *buf, size_t len)
+{
+#ifdef __x86_64__
+	if (use_pclmul && len >= 64)
+		return crc_t10dif_pcl(crc, buf, len);
+#endif
+	return crc_t10dif_sw(crc, buf, len);
+}
@@ -0,0 +1,22 @@
+#ifndef __LIBCRC_H
+#define __LIBCRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * crc32c of nr blocks of len bytes each, stride bytes apart. The
+ * blocks are independent, so they are computed interleaved.
+ */
+extern void crc32c_blocks(const void *buf, size_t stride, size_t len, int nr,
+			  uint32_t *crc);
+
+/*
+ * CRC16 T10-DIF, the guard tag of T10 protection information:
+ * polynomial 0x8bb7, not reflected, no inversion
+ */
+extern uint16_t crc_t10dif(uint16_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,1203 @@
+/*
+ * emulated SCSI disk behind the bsg transport interface
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <scsi/scsi.h>
+
+#include "libbsg.h"
+#include "libbuf.h"
+#include "libcrc.h"
+#include "libemu.h"
+#include "libpi.h"
+
+#define EMU_DEFAULT_SIZE	(1ULL << 30)
+#define EMU_DEFAULT_QD		256
+#define EMU_NO_LBA		UINT64_MAX
+
+#ifndef DRIVER_SENSE
+#define DRIVER_SENSE		0x08
+#endif
+
+/* the data and the behaviour, shared by all the opens of a spec */
+struct emu_target {
+	char spec[PATH_MAX];
+	int refs;
+	struct emu_target *next;
+
+	int fd;			/* backing file, -1 for ram */
+	char *ram;
+	uint64_t size;
+	uint64_t nr_blocks;
+	unsigned int block_size;
+
+	/*
+	 * T10 PI tuples, T10_PI_LEN per block. They are kept inverted so
+	 * untouched pages read as the escape tuple of an unwritten block,
+	 * and in memory only, so a file backing starts without any.
+	 */
+	int pi_type;
+	unsigned char *pi;
+
+	uint64_t lat_ns;
+	int qd;
+	unsigned int err_every;
+	uint64_t err_lba;
+	unsigned long nr_media;
+};
+
+struct emu_cmd {
+	struct sg_io_v4 hdr;
+	uint64_t deadline;
+};
+
+/*
+ * One open. The fd we hand out is an eventfd that is readable while
+ * completions wait in cq, so poll and epoll work as on a bsg fd.
+ */
+struct emu_dev {
+	struct emu_target *t;
+	int fd;
+
+	pthread_mutex_t lock;
+	pthread_cond_t sq_cond;
+	pthread_cond_t cq_cond;
+	pthread_t thread;
+	int has_thread;
+	int stop;
+
+	/* both hold at most qd, that's all that can be busy */
+	struct emu_cmd *sq;
+	unsigned int sq_head, sq_tail;
+	struct sg_io_v4 *cq;
+	unsigned int cq_head, cq_tail;
+	int busy;		/* written and not read back yet */
+	int signalled;		/* the eventfd counter is non zero */
+};
+
+static struct emu_target *emu_targets;
+static pthread_mutex_t emu_targets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t emu_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void emu_wait_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static void *emu_din(struct sg_io_v4 *hdr)
+{
+	return (void *) (unsigned long) hdr->din_xferp;
+}
+
+static void *emu_dout(struct sg_io_v4 *hdr)
+{
+	return (void *) (unsigned long) hdr->dout_xferp;
+}
+
+/* fixed format sense data, nothing is transferred */
+static void emu_sense(struct sg_io_v4 *hdr, int key, int asc, int ascq)
+{
+	unsigned char sense[18];
+	unsigned int len = sizeof(sense);
+
+	memset(sense, 0, sizeof(sense));
+	sense[0] = 0x70;
+	sense[2] = key;
+	sense[7] = sizeof(sense) - 8;
+	sense[12] = asc;
+	sense[13] = ascq;
+
+	if (len > hdr->max_response_len)
+		len = hdr->max_response_len;
+	if (len)
+		memcpy((void *) (unsigned long) hdr->response, sense, len);
+
+	hdr->response_len = len;
+	hdr->device_status = SAM_STAT_CHECK_CONDITION;
+	hdr->driver_status = DRIVER_SENSE;
+	hdr->din_resid = hdr->din_xfer_len;
+	hdr->dout_resid = hdr->dout_xfer_len;
+}
+
+static void emu_invalid_field(struct sg_io_v4 *hdr)
+{
+	emu_sense(hdr, ILLEGAL_REQUEST, 0x24, 0);
+}
+
+static void emu_copy_din(struct sg_io_v4 *hdr, const void *buf,
+			 unsigned int len)
+{
+	if (len > hdr->din_xfer_len)
+		len = hdr->din_xfer_len;
+
+	memcpy(emu_din(hdr), buf, len);
+	hdr->din_resid = hdr->din_xfer_len - len;
+}
+
+static int emu_io(struct emu_target *t, int write, void *buf, uint64_t lba,
+		  uint64_t nr)
+{
+	uint64_t off = lba * t->block_size, len = nr * t->block_size;
+	char *p = buf;
+	ssize_t ret;
+
+	if (t->ram) {
+		if (write)
+			memcpy(t->ram + off, p, len);
+		else
+			memcpy(p, t->ram + off, len);
+		return 0;
+	}
+
+	while (len) {
+		if (write)
+			ret = pwrite(t->fd, p, len, off);
+		else
+			ret = pread(t->fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		/* the file was cut short under us, read the rest as zeros */
+		if (!ret) {
+			memset(p, 0, len);
+			break;
+		}
+
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void emu_pi_put(struct emu_target *t, uint64_t lba,
+		       const unsigned char *pi)
+{
+	uint64_t v;
+
+	memcpy(&v, pi, T10_PI_LEN);
+	v = ~v;
+	memcpy(t->pi + lba * T10_PI_LEN, &v, T10_PI_LEN);
+}
+
+static void emu_pi_get(struct emu_target *t, uint64_t lba, unsigned char *pi)
+{
+	uint64_t v;
+
+	memcpy(&v, t->pi + lba * T10_PI_LEN, T10_PI_LEN);
+	v = ~v;
+	memcpy(pi, &v, T10_PI_LEN);
+}
+
+/* what the device makes up for data written without WRPROTECT */
+static void emu_pi_generate(struct emu_target *t, const char *data,
+			    uint64_t lba, uint64_t nr, int same)
+{
+	unsigned char pi[T10_PI_LEN];
+	uint64_t i;
+
+	if (!t->pi)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		if (!i || !same)
+			put_be16(&pi[0], crc_t10dif(0, data + (same ? 0 : i) *
+						    t->block_size,
+						    t->block_size));
+		put_be16(&pi[2], 0);
+		put_be32(&pi[4], lba + i);
+		emu_pi_put(t, lba + i, pi);
+	}
+}
+
+static void emu_pi_clear(struct emu_target *t, uint64_t lba, uint64_t nr)
+{
+	if (t->pi)
+		memset(t->pi + lba * T10_PI_LEN, 0, nr * T10_PI_LEN);
+}
+
+/* unmapped blocks read as zeros (LBPRZ) */
+static int emu_discard(struct emu_target *t, uint64_t lba, uint64_t nr)
+{
+	uint64_t off = lba * t->block_size, len = nr * t->block_size;
+	static const char zeros[65536];
+	size_t chunk;
+	int ret;
+
+	emu_pi_clear(t, lba, nr);
+
+	if (t->ram) {
+		memset(t->ram + off, 0, len);
+		return 0;
+	}
+
+	if (!fallocate(t->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       off, len))
+		return 0;
+
+	/* no holes on this filesystem */
+	while (len) {
+		chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+		ret = pwrite(t->fd, zeros, chunk, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int emu_lba_ok(struct emu_target *t, struct sg_io_v4 *hdr,
+		      uint64_t lba, uint64_t nr)
+{
+	if (lba > t->nr_blocks || nr > t->nr_blocks - lba) {
+		emu_sense(hdr, ILLEGAL_REQUEST, 0x21, 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int emu_inject_error(struct emu_target *t, uint64_t lba, uint64_t nr)
+{
+	if (t->err_lba != EMU_NO_LBA && t->err_lba >= lba &&
+	    t->err_lba - lba < nr)
+		return 1;
+
+	return t->err_every &&
+		!(__atomic_add_fetch(&t->nr_media, 1, __ATOMIC_RELAXED) %
+		  t->err_every);
+}
+
+/*
+ * RDPROTECT/WRPROTECT 1: the tuples are checked against the data both
+ * ways, ref tags counting up from ref. Returns 0 or -EIO with the
+ * sense set.
+ */
+static int emu_rw_pi(struct emu_target *t, struct sg_io_v4 *hdr, int write,
+		     uint64_t lba, uint64_t nr, uint32_t ref)
+{
+	unsigned int bs = t->block_size, step = bs + T10_PI_LEN;
+	char *xfer = write ? emu_dout(hdr) : emu_din(hdr), *data;
+	int ret = -EIO, err, bad;
+	uint64_t i;
+
+	data = malloc(nr * bs);
+	if (!data) {
+		emu_sense(hdr, HARDWARE_ERROR, 0x55, 0x03);
+		return -EIO;
+	}
+
+	if (write) {
+		err = pi_verify(xfer, bs, nr, t->pi_type, ref, &bad);
+		if (err) {
+			emu_sense(hdr, ABORTED_COMMAND, 0x10, err);
+			goto out;
+		}
+
+		pi_strip(data, xfer, bs, nr);
+		if (emu_io(t, 1, data, lba, nr)) {
+			emu_sense(hdr, MEDIUM_ERROR, 0x0c, 0);
+			goto out;
+		}
+
+		for (i = 0; i < nr; i++)
+			emu_pi_put(t, lba + i,
+				   (unsigned char *) xfer + i * step + bs);
+	} else {
+		if (emu_io(t, 0, data, lba, nr)) {
+			emu_sense(hdr, MEDIUM_ERROR, 0x11, 0);
+			goto out;
+		}
+
+		pi_interleave(xfer, data, bs, nr);
+		for (i = 0; i < nr; i++)
+			emu_pi_get(t, lba + i,
+				   (unsigned char *) xfer + i * step + bs);
+
+		err = pi_verify(xfer, bs, nr, t->pi_type, ref, &bad);
+		if (err) {
+			emu_sense(hdr, ABORTED_COMMAND, 0x10, err);
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	free(data);
+	return ret;
+}
+
+static void emu_rw(struct emu_target *t, struct sg_io_v4 *hdr, int write,
+		   uint64_t lba, uint64_t nr, int protect, uint32_t ref)
+{
+	uint64_t len = nr * t->block_size;
+	uint32_t xfer_len = write ? hdr->dout_xfer_len : hdr->din_xfer_len;
+
+	if (!emu_lba_ok(t, hdr, lba, nr))
+		return;
+
+	if (protect) {
+		/* only 1, the one that checks everything */
+		if (!t->pi_type || protect != 1) {
+			emu_invalid_field(hdr);
+			return;
+		}
+		len = pi_xfer_len(len, t->block_size);
+	}
+
+	if (len > xfer_len) {
+		emu_invalid_field(hdr);
+		return;
+	}
+
+	if (emu_inject_error(t, lba, nr)) {
+		emu_sense(hdr, MEDIUM_ERROR, write ? 0x0c : 0x11, 0);
+		return;
+	}
+
+	if (protect) {
+		if (emu_rw_pi(t, hdr, write, lba, nr, ref))
+			return;
+	} else if (emu_io(t, write, write ? emu_dout(hdr) : emu_din(hdr),
+			  lba, nr)) {
+		emu_sense(hdr, MEDIUM_ERROR, write ? 0x0c : 0x11, 0);
+		return;
+	} else if (write)
+		emu_pi_generate(t, emu_dout(hdr), lba, nr, 0);
+
+	if (write)
+		hdr->dout_resid = xfer_len - len;
+	else
+		hdr->din_resid = xfer_len - len;
+}
+
+/* din gets the old data XOR dout, then dout is written */
+static void emu_xdwriteread(struct emu_target *t, struct sg_io_v4 *hdr,
+			    uint64_t lba, uint64_t nr)
+{
+	uint64_t len = nr * t->block_size;
+	unsigned char *din = emu_din(hdr), *dout = emu_dout(hdr);
+
+	if (!emu_lba_ok(t, hdr, lba, nr))
+		return;
+
+	if (len > hdr->din_xfer_len || len > hdr->dout_xfer_len) {
+		emu_invalid_field(hdr);
+		return;
+	}
+
+	if (emu_inject_error(t, lba, nr) || emu_io(t, 0, din, lba, nr)) {
+		emu_sense(hdr, MEDIUM_ERROR, 0x11, 0);
+		return;
+	}
+
+	buf_xor(din, dout, len);
+
+	if (emu_io(t, 1, dout, lba, nr)) {
+		emu_sense(hdr, MEDIUM_ERROR, 0x0c, 0);
+		return;
+	}
+	emu_pi_generate(t, (char *) dout, lba, nr, 0);
+
+	hdr->din_resid = hdr->din_xfer_len - len;
+	hdr->dout_resid = hdr->dout_xfer_len - len;
+}
+
+static void emu_write_same(struct emu_target *t, struct sg_io_v4 *hdr,
+			   uint64_t lba, uint64_t nr, int unmap)
+{
+	unsigned int bs = t->block_size;
+	unsigned char *block = emu_dout(hdr);
+	uint64_t i, n;
+	char *buf;
+
+	/* 0 is up to the last LBA */
+	if (!nr && lba < t->nr_blocks)
+		nr = t->nr_blocks - lba;
+
+	if (!emu_lba_ok(t, hdr, lba, nr))
+		return;
+
+	if (hdr->dout_xfer_len < bs) {
+		emu_invalid_field(hdr);
+		return;
+	}
+
+	hdr->dout_resid = hdr->dout_xfer_len - bs;
+
+	if (unmap || buf_is_zero(block, bs)) {
+		if (emu_discard(t, lba, nr))
+			emu_sense(hdr, MEDIUM_ERROR, 0x0c, 0);
+		return;
+	}
+
+	/* write the block out a chunk of copies at a time */
+	n = nr < 256 ? nr : 256;
+	buf = malloc(n * bs);
+	if (!buf) {
+		emu_sense(hdr, HARDWARE_ERROR, 0x55, 0x03);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		memcpy(buf + i * bs, block, bs);
+
+	for (i = 0; i < nr; i += n) {
+		if (n > nr - i)
+			n = nr - i;
+		if (emu_io(t, 1, buf, lba + i, n)) {
+			emu_sense(hdr, MEDIUM_ERROR, 0x0c, 0);
+			break;
+		}
+	}
+
+	emu_pi_generate(t, (char *) block, lba, i, 1);
+
+	free(buf);
+}
+
+static void emu_unmap(struct emu_target *t, struct sg_io_v4 *hdr,
+		      unsigned char *cdb)
+{
+	unsigned char *param = emu_dout(hdr);
+	unsigned int len = get_be16(&cdb[7]), off;
+	uint64_t lba;
+	uint32_t nr;
+
+	if (len > hdr->dout_xfer_len || (len && len < 8)) {
+		emu_invalid_field(hdr);
+		return;
+	}
+
+	if (len && get_be16(&param[2]) + 8 < len)
+		len = get_be16(&param[2]) + 8;
+
+	for (off = 8; off + 16 <= len; off += 16) {
+		lba = get_be64(&param[off]);
+		nr = get_be32(&param[off + 8]);
+
+		if (!emu_lba_ok(t, hdr, lba, nr))
+			return;
+
+		if (emu_discard(t, lba, nr)) {
+			emu_sense(hdr, MEDIUM_ERROR, 0x0c, 0);
+			return;
+		}
+	}
+
+	hdr->dout_resid = hdr->dout_xfer_len - get_be16(&cdb[7]);
+}
+
+static void emu_inquiry(struct emu_target *t, struct sg_io_v4 *hdr,
+			unsigned char *cdb)
+{
+	unsigned char buf[64];
+	unsigned int len;
+	uint64_t max;
+
+	memset(buf, 0, sizeof(buf));
+
+	if (!(cdb[1] & 0x01)) {
+		if (cdb[2]) {
+			emu_invalid_field(hdr);
+			return;
+		}
+
+		buf[2] = 0x06;		/* SPC-4 */
+		buf[3] = 0x02;
+		buf[4] = 36 - 5;
+		buf[5] = t->pi_type ? 0x01 : 0;	/* PROTECT */
+		buf[7] = 0x02;		/* CMDQUE */
+		memcpy(&buf[8], "SGV4    ", 8);
+		memcpy(&buf[16], "EMULATED DISK   ", 16);
+		memcpy(&buf[32], "0001", 4);
+		len = 36;
+		goto out;
+	}
+
+	buf[1] = cdb[2];
+
+	switch (cdb[2]) {
+	case 0x00:
+		buf[3] = 3;
+		buf[4] = 0x00;
+		buf[5] = VPD_BLOCK_LIMITS;
+		buf[6] = VPD_LB_PROVISIONING;
+		break;
+	case VPD_BLOCK_LIMITS:
+		max = t->nr_blocks < 0xffffffff ? t->nr_blocks : 0xffffffff;
+		buf[3] = 0x3c;
+		put_be32(&buf[20], max);	/* MAXIMUM UNMAP LBA COUNT */
+		put_be32(&buf[24], 1);		/* one descriptor */
+		put_be32(&buf[28], 1);		/* OPTIMAL UNMAP GRANULARITY */
+		buf[32] = 0x80;			/* UGAVALID, aligned at LBA 0 */
+		put_be64(&buf[36], max);	/* MAXIMUM WRITE SAME LENGTH */
+		break;
+	case VPD_LB_PROVISIONING:
+		buf[3] = 4;
+		buf[5] = 0x80 | 0x40 | 0x04;	/* LBPU, LBPWS, LBPRZ */
+		buf[6] = 0x02;			/* thin */
+		break;
+	default:
+		emu_invalid_field(hdr);
+		return;
+	}
+
+	len = get_be16(&buf[2]) + 4;
+out:
+	if (len > get_be16(&cdb[3]))
+		len = get_be16(&cdb[3]);
+	emu_copy_din(hdr, buf, len);
+}
+
+static void emu_read_capacity(struct emu_target *t, struct sg_io_v4 *hdr,
+			      unsigned char *cdb, int rc16)
+{
+	unsigned char buf[32];
+	uint64_t last = t->nr_blocks - 1;
+	unsigned int len;
+
+	memset(buf, 0, sizeof(buf));
+
+	if (rc16) {
+		put_be64(&buf[0], last);
+		put_be32(&buf[8], t->block_size);
+		buf[14] = 0x80 | 0x40;		/* LBPME, LBPRZ */
+		if (t->pi_type)			/* P_TYPE, PROT_EN */
+			buf[12] = ((t->pi_type - 1) << 1) | 0x01;
+		len = get_be32(&cdb[10]);
+		if (len > sizeof(buf))
+			len = sizeof(buf);
+	} else {
+		put_be32(&buf[0], last > 0xffffffff ? 0xffffffff : last);
+		put_be32(&buf[4], t->block_size);
+		len = 8;
+	}
+
+	emu_copy_din(hdr, buf, len);
+}
+
+static int emu_cdb_len(unsigned char *cdb)
+{
+	if (cdb[0] == VARIABLE_LENGTH_CMD)
+		return 8 + cdb[7];
+
+	switch (cdb[0] >> 5) {
+	case 0:
+		return 6;
+	case 1:
+	case 2:
+		return 10;
+	case 4:
+		return 16;
+	case 5:
+		return 12;
+	}
+
+	return BSG_CDB_MAX;
+}
+
+/* type 2 moves the tuples with the 32 byte commands only */
+static int emu_protect_ok(struct emu_target *t, struct sg_io_v4 *hdr,
+			  int protect)
+{
+	if (protect && t->pi_type == 2) {
+		emu_invalid_field(hdr);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* run one command against the target, the response goes in hdr */
+static void emu_exec(struct emu_target *t, struct sg_io_v4 *hdr)
+{
+	unsigned char *cdb = (unsigned char *) (unsigned long) hdr->request;
+	uint64_t lba, nr;
+
+	hdr->driver_status = hdr->transport_status = hdr->device_status = 0;
+	hdr->response_len = 0;
+	hdr->din_resid = hdr->dout_resid = 0;
+	hdr->info = 0;
+
+	if (hdr->request_len < 6 || (int) hdr->request_len < emu_cdb_len(cdb)) {
+		emu_invalid_field(hdr);
+		return;
+	}
+
+	switch (cdb[0]) {
+	case TEST_UNIT_READY:
+		break;
+	case INQUIRY:
+		emu_inquiry(t, hdr, cdb);
+		break;
+	case READ_CAPACITY:
+		emu_read_capacity(t, hdr, cdb, 0);
+		break;
+	case SERVICE_ACTION_IN_16:
+		if ((cdb[1] & 0x1f) != SAI_READ_CAPACITY_16)
+			goto invalid_opcode;
+		emu_read_capacity(t, hdr, cdb, 1);
+		break;
+	case READ_6:
+	case WRITE_6:
+		lba = ((cdb[1] & 0x1f) << 16) | get_be16(&cdb[2]);
+		nr = cdb[4] ? cdb[4] : 256;
+		emu_rw(t, hdr, cdb[0] == WRITE_6, lba, nr, 0, lba);
+		break;
+	case READ_10:
+	case WRITE_10:
+		lba = get_be32(&cdb[2]);
+		if (!emu_protect_ok(t, hdr, cdb[1] >> 5))
+			break;
+		emu_rw(t, hdr, cdb[0] == WRITE_10, lba, get_be16(&cdb[7]),
+		       cdb[1] >> 5, lba);
+		break;
+	case READ_16:
+	case WRITE_16:
+		lba = get_be64(&cdb[2]);
+		if (!emu_protect_ok(t, hdr, cdb[1] >> 5))
+			break;
+		emu_rw(t, hdr, cdb[0] == WRITE_16, lba, get_be32(&cdb[10]),
+		       cdb[1] >> 5, lba);
+		break;
+	case XDWRITEREAD_10:
+		emu_xdwriteread(t, hdr, get_be32(&cdb[2]), get_be16(&cdb[7]));
+		break;
+	case VARIABLE_LENGTH_CMD:
+		switch (get_be16(&cdb[8])) {
+		case XDWRITEREAD_32:
+			emu_xdwriteread(t, hdr, get_be64(&cdb[12]),
+					get_be32(&cdb[28]));
+			break;
+		case READ_32:
+		case WRITE_32:
+			if (t->pi_type != 2)
+				goto invalid_opcode;
+			emu_rw(t, hdr, get_be16(&cdb[8]) == WRITE_32,
+			       get_be64(&cdb[12]), get_be32(&cdb[28]),
+			       cdb[10] >> 5, get_be32(&cdb[20]));
+			break;
+		default:
+			goto invalid_opcode;
+		}
+		break;
+	case WRITE_SAME_16:
+		emu_write_same(t, hdr, get_be64(&cdb[2]), get_be32(&cdb[10]),
+			       cdb[1] & 0x08);
+		break;
+	case UNMAP:
+		emu_unmap(t, hdr, cdb);
+		break;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		if (t->fd >= 0 && fdatasync(t->fd))
+			emu_sense(hdr, MEDIUM_ERROR, 0x0c, 0);
+		break;
+	default:
+		goto invalid_opcode;
+	}
+
+	return;
+
+invalid_opcode:
+	emu_sense(hdr, ILLEGAL_REQUEST, 0x20, 0);
+}
+
+/* what the kernel refuses before a command gets anywhere */
+static int emu_check_hdr(const struct sg_io_v4 *hdr)
+{
+	if (hdr->guard != 'Q' || hdr->protocol != BSG_PROTOCOL_SCSI ||
+	    hdr->subprotocol != BSG_SUB_PROTOCOL_SCSI_CMD)
+		return -EINVAL;
+
+	/* nothing here builds iovecs */
+	if (hdr->din_iovec_count || hdr->dout_iovec_count)
+		return -EINVAL;
+
+	if (hdr->request_len > BSG_CDB_MAX)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int emu_nonblock(struct emu_dev *dev)
+{
+	int fl = fcntl(dev->fd, F_GETFL);
+
+	return fl >= 0 && (fl & O_NONBLOCK);
+}
+
+/* called with the lock held */
+static void emu_complete(struct emu_dev *dev, struct sg_io_v4 *hdr)
+{
+	dev->cq[dev->cq_tail++ % dev->t->qd] = *hdr;
+
+	if (!dev->signalled) {
+		dev->signalled = 1;
+		eventfd_write(dev->fd, 1);
+	}
+
+	pthread_cond_broadcast(&dev->cq_cond);
+}
+
+/*
+ * Commands with a latency run here, in order. Every command waits for
+ * its own deadline, so a queue of them completes at the rate they were
+ * submitted, not one latency after another.
+ */
+static void *emu_thread(void *arg)
+{
+	struct emu_dev *dev = arg;
+	struct emu_cmd cmd;
+
+	pthread_mutex_lock(&dev->lock);
+	for (;;) {
+		while (dev->sq_head == dev->sq_tail && !dev->stop)
+			pthread_cond_wait(&dev->sq_cond, &dev->lock);
+		if (dev->stop)
+			break;
+
+		cmd = dev->sq[dev->sq_head++ % dev->t->qd];
+		pthread_mutex_unlock(&dev->lock);
+
+		emu_exec(dev->t, &cmd.hdr);
+		emu_wait_until(cmd.deadline);
+
+		pthread_mutex_lock(&dev->lock);
+		emu_complete(dev, &cmd.hdr);
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return NULL;
+}
+
+/* like bsg, a full queue is EAGAIN whether the fd blocks or not */
+static int emu_write(void *priv, const struct sg_io_v4 *hdrs, int nr)
+{
+	struct emu_dev *dev = priv;
+	struct emu_target *t = dev->t;
+	struct sg_io_v4 hdr;
+	struct emu_cmd *cmd;
+	uint64_t now = 0;
+	int i, ret;
+
+	if (t->lat_ns)
+		now = emu_now_ns();
+
+	pthread_mutex_lock(&dev->lock);
+	for (i = 0; i < nr; i++) {
+		ret = emu_check_hdr(&hdrs[i]);
+		if (ret || dev->busy == t->qd) {
+			if (!ret)
+				ret = -EAGAIN;
+			break;
+		}
+
+		dev->busy++;
+
+		if (t->lat_ns) {
+			cmd = &dev->sq[dev->sq_tail++ % t->qd];
+			cmd->hdr = hdrs[i];
+			cmd->deadline = now + t->lat_ns;
+			pthread_cond_signal(&dev->sq_cond);
+			continue;
+		}
+
+		hdr = hdrs[i];
+		pthread_mutex_unlock(&dev->lock);
+		emu_exec(t, &hdr);
+		pthread_mutex_lock(&dev->lock);
+		emu_complete(dev, &hdr);
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return i ? i : ret;
+}
+
+/*
+ * Non-blocking reads return what's done, blocking ones wait for nr
+ * completions or for everything that was written.
+ */
+static int emu_read(void *priv, struct sg_io_v4 *hdrs, int nr)
+{
+	struct emu_dev *dev = priv;
+	int i, done, nonblock, qd = dev->t->qd;
+	eventfd_t cnt;
+
+	nonblock = emu_nonblock(dev);
+
+	pthread_mutex_lock(&dev->lock);
+
+	if (!nonblock)
+		while ((int) (dev->cq_tail - dev->cq_head) < nr &&
+		       (int) (dev->cq_tail - dev->cq_head) < dev->busy)
+			pthread_cond_wait(&dev->cq_cond, &dev->lock);
+
+	done = dev->cq_tail - dev->cq_head;
+	if (done > nr)
+		done = nr;
+
+	for (i = 0; i < done; i++)
+		hdrs[i] = dev->cq[dev->cq_head++ % qd];
+	dev->busy -= done;
+
+	/* the counter is non zero, so this doesn't block */
+	if (dev->cq_head == dev->cq_tail && dev->signalled) {
+		dev->signalled = 0;
+		eventfd_read(dev->fd, &cnt);
+	}
+
+	pthread_mutex_unlock(&dev->lock);
+
+	if (!done && nonblock)
+		return -EAGAIN;
+
+	return done;
+}
+
+static int emu_sg_io(void *priv, struct sg_io_v4 *hdr)
+{
+	struct emu_dev *dev = priv;
+	uint64_t start = emu_now_ns();
+	int ret;
+
+	ret = emu_check_hdr(hdr);
+	if (ret)
+		return ret;
+
+	emu_exec(dev->t, hdr);
+	if (dev->t->lat_ns)
+		emu_wait_until(start + dev->t->lat_ns);
+
+	hdr->duration = (emu_now_ns() - start) / 1000000;
+
+	return 0;
+}
+
+static void emu_put_target(struct emu_target *t)
+{
+	struct emu_target **p;
+
+	pthread_mutex_lock(&emu_targets_lock);
+	if (--t->refs) {
+		pthread_mutex_unlock(&emu_targets_lock);
+		return;
+	}
+
+	for (p = &emu_targets; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&emu_targets_lock);
+
+	if (t->ram)
+		munmap(t->ram, t->size);
+	if (t->pi)
+		munmap(t->pi, t->nr_blocks * T10_PI_LEN);
+	if (t->fd >= 0)
+		close(t->fd);
+	free(t);
+}
+
+static void emu_close(void *priv)
+{
+	struct emu_dev *dev = priv;
+
+	if (dev->has_thread) {
+		pthread_mutex_lock(&dev->lock);
+		dev->stop = 1;
+		pthread_cond_signal(&dev->sq_cond);
+		pthread_mutex_unlock(&dev->lock);
+		pthread_join(dev->thread, NULL);
+	}
+
+	close(dev->fd);
+	emu_put_target(dev->t);
+	pthread_mutex_destroy(&dev->lock);
+	pthread_cond_destroy(&dev->sq_cond);
+	pthread_cond_destroy(&dev->cq_cond);
+	free(dev->sq);
+	free(dev->cq);
+	free(dev);
+}
+
+static const struct bsg_transport emu_transport = {
+	.name = "emu",
+	.write = emu_write,
+	.read = emu_read,
+	.sg_io = emu_sg_io,
+	.close = emu_close,
+};
+
+static int emu_parse_u64(const char *str, uint64_t *v)
+{
+	char *p;
+
+	errno = 0;
+	*v = strtoull(str, &p, 0);
+	if (errno || p == str)
+		return -EINVAL;
+
+	switch (*p) {
+	case 't':
+		*v <<= 10;
+		/* fall through */
+	case 'g':
+		*v <<= 10;
+		/* fall through */
+	case 'm':
+		*v <<= 10;
+		/* fall through */
+	case 'k':
+		*v <<= 10;
+		p++;
+		break;
+	}
+
+	return *p ? -EINVAL : 0;
+}
+
+static int emu_parse(struct emu_target *t, const char *spec, char *backing,
+		     uint64_t *size)
+{
+	char buf[PATH_MAX], *opt, *val, *save;
+	uint64_t v;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+
+	opt = strtok_r(buf, ",", &save);
+	if (!opt)
+		return -EINVAL;
+	snprintf(backing, PATH_MAX, "%s", opt);
+
+	while ((opt = strtok_r(NULL, ",", &save))) {
+		val = strchr(opt, '=');
+		if (!val || emu_parse_u64(val + 1, &v))
+			goto bad;
+		*val = 0;
+
+		if (!strcmp(opt, "size"))
+			*size = v;
+		else if (!strcmp(opt, "bs"))
+			t->block_size = v;
+		else if (!strcmp(opt, "lat"))
+			t->lat_ns = v * 1000;
+		else if (!strcmp(opt, "qd"))
+			t->qd = v;
+		else if (!strcmp(opt, "err"))
+			t->err_every = v;
+		else if (!strcmp(opt, "errlba"))
+			t->err_lba = v;
+		else if (!strcmp(opt, "pi") && v <= 3)
+			t->pi_type = v;
+		else
+			goto bad;
+	}
+
+	if (!t->block_size || (t->block_size & (t->block_size - 1)) ||
+	    t->block_size % SECTOR_SIZE || t->qd <= 0) {
+		fprintf(stderr, "emu: bad block size or queue depth\n");
+		return -EINVAL;
+	}
+
+	return 0;
+bad:
+	fprintf(stderr, "emu: bad option %s\n", opt);
+	return -EINVAL;
+}
+
+static int emu_setup_backing(struct emu_target *t, const char *backing,
+			     uint64_t size)
+{
+	struct stat st;
+
+	if (!strcmp(backing, "ram")) {
+		t->size = size ? size : EMU_DEFAULT_SIZE;
+		/* untouched pages stay unallocated, like a sparse file */
+		t->ram = mmap(NULL, t->size, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			      -1, 0);
+		if (t->ram == MAP_FAILED) {
+			t->ram = NULL;
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	t->fd = open(backing, O_RDWR | O_CREAT, 0644);
+	if (t->fd < 0)
+		return -errno;
+
+	if (fstat(t->fd, &st))
+		return -errno;
+
+	t->size = size ? size : st.st_size;
+	if (!t->size)
+		t->size = EMU_DEFAULT_SIZE;
+
+	if ((uint64_t) st.st_size < t->size && ftruncate(t->fd, t->size))
+		return -errno;
+
+	return 0;
+}
+
+static struct emu_target *emu_get_target(const char *spec, int *err)
+{
+	struct emu_target *t;
+	char backing[PATH_MAX];
+	uint64_t size = 0;
+	int ret;
+
+	pthread_mutex_lock(&emu_targets_lock);
+
+	for (t = emu_targets; t; t = t->next) {
+		if (!strcmp(t->spec, spec)) {
+			t->refs++;
+			goto out;
+		}
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		*err = -ENOMEM;
+		goto out;
+	}
+
+	snprintf(t->spec, sizeof(t->spec), "%s", spec);
+	t->refs = 1;
+	t->fd = -1;
+	t->block_size = SECTOR_SIZE;
+	t->qd = EMU_DEFAULT_QD;
+	t->err_lba = EMU_NO_LBA;
+
+	ret = emu_parse(t, spec, backing, &size);
+	if (!ret)
+		ret = emu_setup_backing(t, backing, size);
+	if (!ret && t->size < t->block_size)
+		ret = -EINVAL;
+	if (ret) {
+		if (t->fd >= 0)
+			close(t->fd);
+		free(t);
+		t = NULL;
+		*err = ret;
+		goto out;
+	}
+
+	t->nr_blocks = t->size / t->block_size;
+	if (t->pi_type) {
+		t->pi = mmap(NULL, t->nr_blocks * T10_PI_LEN,
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			     -1, 0);
+		if (t->pi == MAP_FAILED) {
+			if (t->ram)
+				munmap(t->ram, t->size);
+			if (t->fd >= 0)
+				close(t->fd);
+			free(t);
+			t = NULL;
+			*err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	t->next = emu_targets;
+	emu_targets = t;
+out:
+	pthread_mutex_unlock(&emu_targets_lock);
+
+	return t;
+}
+
+int emu_open(const char *spec)
+{
+	struct emu_dev *dev;
+	struct emu_target *t;
+	int ret = 0;
+
+	t = emu_get_target(spec, &ret);
+	if (!t)
+		return ret;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		emu_put_target(t);
+		return -ENOMEM;
+	}
+
+	dev->t = t;
+	pthread_mutex_init(&dev->lock, NULL);
+	pthread_cond_init(&dev->sq_cond, NULL);
+	pthread_cond_init(&dev->cq_cond, NULL);
+
+	dev->sq = calloc(t->qd, sizeof(*dev->sq));
+	dev->cq = calloc(t->qd, sizeof(*dev->cq));
+	dev->fd = eventfd(0, EFD_CLOEXEC);
+	if (!dev->sq || !dev->cq || dev->fd < 0) {
+		ret = dev->fd < 0 ? -errno : -ENOMEM;
+		goto free_dev;
+	}
+
+	if (t->lat_ns) {
+		ret = -pthread_create(&dev->thread, NULL, emu_thread, dev);
+		if (ret)
+			goto free_dev;
+		dev->has_thread = 1;
+	}
+
+	ret = bsg_transport_register(dev->fd, &emu_transport, dev);
+	if (ret) {
+		emu_close(dev);
+		return ret;
+	}
+
+	return dev->fd;
+
+free_dev:
+	if (dev->fd >= 0)
+		close(dev->fd);
+	free(dev->sq);
+	free(dev->cq);
+	free(dev);
+	emu_put_target(t);
+	return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef __LIBEMU_H
+#define __LIBEMU_H
+
+/*
+ * An emulated SCSI disk that the tools can open in place of a bsg
+ * device, "emu:<backing>[,option=value...]":
+ *
+ *   backing    "ram", or a file that is created sparse if needed
+ *   size=      capacity, with a k/m/g/t suffix. Default: the size of
+ *              the file, 1g for ram or a new file
+ *   bs=        logical block size. Default: 512
+ *   lat=       completion latency of every command in usec. 0 runs
+ *              the commands in the submitting thread. Default: 0
+ *   qd=        commands queued per open before write() gets EAGAIN.
+ *              Default: 256
+ *   err=       fail every Nth READ/WRITE with a MEDIUM ERROR
+ *   errlba=    fail every READ/WRITE that covers this LBA
+ *   pi=        format with T10 PI of type 1, 2 or 3. RDPROTECT and
+ *              WRPROTECT 1 are checked, type 2 takes them on the
+ *              32 byte commands only. Default: 0
+ *
+ * Opens of the same spec share the data, each open gets its own queue.
+ */
+#define EMU_PREFIX	"emu:"
+
+extern int emu_open(const char *spec);
+
+#endif
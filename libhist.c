@@ -0,0 +1,132 @@
+/*
+ * latency histogram functions
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libhist.h"
+
+void hist_init(struct lat_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void hist_merge(struct lat_hist *dst, struct lat_hist *src)
+{
+	int i;
+
+	if (!src->nr)
+		return;
+
+	dst->nr += src->nr;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+
+	for (i = 0; i < HIST_NR; i++)
+		dst->bucket[i] += src->bucket[i];
+}
+
+static uint64_t hist_lower(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < HIST_SUB_NR)
+		return idx;
+
+	shift = (idx >> HIST_SUB_BITS) - 1;
+
+	return (uint64_t)(HIST_SUB_NR + (idx & (HIST_SUB_NR - 1))) << shift;
+}
+
+static uint64_t hist_width(unsigned int idx)
+{
+	if (idx < HIST_SUB_NR)
+		return 1;
+
+	return 1ULL << ((idx >> HIST_SUB_BITS) - 1);
+}
+
+/*
+ * dst = a - b, for the samples recorded between two snapshots of the
+ * same histogram. min and max are only known to bucket precision.
+ */
+void hist_sub(struct lat_hist *dst, struct lat_hist *a, struct lat_hist *b)
+{
+	int i;
+
+	hist_init(dst);
+
+	for (i = 0; i < HIST_NR; i++) {
+		dst->bucket[i] = a->bucket[i] - b->bucket[i];
+		if (!dst->bucket[i])
+			continue;
+
+		dst->nr += dst->bucket[i];
+		if (dst->min == UINT64_MAX)
+			dst->min = hist_lower(i);
+		dst->max = hist_lower(i) + hist_width(i) - 1;
+	}
+
+	dst->sum = a->sum - b->sum;
+}
+
+/* the middle of the bucket, clamped to the recorded min and max */
+static uint64_t hist_value(struct lat_hist *h, unsigned int idx)
+{
+	uint64_t v;
+
+	v = hist_lower(idx) + (hist_width(idx) >> 1);
+
+	if (v < h->min)
+		v = h->min;
+	if (v > h->max)
+		v = h->max;
+
+	return v;
+}
+
+uint64_t hist_percentile(struct lat_hist *h, double pct)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!h->nr)
+		return 0;
+
+	rank = (uint64_t)(h->nr * pct / 100.0);
+	if (rank >= h->nr)
+		rank = h->nr - 1;
+
+	for (i = 0; i < HIST_NR; i++) {
+		seen += h->bucket[i];
+		if (seen > rank)
+			return hist_value(h, i);
+	}
+
+	return h->max;
+}
+
+void hist_print(FILE *fp, const char *prefix, struct lat_hist *h)
+{
+	if (!h->nr) {
+		fprintf(fp, "%slatency : none\n", prefix);
+		return;
+	}
+
+	fprintf(fp, "%slatency min/mean/max : %.1f / %.1f / %.1f [us]\n",
+		prefix, h->min / 1000.0, (double)h->sum / h->nr / 1000.0,
+		h->max / 1000.0);
+	fprintf(fp, "%slatency p50/p99/p99.9/p99.99 : %.1f / %.1f / %.1f / %.1f [us]\n",
+		prefix,
+		hist_percentile(h, 50) / 1000.0,
+		hist_percentile(h, 99) / 1000.0,
+		hist_percentile(h, 99.9) / 1000.0,
+		hist_percentile(h, 99.99) / 1000.0);
+}
@@ -0,0 +1,70 @@
+#ifndef __LIBHIST_H
+#define __LIBHIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Log-linear latency histogram: values below HIST_SUB_NR get a bucket
+ * each, every power of two above that is split into HIST_SUB_NR
+ * linear buckets, so the relative error is below 1/HIST_SUB_NR.
+ * Values are nanoseconds and saturate at HIST_MAX_BITS (~18 minutes).
+ */
+#define HIST_SUB_BITS	6
+#define HIST_SUB_NR	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS	40
+#define HIST_NR		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_NR)
+
+struct lat_hist {
+	uint64_t nr;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[HIST_NR];
+};
+
+static inline uint64_t lat_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB_NR)
+		return v;
+
+	if (v >= (1ULL << HIST_MAX_BITS))
+		return HIST_NR - 1;
+
+	e = 63 - __builtin_clzll(v);
+
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_NR - 1));
+}
+
+static inline void hist_record(struct lat_hist *h, uint64_t v)
+{
+	h->nr++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->bucket[hist_index(v)]++;
+}
+
+extern void hist_init(struct lat_hist *h);
+extern void hist_merge(struct lat_hist *dst, struct lat_hist *src);
+extern void hist_sub(struct lat_hist *dst, struct lat_hist *a,
+		     struct lat_hist *b);
+extern uint64_t hist_percentile(struct lat_hist *h, double pct);
+extern void hist_print(FILE *fp, const char *prefix, struct lat_hist *h);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * T10 protection information functions
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "libbsg.h"
+#include "libcrc.h"
+#include "libpi.h"
+
+static int pi_escape(const unsigned char *pi, int type)
+{
+	if (get_be16(&pi[2]) != T10_PI_APP_ESCAPE)
+		return 0;
+
+	return type != 3 || get_be32(&pi[4]) == T10_PI_REF_ESCAPE;
+}
+
+/* the ref tag counts up from ref_tag for types 1 and 2 */
+void pi_generate(char *buf, unsigned int block_size, int nr, int type,
+		 uint32_t ref_tag, uint16_t app_tag)
+{
+	unsigned char *pi;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		pi = (unsigned char *) buf + block_size;
+		put_be16(&pi[0], crc_t10dif(0, buf, block_size));
+		put_be16(&pi[2], app_tag);
+		put_be32(&pi[4], type == 3 ? ref_tag : ref_tag + i);
+		buf += block_size + T10_PI_LEN;
+	}
+}
+
+/*
+ * Returns 0, or T10_PI_GUARD_ERR or T10_PI_REF_ERR for the first bad
+ * block, its index in *bad. Type 3 ref tags aren't checked.
+ */
+int pi_verify(const char *buf, unsigned int block_size, int nr, int type,
+	      uint32_t ref_tag, int *bad)
+{
+	const unsigned char *pi;
+	int i;
+
+	for (i = 0; i < nr; i++, buf += block_size + T10_PI_LEN) {
+		pi = (const unsigned char *) buf + block_size;
+		if (pi_escape(pi, type))
+			continue;
+
+		if (get_be16(&pi[0]) != crc_t10dif(0, buf, block_size)) {
+			*bad = i;
+			return T10_PI_GUARD_ERR;
+		}
+
+		if (type != 3 && get_be32(&pi[4]) != ref_tag + i) {
+			*bad = i;
+			return T10_PI_REF_ERR;
+		}
+	}
+
+	return 0;
+}
+
+/* the data moves to another LBA, the guards stay */
+void pi_remap_ref(char *buf, unsigned int block_size, int nr, int type,
+		  uint32_t ref_tag)
+{
+	unsigned char *pi;
+	int i;
+
+	if (type == 3)
+		return;
+
+	for (i = 0; i < nr; i++) {
+		pi = (unsigned char *) buf + block_size;
+		if (!pi_escape(pi, type))
+			put_be32(&pi[4], ref_tag + i);
+		buf += block_size + T10_PI_LEN;
+	}
+}
+
+/* plain data to the interleaved layout, the tuples are left alone */
+void pi_interleave(char *dst, const char *src, unsigned int block_size,
+		   int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		memcpy(dst, src, block_size);
+		dst += block_size + T10_PI_LEN;
+		src += block_size;
+	}
+}
+
+void pi_strip(char *dst, const char *src, unsigned int block_size, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		memcpy(dst, src, block_size);
+		dst += block_size;
+		src += block_size + T10_PI_LEN;
+	}
+}
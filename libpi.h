@@ -0,0 +1,46 @@
+#ifndef __LIBPI_H
+#define __LIBPI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * T10 protection information. On a device formatted with it every
+ * logical block carries an 8 byte tuple, and a READ or WRITE with
+ * RDPROTECT/WRPROTECT set moves the tuples along with the data,
+ * interleaved: block_size bytes of data, its tuple, the next block.
+ *
+ *   guard    CRC16 T10-DIF of the data
+ *   app tag  ours, nobody checks it here
+ *   ref tag  types 1 and 2: the low 32 bits of the LBA. Type 3: ours
+ *
+ * All of it is big endian. A tuple with the app tag all ones (and for
+ * type 3 the ref tag too) is never checked, that's what unwritten
+ * blocks read as.
+ */
+#define T10_PI_LEN		8
+#define T10_PI_APP_ESCAPE	0xffff
+#define T10_PI_REF_ESCAPE	0xffffffff
+
+/* what pi_verify() found, the ASCQs of ASC 10h */
+#define T10_PI_GUARD_ERR	0x01
+#define T10_PI_REF_ERR		0x03
+
+/* the transfer length of len bytes of data with their tuples */
+static inline size_t pi_xfer_len(size_t len, unsigned int block_size)
+{
+	return len / block_size * (block_size + T10_PI_LEN);
+}
+
+extern void pi_generate(char *buf, unsigned int block_size, int nr,
+			int type, uint32_t ref_tag, uint16_t app_tag);
+extern int pi_verify(const char *buf, unsigned int block_size, int nr,
+		     int type, uint32_t ref_tag, int *bad);
+extern void pi_remap_ref(char *buf, unsigned int block_size, int nr,
+			 int type, uint32_t ref_tag);
+extern void pi_interleave(char *dst, const char *src, unsigned int block_size,
+			  int nr);
+extern void pi_strip(char *dst, const char *src, unsigned int block_size,
+		     int nr);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * minimal io_uring without liburing
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "libring.h"
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+int io_ring_init(struct io_ring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->sq_entries = p.sq_entries;
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_len > r->sq_map_len)
+			r->sq_map_len = r->cq_map_len;
+		r->cq_map_len = 0;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto fail;
+
+	if (r->cq_map_len) {
+		r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto fail;
+	} else
+		r->cq_map = r->sq_map;
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_map;
+	r->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	r->sqe_tail = *r->sq_tail;
+
+	cq = r->cq_map;
+	r->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return 0;
+fail:
+	ret = -errno;
+	io_ring_exit(r);
+	return ret;
+}
+
+void io_ring_exit(struct io_ring *r)
+{
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	if (r->sq_map && r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_map_len);
+	if (r->fd > 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+}
+
+int io_ring_register_buffers(struct io_ring *r, struct iovec *iov,
+			     unsigned int nr)
+{
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+		    iov, nr))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * hand everything from io_ring_get_sqe to the kernel and wait until
+ * wait_nr completions are there, in one syscall
+ */
+int io_ring_submit_wait(struct io_ring *r, unsigned int wait_nr)
+{
+	unsigned int tail = *r->sq_tail, mask = *r->sq_mask;
+	unsigned int nr = r->sqe_tail - tail;
+	int ret;
+
+	if (!nr && !wait_nr)
+		return 0;
+
+	for (; tail != r->sqe_tail; tail++)
+		r->sq_array[tail & mask] = tail & mask;
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+	ret = io_uring_enter(r->fd, nr, wait_nr,
+			     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+int io_ring_submit(struct io_ring *r)
+{
+	return io_ring_submit_wait(r, 0);
+}
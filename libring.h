@@ -0,0 +1,86 @@
+#ifndef __LIBRING_H
+#define __LIBRING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Just enough io_uring to drive a handful of file reads and writes
+ * next to bsg commands: one ring, fixed buffers, no SQPOLL.
+ */
+struct io_ring {
+	int fd;
+	unsigned int sq_entries;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	/* entries handed out by io_ring_get_sqe, not submitted yet */
+	unsigned int sqe_tail;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+extern int io_ring_init(struct io_ring *r, unsigned int entries);
+extern void io_ring_exit(struct io_ring *r);
+extern int io_ring_register_buffers(struct io_ring *r, struct iovec *iov,
+				    unsigned int nr);
+extern int io_ring_submit(struct io_ring *r);
+extern int io_ring_submit_wait(struct io_ring *r, unsigned int wait_nr);
+
+/* NULL when the submission queue is full */
+static inline struct io_uring_sqe *io_ring_get_sqe(struct io_ring *r)
+{
+	unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (r->sqe_tail - head >= r->sq_entries)
+		return NULL;
+
+	sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+	r->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static inline void io_ring_prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+				   void *addr, unsigned int len,
+				   uint64_t offset, int buf_index,
+				   uint64_t user_data)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) addr;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = buf_index;
+	sqe->user_data = user_data;
+}
+
+/* NULL when there is no completion to reap */
+static inline struct io_uring_cqe *io_ring_peek_cqe(struct io_ring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void io_ring_cqe_seen(struct io_ring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
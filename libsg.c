@@ -0,0 +1,198 @@
+/*
+ * sg v2/v3 lib functions
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <scsi/scsi.h>
+#include <scsi/sg.h>
+
+#include "libbsg.h"
+#include "libsg.h"
+
+/*
+ * Send the command in buf; for a write the data is already at
+ * sgv2_dout(). Returns 0 or -errno, a short write is -EIO.
+ */
+int sgv2_send(int fd, char *buf, unsigned char *cdb, int cdb_len,
+	      int dout_len, int din_len, int pack_id)
+{
+	struct sg_header *hdr = (struct sg_header *) buf;
+	int len = sizeof(*hdr) + cdb_len + dout_len;
+	int ret;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->reply_len = sizeof(*hdr) + din_len;
+	hdr->pack_id = pack_id;
+	hdr->twelve_byte = cdb_len == 12;
+	memcpy(buf + sizeof(*hdr), cdb, cdb_len);
+
+	ret = write(fd, buf, len);
+	if (ret < 0)
+		return -errno;
+
+	return ret == len ? 0 : -EIO;
+}
+
+/*
+ * Read back a reply, the one for pack_id unless that is -1 (with
+ * SG_SET_FORCE_PACK_ID on). The data in lands at sgv2_din().
+ */
+int sgv2_recv(int fd, char *buf, int din_len, int *pack_id)
+{
+	struct sg_header *hdr = (struct sg_header *) buf;
+	int ret;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->pack_id = pack_id ? *pack_id : -1;
+	hdr->reply_len = sizeof(*hdr) + din_len;
+
+	ret = read(fd, buf, sizeof(*hdr) + din_len);
+	if (ret < 0)
+		return -errno;
+	if (ret < (int) sizeof(*hdr))
+		return -EIO;
+
+	if (pack_id)
+		*pack_id = hdr->pack_id;
+
+	return ret - sizeof(*hdr);
+}
+
+/* 1 once a reply is waiting on fd, 0 if none turns up in timeout ms */
+int sgv2_ready(int fd, int timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int ret;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret < 0)
+		return -errno;
+
+	return ret && (pfd.revents & POLLIN);
+}
+
+int sgv2_check(char *buf)
+{
+	struct sg_header *hdr = (struct sg_header *) buf;
+
+	return hdr->result || hdr->target_status || hdr->host_status ||
+		(hdr->driver_status & 0xf);
+}
+
+void sgv3_setup_hdr(struct sg_io_hdr *hdr, unsigned char *cdb, int cdb_len,
+		    unsigned char *sense, int sense_len, int dir, void *buf,
+		    int len)
+{
+	memset(hdr, 0, sizeof(*hdr));
+
+	hdr->interface_id = 'S';
+	hdr->cmdp = cdb;
+	hdr->cmd_len = cdb_len;
+	hdr->sbp = sense;
+	hdr->mx_sb_len = sense_len;
+	hdr->dxfer_direction = len ? dir : SG_DXFER_NONE;
+	hdr->dxferp = buf;
+	hdr->dxfer_len = len;
+}
+
+int sgv3_check(struct sg_io_hdr *hdr)
+{
+	return (hdr->info & SG_INFO_OK_MASK) != SG_INFO_OK || hdr->resid;
+}
+
+int sgv3_exec(int fd, struct sg_io_hdr *hdr)
+{
+	if (ioctl(fd, SG_IO, hdr))
+		return -errno;
+
+	return 0;
+}
+
+/* READ CAPACITY(16), (10) for devices without it */
+int sgv3_read_capacity(int fd, uint64_t *nr_blocks, uint32_t *block_size)
+{
+	unsigned char cdb[16], sense[SGV3_SENSE_LEN], buf[32];
+	struct sg_io_hdr hdr;
+	int ret;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SERVICE_ACTION_IN_16;
+	cdb[1] = SAI_READ_CAPACITY_16;
+	put_be32(&cdb[10], sizeof(buf));
+
+	sgv3_setup_hdr(&hdr, cdb, 16, sense, sizeof(sense),
+		       SG_DXFER_FROM_DEV, buf, sizeof(buf));
+	ret = sgv3_exec(fd, &hdr);
+	if (ret)
+		return ret;
+
+	if ((hdr.info & SG_INFO_OK_MASK) == SG_INFO_OK &&
+	    sizeof(buf) - hdr.resid >= 12) {
+		*nr_blocks = get_be64(&buf[0]) + 1;
+		*block_size = get_be32(&buf[8]);
+		return 0;
+	}
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = READ_CAPACITY;
+
+	sgv3_setup_hdr(&hdr, cdb, 10, sense, sizeof(sense),
+		       SG_DXFER_FROM_DEV, buf, 8);
+	ret = sgv3_exec(fd, &hdr);
+	if (ret)
+		return ret;
+	if (sgv3_check(&hdr))
+		return -EIO;
+
+	*nr_blocks = (uint64_t) get_be32(&buf[0]) + 1;
+	*block_size = get_be32(&buf[4]);
+
+	return 0;
+}
+
+static int reserved_len(int len)
+{
+	long pgsize = sysconf(_SC_PAGESIZE);
+
+	return (len + pgsize - 1) & ~(pgsize - 1);
+}
+
+/*
+ * Grow the reserved buffer of fd to len bytes and map it. A command
+ * with SG_FLAG_MMAP_IO moves its data through the mapping instead of
+ * dxferp, and only one can be in flight per fd as there is a single
+ * reserved buffer. The driver caps the size to the max transfer of the
+ * device, that is -ENOMEM.
+ */
+int sgv3_map_reserved(int fd, int len, void **addr)
+{
+	int size = reserved_len(len);
+	void *p;
+
+	if (ioctl(fd, SG_SET_RESERVED_SIZE, &size) ||
+	    ioctl(fd, SG_GET_RESERVED_SIZE, &size))
+		return -errno;
+	if (size < len)
+		return -ENOMEM;
+
+	p = mmap(NULL, reserved_len(len), PROT_READ | PROT_WRITE, MAP_SHARED,
+		 fd, 0);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	*addr = p;
+
+	return 0;
+}
+
+void sgv3_unmap_reserved(void *addr, int len)
+{
+	munmap(addr, reserved_len(len));
+}
@@ -0,0 +1,65 @@
+#ifndef __LIBSG_H
+#define __LIBSG_H
+
+#include <stdint.h>
+#include <scsi/sg.h>
+
+/*
+ * The sg driver's own interfaces on /dev/sgN: the v2 sg_header
+ * write()/read() protocol and the v3 sg_io_hdr one.
+ */
+
+#define SGV3_SENSE_LEN	32
+
+/* not in the glibc copy of sg.h */
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO	4
+#endif
+
+/*
+ * A v2 command goes out as sg_header, the CDB and the data out; the
+ * reply comes back as sg_header and the data in. So the two data
+ * areas of a command buffer are at different offsets.
+ */
+static inline char *sgv2_dout(char *buf, int cdb_len)
+{
+	return buf + sizeof(struct sg_header) + cdb_len;
+}
+
+static inline char *sgv2_din(char *buf)
+{
+	return buf + sizeof(struct sg_header);
+}
+
+/* a buffer that fits both for len bytes of data */
+static inline int sgv2_buf_len(int cdb_len, int len)
+{
+	return sizeof(struct sg_header) + cdb_len + len;
+}
+
+extern int sgv2_send(int fd, char *buf, unsigned char *cdb, int cdb_len,
+		     int dout_len, int din_len, int pack_id);
+extern int sgv2_recv(int fd, char *buf, int din_len, int *pack_id);
+extern int sgv2_ready(int fd, int timeout);
+extern int sgv2_check(char *buf);
+
+extern void sgv3_setup_hdr(struct sg_io_hdr *hdr, unsigned char *cdb,
+			   int cdb_len, unsigned char *sense, int sense_len,
+			   int dir, void *buf, int len);
+extern int sgv3_check(struct sg_io_hdr *hdr);
+extern int sgv3_exec(int fd, struct sg_io_hdr *hdr);
+extern int sgv3_read_capacity(int fd, uint64_t *nr_blocks,
+			      uint32_t *block_size);
+extern int sgv3_map_reserved(int fd, int len, void **addr);
+extern void sgv3_unmap_reserved(void *addr, int len);
+
+/*
+ * SG_FLAG_DIRECT_IO is only a request: without allow_dio, or with a
+ * buffer the HBA can't DMA to, the driver quietly copies instead.
+ */
+static inline int sgv3_direct_done(struct sg_io_hdr *hdr)
+{
+	return (hdr->info & SG_INFO_DIRECT_IO_MASK) == SG_INFO_DIRECT_IO;
+}
+
+#endif
@@ -0,0 +1,971 @@
+/*
+ * run one workload through the SCSI pass-through interfaces and the
+ * block layer, and compare what each costs
+ *
+ * Released under the terms of the GNU GPL v2.0.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <scsi/scsi.h>
+#include <scsi/sg.h>
+
+#include "libbsg.h"
+#include "libhist.h"
+#include "libring.h"
+#include "libsg.h"
+
+static char pname[] = "sg_ifbench";
+
+static struct option const long_options[] =
+{
+	{"blksize", required_argument, 0, 'b'},
+	{"count", required_argument, 0, 'c'},
+	{"runtime", required_argument, 0, 'r'},
+	{"outstanding", required_argument, 0, 'o'},
+	{"write", no_argument, 0, 'w'},
+	{"pattern", required_argument, 0, 'P'},
+	{"seed", required_argument, 0, 's'},
+	{"offset", required_argument, 0, 'O'},
+	{"size", required_argument, 0, 'S'},
+	{"paths", required_argument, 0, 'p'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0},
+};
+
+static void usage(int status)
+{
+	if (status)
+		fprintf(stderr, "Try `%s --help' for more information.\n", pname);
+	else {
+		printf("Usage: %s [OPTIONS]... [bsg=DEV] [sg=DEV] [blk=DEV]\n",
+		       pname);
+		printf("\
+  -b, --blksize           I/O size. Default is 4k\n\
+  -c, --count             number of I/Os per path. Default is 100000\n\
+  -r, --runtime           run each path for the given seconds instead\n\
+  -o, --outstanding       I/Os in flight. The asynchronous paths queue\n\
+                          them, the synchronous ones run as many threads.\n\
+                          Default is 1\n\
+  -w, --write             Do write I/Os.\n\
+  -P, --pattern           seq or rand. Default is seq\n\
+  -s, --seed              seed of the rand pattern\n\
+  -O, --offset            start of the range to access, in bytes\n\
+  -S, --size              size of the range to access, in bytes. Default\n\
+                          is the smallest of the devices\n\
+  -p, --paths             comma separated list of the paths to run.\n\
+                          Default is all the paths of the given devices\n\
+  -h, --help              display this help and exit\n\
+");
+		printf("\n\
+Paths:\n\
+  bsg                     bsg write()/read(), queued          bsg=DEV\n\
+  bsg-sgio                bsg SG_IO ioctl                     bsg=DEV\n\
+  sg3                     sg v3 SG_IO ioctl                   sg=/dev/sgN\n\
+  sg3-direct              SG_IO, SG_FLAG_DIRECT_IO. Needs     sg=/dev/sgN\n\
+                          /proc/scsi/sg/allow_dio set\n\
+  sg3-mmap                SG_IO, SG_FLAG_MMAP_IO through the  sg=/dev/sgN\n\
+                          mapped reserved buffer\n\
+  sg2                     sg v2 sg_header write()/read()      sg=/dev/sgN\n\
+  blk                     O_DIRECT, io_uring (pread/pwrite    blk=/dev/sdX\n\
+                          threads without it)\n\
+\n\
+bsg=, sg= and blk= should be the same disk.\n\
+");
+		printf("\n\
+Examples:\n\
+  $ %s -o 32 -P rand bsg=/dev/bsg/0:0:0:0 sg=/dev/sg0 blk=/dev/sda\n\
+  $ %s -r 10 -p bsg,blk bsg=/dev/bsg/0:0:0:0 blk=/dev/sda\n\
+", pname, pname);
+	}
+	exit(status);
+}
+
+enum {
+	PATH_BSG,
+	PATH_BSG_SGIO,
+	PATH_SG3,
+	PATH_SG3_DIRECT,
+	PATH_SG3_MMAP,
+	PATH_SG2,
+	PATH_BLK,
+	PATH_NR,
+};
+
+static const char *path_name[] = {
+	"bsg", "bsg-sgio", "sg3", "sg3-direct", "sg3-mmap", "sg2", "blk",
+};
+
+enum {
+	DEV_BSG,
+	DEV_SG,
+	DEV_BLK,
+	DEV_NR,
+};
+
+static const int path_dev[] = {
+	DEV_BSG, DEV_BSG, DEV_SG, DEV_SG, DEV_SG, DEV_SG, DEV_BLK,
+};
+
+static const char *dev_name[] = {
+	"bsg", "sg", "blk",
+};
+
+static char *devs[DEV_NR];
+static uint32_t dev_block_size[DEV_NR];
+
+static int bs = 4096;
+static uint64_t count = 100000;
+static int runtime;
+static int outstanding = 1;
+static int write_io;
+static int rand_io;
+static uint64_t seed = 1;
+static uint64_t range_start, range_size;
+
+/* one path's run, shared by its threads */
+struct ifb_run {
+	int path;
+	char *dev;
+	uint32_t block_size;
+	char engine[64];
+
+	uint64_t next;
+	uint64_t end_ns;
+	int stop;
+	int err;
+
+	uint64_t done;
+	uint64_t indirect;
+	uint64_t ns;
+	double user_us, sys_us;
+	long csw;
+	struct lat_hist lat;
+};
+
+struct ifb_thread {
+	struct ifb_run *run;
+	pthread_t thread;
+	int fd;
+	char *buf;
+	void *map;		/* the mapped reserved buffer of sg3-mmap */
+	uint64_t *start;	/* submit times of the queued paths, by tag */
+	uint64_t rand;
+	uint64_t done;
+	uint64_t indirect;
+	struct lat_hist lat;
+};
+
+static uint64_t xorshift64(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*s = x;
+
+	return x;
+}
+
+/* 0 once the run is over */
+static int next_io(struct ifb_thread *t, uint64_t *offset)
+{
+	struct ifb_run *run = t->run;
+	uint64_t n, nr_blocks = range_size / bs;
+
+	if (__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+		return 0;
+
+	n = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+	if ((!runtime && n >= count) ||
+	    (runtime && !(n & 63) && lat_now_ns() >= run->end_ns)) {
+		__atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (rand_io)
+		n = xorshift64(&t->rand);
+	*offset = range_start + (n % nr_blocks) * bs;
+
+	return 1;
+}
+
+static void run_fail(struct ifb_run *run, int err)
+{
+	if (!run->err)
+		run->err = err;
+	__atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+}
+
+static int bsg_sgio_io(struct ifb_thread *t, uint64_t offset)
+{
+	unsigned char cdb[RW_CDB_MAX], sense[BSG_SENSE_LEN];
+	struct sg_io_v4 hdr;
+	int cdb_len, ret;
+
+	cdb_len = setup_rw_cdb(cdb, write_io, bs, offset,
+			       t->run->block_size);
+	if (write_io)
+		setup_sgv4_hdr(&hdr, cdb, cdb_len, sense, sizeof(sense),
+			       NULL, 0, t->buf, bs);
+	else
+		setup_sgv4_hdr(&hdr, cdb, cdb_len, sense, sizeof(sense),
+			       t->buf, bs, NULL, 0);
+
+	ret = bsg_sg_io(t->fd, &hdr);
+	if (ret)
+		return ret;
+
+	return sgv4_rsp_check(&hdr) ? -EIO : 0;
+}
+
+static int sg3_flags_io(struct ifb_thread *t, uint64_t offset, int flags)
+{
+	unsigned char cdb[RW_CDB_MAX], sense[SGV3_SENSE_LEN];
+	struct sg_io_hdr hdr;
+	int cdb_len, ret;
+
+	cdb_len = setup_rw_cdb(cdb, write_io, bs, offset,
+			       t->run->block_size);
+	sgv3_setup_hdr(&hdr, cdb, cdb_len, sense, sizeof(sense),
+		       write_io ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV,
+		       t->buf, bs);
+	hdr.flags = flags;
+
+	ret = sgv3_exec(t->fd, &hdr);
+	if (ret)
+		return ret;
+
+	if ((flags & SG_FLAG_DIRECT_IO) && !sgv3_direct_done(&hdr))
+		t->indirect++;
+
+	return sgv3_check(&hdr) ? -EIO : 0;
+}
+
+static int sg3_io(struct ifb_thread *t, uint64_t offset)
+{
+	return sg3_flags_io(t, offset, 0);
+}
+
+/* the arena slots are page aligned, as direct I/O wants */
+static int sg3_direct_io(struct ifb_thread *t, uint64_t offset)
+{
+	return sg3_flags_io(t, offset, SG_FLAG_DIRECT_IO);
+}
+
+/* t->buf is the mapping, the driver ignores it but it's where the data is */
+static int sg3_mmap_io(struct ifb_thread *t, uint64_t offset)
+{
+	return sg3_flags_io(t, offset, SG_FLAG_MMAP_IO);
+}
+
+/* the data sits in the command buffer, so nothing is copied */
+static int sg2_io(struct ifb_thread *t, uint64_t offset)
+{
+	unsigned char cdb[RW_CDB_MAX];
+	int cdb_len, ret;
+
+	cdb_len = setup_rw_cdb(cdb, write_io, bs, offset,
+			       t->run->block_size);
+
+	ret = sgv2_send(t->fd, t->buf, cdb, cdb_len, write_io ? bs : 0,
+			write_io ? 0 : bs, 0);
+	if (ret)
+		return ret;
+
+	ret = sgv2_recv(t->fd, t->buf, write_io ? 0 : bs, NULL);
+	if (ret < 0)
+		return ret;
+
+	return sgv2_check(t->buf) ? -EIO : 0;
+}
+
+static int blk_io(struct ifb_thread *t, uint64_t offset)
+{
+	ssize_t ret;
+
+	if (write_io)
+		ret = pwrite(t->fd, t->buf, bs, offset);
+	else
+		ret = pread(t->fd, t->buf, bs, offset);
+	if (ret < 0)
+		return -errno;
+
+	return ret == bs ? 0 : -EIO;
+}
+
+static int (*sync_io[PATH_NR])(struct ifb_thread *t, uint64_t offset) = {
+	[PATH_BSG_SGIO] = bsg_sgio_io,
+	[PATH_SG3] = sg3_io,
+	[PATH_SG3_DIRECT] = sg3_direct_io,
+	[PATH_SG3_MMAP] = sg3_mmap_io,
+	[PATH_SG2] = sg2_io,
+	[PATH_BLK] = blk_io,
+};
+
+static int open_dev(int path)
+{
+	int fd;
+
+	switch (path) {
+	case PATH_BSG:
+	case PATH_BSG_SGIO:
+		return open_bsg_dev(devs[DEV_BSG]);
+	case PATH_BLK:
+		fd = open(devs[DEV_BLK], (write_io ? O_RDWR : O_RDONLY) |
+			  O_DIRECT);
+		break;
+	default:
+		/* the sg driver wants O_RDWR for anything but INQUIRY */
+		fd = open(devs[DEV_SG], O_RDWR);
+		break;
+	}
+
+	return fd < 0 ? -errno : fd;
+}
+
+static void close_dev(int path, int fd)
+{
+	if (path == PATH_BSG || path == PATH_BSG_SGIO)
+		close_bsg_dev(fd);
+	else
+		close(fd);
+}
+
+static void *sync_worker(void *arg)
+{
+	struct ifb_thread *t = arg;
+	struct ifb_run *run = t->run;
+	uint64_t offset, start;
+	int ret;
+
+	while (next_io(t, &offset)) {
+		start = lat_now_ns();
+		ret = sync_io[run->path](t, offset);
+		if (ret) {
+			run_fail(run, ret);
+			break;
+		}
+		hist_record(&t->lat, lat_now_ns() - start);
+		t->done++;
+	}
+
+	return NULL;
+}
+
+/* a thread per outstanding I/O, each with its own fd */
+static int run_sync(struct ifb_run *run, struct ifb_thread *threads,
+		    struct bsg_arena *arena)
+{
+	int i, ret = 0, nr = 0;
+
+	snprintf(run->engine, sizeof(run->engine), "%d thread%s",
+		 outstanding, outstanding > 1 ? "s" : "");
+
+	for (i = 0; i < outstanding; i++) {
+		threads[i].buf = bsg_arena_slot(arena, i);
+		threads[i].fd = open_dev(run->path);
+		if (threads[i].fd < 0) {
+			ret = threads[i].fd;
+			break;
+		}
+
+		/* one reserved buffer per fd, hence per thread */
+		if (run->path == PATH_SG3_MMAP) {
+			ret = sgv3_map_reserved(threads[i].fd, bs,
+						&threads[i].map);
+			if (ret) {
+				close_dev(run->path, threads[i].fd);
+				break;
+			}
+			threads[i].buf = threads[i].map;
+		}
+	}
+	nr = i;
+
+	if (!ret) {
+		for (i = 0; i < nr; i++) {
+			ret = pthread_create(&threads[i].thread, NULL,
+					     sync_worker, &threads[i]);
+			if (ret) {
+				run_fail(run, -ret);
+				break;
+			}
+		}
+		while (i--)
+			pthread_join(threads[i].thread, NULL);
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (threads[i].map)
+			sgv3_unmap_reserved(threads[i].map, bs);
+		close_dev(run->path, threads[i].fd);
+	}
+
+	return ret;
+}
+
+static void bsg_done(struct bsg_queue *q, struct bsg_req *req)
+{
+	struct ifb_thread *t = req->priv;
+
+	if (sgv4_rsp_check(&req->hdr))
+		run_fail(t->run, -EIO);
+
+	hist_record(&t->lat, lat_now_ns() - t->start[req->tag]);
+	t->done++;
+	bsg_put_req(q, req);
+}
+
+static int run_bsg(struct ifb_run *run, struct ifb_thread *t,
+		   struct bsg_arena *arena)
+{
+	struct bsg_queue q;
+	struct bsg_req *req;
+	struct pollfd pfd;
+	uint64_t offset, now, *start;
+	int i, fd, ret;
+
+	snprintf(run->engine, sizeof(run->engine), "queue depth %d",
+		 outstanding);
+
+	start = calloc(outstanding, sizeof(*start));
+	if (!start)
+		return -ENOMEM;
+
+	fd = open_dev(run->path);
+	if (fd < 0) {
+		free(start);
+		return fd;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	ret = bsg_queue_init(&q, fd, outstanding, 0);
+	if (ret)
+		goto out;
+
+	t->start = start;
+	for (i = 0; i < outstanding; i++) {
+		q.reqs[i].priv = t;
+		q.reqs[i].done = bsg_done;
+	}
+
+	for (;;) {
+		now = lat_now_ns();
+		while (q.nr_free && next_io(t, &offset)) {
+			req = bsg_get_req(&q);
+			bsg_req_prep_rw(req, write_io,
+					bsg_arena_slot(arena, req->tag), bs,
+					offset, run->block_size);
+			start[req->tag] = now;
+			bsg_queue_rq(&q, req);
+		}
+
+		ret = bsg_queue_submit(&q);
+		if (ret < 0) {
+			run_fail(run, ret);
+			break;
+		}
+
+		if (!bsg_queue_busy(&q))
+			break;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			run_fail(run, -errno);
+			break;
+		}
+
+		ret = bsg_queue_reap(&q);
+		if (ret < 0) {
+			run_fail(run, ret);
+			break;
+		}
+	}
+	ret = 0;
+
+	bsg_queue_exit(&q);
+out:
+	close_bsg_dev(fd);
+	free(start);
+	t->start = NULL;
+
+	return ret;
+}
+
+/* O_DIRECT through io_uring, the buffers registered once */
+static int run_blk_ring(struct ifb_run *run, struct ifb_thread *t,
+			struct bsg_arena *arena)
+{
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	struct io_ring ring;
+	struct iovec *iov;
+	uint64_t offset, now, *start;
+	int i, fd, ret, inflight = 0, *free_slots, nr_free;
+
+	/* -ENOSYS lets the caller fall back to threads */
+	if (io_ring_init(&ring, outstanding))
+		return -ENOSYS;
+
+	iov = calloc(outstanding, sizeof(*iov));
+	start = calloc(outstanding, sizeof(*start));
+	free_slots = calloc(outstanding, sizeof(*free_slots));
+	if (!iov || !start || !free_slots) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	for (i = 0; i < outstanding; i++) {
+		iov[i].iov_base = bsg_arena_slot(arena, i);
+		iov[i].iov_len = bs;
+		free_slots[i] = i;
+	}
+	nr_free = outstanding;
+
+	ret = io_ring_register_buffers(&ring, iov, outstanding);
+	if (ret)
+		goto free;
+
+	fd = open_dev(run->path);
+	if (fd < 0) {
+		ret = fd;
+		goto free;
+	}
+
+	snprintf(run->engine, sizeof(run->engine), "io_uring depth %d",
+		 outstanding);
+
+	for (;;) {
+		now = lat_now_ns();
+		while (nr_free && next_io(t, &offset)) {
+			sqe = io_ring_get_sqe(&ring);
+			if (!sqe)
+				break;
+			i = free_slots[--nr_free];
+			io_ring_prep_rw(sqe, write_io ? IORING_OP_WRITE_FIXED :
+					IORING_OP_READ_FIXED, fd, iov[i].iov_base,
+					bs, offset, i, i);
+			start[i] = now;
+			inflight++;
+		}
+
+		if (!inflight)
+			break;
+
+		ret = io_ring_submit_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			run_fail(run, ret);
+			break;
+		}
+
+		while ((cqe = io_ring_peek_cqe(&ring))) {
+			i = cqe->user_data;
+			if (cqe->res != bs)
+				run_fail(run, cqe->res < 0 ? cqe->res : -EIO);
+			hist_record(&t->lat, lat_now_ns() - start[i]);
+			t->done++;
+			free_slots[nr_free++] = i;
+			inflight--;
+			io_ring_cqe_seen(&ring);
+		}
+	}
+	ret = 0;
+
+	close(fd);
+free:
+	free(iov);
+	free(start);
+	free(free_slots);
+	io_ring_exit(&ring);
+
+	return ret;
+}
+
+static void run_path(struct ifb_run *run, struct bsg_arena *arena)
+{
+	struct ifb_thread *threads;
+	struct rusage ru0, ru1;
+	uint64_t start;
+	int i, ret;
+
+	threads = calloc(outstanding, sizeof(*threads));
+	if (!threads) {
+		run->err = -ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < outstanding; i++) {
+		threads[i].run = run;
+		threads[i].rand = seed * (i + 1) * 0x9e3779b97f4a7c15ULL;
+		if (!threads[i].rand)
+			threads[i].rand = 1;
+		hist_init(&threads[i].lat);
+	}
+
+	getrusage(RUSAGE_SELF, &ru0);
+	start = lat_now_ns();
+	run->end_ns = start + runtime * 1000000000ULL;
+
+	switch (run->path) {
+	case PATH_BSG:
+		ret = run_bsg(run, threads, arena);
+		break;
+	case PATH_BLK:
+		ret = run_blk_ring(run, threads, arena);
+		if (ret != -ENOSYS)
+			break;
+		/* no io_uring here, the block layer gets threads too */
+		/* fall through */
+	default:
+		ret = run_sync(run, threads, arena);
+		break;
+	}
+
+	run->ns = lat_now_ns() - start;
+	getrusage(RUSAGE_SELF, &ru1);
+
+	if (ret)
+		run_fail(run, ret);
+
+	run->user_us = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) * 1e6 +
+		(ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec);
+	run->sys_us = (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) * 1e6 +
+		(ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec);
+	run->csw = (ru1.ru_nvcsw - ru0.ru_nvcsw) +
+		(ru1.ru_nivcsw - ru0.ru_nivcsw);
+
+	hist_init(&run->lat);
+	for (i = 0; i < outstanding; i++) {
+		run->done += threads[i].done;
+		run->indirect += threads[i].indirect;
+		hist_merge(&run->lat, &threads[i].lat);
+	}
+
+	free(threads);
+}
+
+/* the capacity in bytes and the logical block size of a device */
+static int dev_capacity(int dev, uint64_t *size, uint32_t *block_size)
+{
+	struct bsg_capacity cap;
+	uint64_t nr_blocks;
+	struct stat st;
+	int fd, ret = 0;
+
+	if (dev == DEV_BSG) {
+		fd = open_bsg_dev(devs[dev]);
+		if (fd < 0)
+			return fd;
+		ret = bsg_read_capacity(fd, &cap);
+		close_bsg_dev(fd);
+		*size = cap.nr_blocks * cap.block_size;
+		*block_size = cap.block_size;
+		return ret;
+	}
+
+	fd = open(devs[dev], dev == DEV_SG ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (dev == DEV_SG) {
+		ret = sgv3_read_capacity(fd, &nr_blocks, block_size);
+		*size = nr_blocks * *block_size;
+	} else if (fstat(fd, &st))
+		ret = -errno;
+	else if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, size) ||
+		    ioctl(fd, BLKSSZGET, block_size))
+			ret = -errno;
+	} else {
+		/* a file, handy to try the tool out */
+		*size = st.st_size;
+		*block_size = SECTOR_SIZE;
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static int parse_paths(char *str, int *paths)
+{
+	char *p;
+	int i;
+
+	memset(paths, 0, sizeof(*paths) * PATH_NR);
+
+	for (p = strtok(str, ","); p; p = strtok(NULL, ",")) {
+		for (i = 0; i < PATH_NR; i++)
+			if (!strcmp(p, path_name[i]))
+				break;
+		if (i == PATH_NR) {
+			fprintf(stderr, "unknown path, %s\n", p);
+			return -EINVAL;
+		}
+		paths[i] = 1;
+	}
+
+	return 0;
+}
+
+static uint64_t parse_size(char *str)
+{
+	uint64_t v;
+	char *p;
+
+	v = strtoull(str, &p, 0);
+	switch (*p) {
+	case 't':
+		v <<= 10;
+		/* fall through */
+	case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'k':
+		v <<= 10;
+		break;
+	}
+
+	return v;
+}
+
+static void print_results(struct ifb_run *runs, int *paths)
+{
+	struct ifb_run *run;
+	double secs, iops;
+	int i;
+
+	printf("%-10s %-19s %11s %9s %9s %9s %9s %9s %9s %9s %8s %8s\n",
+	       "path", "engine", "iops", "MB/s", "lat mean", "p50", "p99",
+	       "p99.9", "cpu/IO", "sys/IO", "csw/IO", "cpu/GB");
+
+	for (i = 0; i < PATH_NR; i++) {
+		run = &runs[i];
+		if (!paths[i])
+			continue;
+
+		if (!run->done) {
+			printf("%-10s failed, %s\n", path_name[i],
+			       strerror(run->err ? -run->err : EIO));
+			continue;
+		}
+
+		secs = run->ns / 1e9;
+		iops = run->done / secs;
+
+		printf("%-10s %-19s %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.2f %9.2f %8.3f %8.3f%s\n",
+		       path_name[i], run->engine, iops,
+		       iops * bs / 1e6,
+		       run->lat.sum / 1e3 / run->lat.nr,
+		       hist_percentile(&run->lat, 50) / 1e3,
+		       hist_percentile(&run->lat, 99) / 1e3,
+		       hist_percentile(&run->lat, 99.9) / 1e3,
+		       (run->user_us + run->sys_us) / run->done,
+		       run->sys_us / run->done,
+		       (double) run->csw / run->done,
+		       (run->user_us + run->sys_us) / 1e6 /
+		       (run->done * bs / 1e9),
+		       run->err ? " (errors)" : "");
+	}
+
+	printf("latencies in usec, cpu/IO and sys/IO in usec of CPU time, "
+	       "cpu/GB in sec\n");
+
+	for (i = 0; i < PATH_NR; i++)
+		if (paths[i] && runs[i].indirect)
+			printf("%s: %" PRIu64 " of %" PRIu64 " I/Os fell back "
+			       "to indirect I/O, is /proc/scsi/sg/allow_dio "
+			       "1?\n", path_name[i], runs[i].indirect,
+			       runs[i].done);
+}
+
+int main(int argc, char **argv)
+{
+	int longindex, ch, i, dev, paths[PATH_NR], has_paths = 0;
+	struct ifb_run runs[PATH_NR];
+	struct bsg_arena arena;
+	uint64_t size, min_size = UINT64_MAX;
+	uint32_t block_size;
+	char *p;
+	int ret;
+
+	while ((ch = getopt_long(argc, argv, "b:c:r:o:wP:s:O:S:p:h",
+				 long_options, &longindex)) >= 0) {
+		switch (ch) {
+		case 'b':
+			bs = parse_size(optarg);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			runtime = atoi(optarg);
+			break;
+		case 'o':
+			outstanding = atoi(optarg);
+			break;
+		case 'w':
+			write_io = 1;
+			break;
+		case 'P':
+			if (!strcmp(optarg, "rand"))
+				rand_io = 1;
+			else if (strcmp(optarg, "seq")) {
+				fprintf(stderr, "unknown pattern, %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'O':
+			range_start = parse_size(optarg);
+			break;
+		case 'S':
+			range_size = parse_size(optarg);
+			break;
+		case 'p':
+			if (parse_paths(optarg, paths))
+				usage(1);
+			has_paths = 1;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		p = strchr(argv[i], '=');
+		if (!p) {
+			fprintf(stderr, "unknown operand, %s\n", argv[i]);
+			usage(1);
+		}
+		*p++ = '\0';
+
+		for (dev = 0; dev < DEV_NR; dev++)
+			if (!strcmp(argv[i], dev_name[dev]))
+				break;
+		if (dev == DEV_NR) {
+			fprintf(stderr, "unknown operand, %s\n", argv[i]);
+			usage(1);
+		}
+		devs[dev] = p;
+	}
+
+	if (bs <= 0 || bs % SECTOR_SIZE || outstanding <= 0 ||
+	    (!runtime && !count)) {
+		fprintf(stderr, "bad I/O size, outstanding or count\n");
+		exit(1);
+	}
+
+	for (i = 0; i < PATH_NR; i++) {
+		if (!has_paths)
+			paths[i] = !!devs[path_dev[i]];
+		else if (paths[i] && !devs[path_dev[i]]) {
+			fprintf(stderr, "%s needs %s=DEV\n", path_name[i],
+				dev_name[path_dev[i]]);
+			exit(1);
+		}
+	}
+
+	for (dev = 0; dev < DEV_NR; dev++) {
+		if (!devs[dev])
+			continue;
+
+		ret = dev_capacity(dev, &size, &block_size);
+		if (ret) {
+			fprintf(stderr, "can't get the capacity of %s, %s\n",
+				devs[dev], strerror(-ret));
+			exit(1);
+		}
+
+		if (bs % block_size || range_start % block_size) {
+			fprintf(stderr, "The I/O size and the offset should be "
+				"multiples of the %u byte blocks of %s\n",
+				block_size, devs[dev]);
+			exit(1);
+		}
+
+		dev_block_size[dev] = block_size;
+		if (size < min_size)
+			min_size = size;
+	}
+
+	if (min_size == UINT64_MAX) {
+		fprintf(stderr, "no device is given\n");
+		usage(1);
+	}
+
+	if (range_start >= min_size) {
+		fprintf(stderr, "the offset is past the end of the devices\n");
+		exit(1);
+	}
+	if (!range_size || range_size > min_size - range_start)
+		range_size = min_size - range_start;
+	if (range_size < (uint64_t) bs) {
+		fprintf(stderr, "the range is smaller than the I/O size\n");
+		exit(1);
+	}
+
+	/* the v2 data follows a header and the CDB in the same buffer */
+	ret = bsg_arena_init(&arena, outstanding,
+			     sgv2_buf_len(RW_CDB_MAX, bs), 0,
+			     BSG_ARENA_PREFAULT);
+	if (ret) {
+		fprintf(stderr, "can't allocate the buffers, %s\n",
+			strerror(-ret));
+		exit(1);
+	}
+
+	printf("%s, %d bytes, %d outstanding, %" PRIu64 " bytes from %"
+	       PRIu64 "\n", write_io ? "write" : "read", bs, outstanding,
+	       range_size, range_start);
+	if (runtime)
+		printf("%d seconds per path\n\n", runtime);
+	else
+		printf("%" PRIu64 " I/Os per path\n\n", count);
+
+	memset(runs, 0, sizeof(runs));
+	for (i = 0; i < PATH_NR; i++) {
+		if (!paths[i])
+			continue;
+
+		runs[i].path = i;
+		runs[i].dev = devs[path_dev[i]];
+		runs[i].block_size = dev_block_size[path_dev[i]];
+		run_path(&runs[i], &arena);
+	}
+
+	print_results(runs, paths);
+
+	bsg_arena_exit(&arena);
+
+	for (i = 0; i < PATH_NR; i++)
+		if (paths[i] && runs[i].err)
+			return 1;
+
+	return 0;
+}
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,12 +9,19 @@
 #include <unistd.h>
 #include <scsi/scsi.h>
 #include <scsi/sg.h>
-#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "libbsg.h"
+#include "libsg.h"
 
 static char pname[] = "sgv2_dd";
 
 static struct option const long_options[] =
 {
+	{"qdepth", required_argument, 0, 'q'},
+	{"engine", required_argument, 0, 'e'},
 	{"help", no_argument, 0, 'h'},
 	{0, 0, 0, 0},
 };
@@ -26,137 +34,427 @@ static void usage(int status)
 	else {
 		printf("Usage: %s [OPTIONS]... <sg device>\n", pname);
 		printf("\
+  -q, --qdepth            blocks in flight, up to 16. Default is 1\n\
+  -e, --engine            how the data gets to and from the sg device:\n\
+                            v2         sg_header write()/read(), queued\n\
+                            v3         sg_io_hdr SG_IO, copied by the driver\n\
+                            v3-direct  SG_IO with SG_FLAG_DIRECT_IO, needs\n\
+                                       /proc/scsi/sg/allow_dio set\n\
+                            v3-mmap    SG_IO with SG_FLAG_MMAP_IO, through\n\
+                                       the mapped reserved buffer\n\
+                          The v3 ones do a block at a time. Default is v2\n\
   -h, --help              display this help and exit\n\
 ");
 		printf("\n\
 Examples:\n\
-  $ %s /dev/sg1\n\
-", pname);
+  $ %s if=/dev/sg1 of=/dev/null bs=64k count=1024\n\
+  $ %s -q 8 if=/dev/sg1 of=/dev/sg2 bs=64k count=1024\n\
+  $ %s -e v3-mmap if=/dev/sg1 of=/dev/null bs=512k count=2048\n\
+", pname, pname, pname);
 	}
 	exit(status);
 }
 
-#define SECTOR_SIZE 512
 
-static void setup_rw_scb10(unsigned char *scb, int scb_len, unsigned char cmd,
-			   unsigned long len, unsigned long offset)
+enum {
+	ENGINE_V2,
+	ENGINE_V3,
+	ENGINE_V3_DIRECT,
+	ENGINE_V3_MMAP,
+	ENGINE_NR,
+};
+
+static const char *engine_name[] = {
+	"v2", "v3", "v3-direct", "v3-mmap",
+};
+
+static int qdepth = 1;
+static int engine = ENGINE_V2;
+static uint64_t indirect_ios;
+
+/* the logical block sizes of the sg sides, from READ CAPACITY */
+static unsigned int if_lbs, of_lbs;
+
+/*
+ * The v2 slot layout below depends on the CDB length, so the v2
+ * engine uses one for the whole copy: (10) unless the last block
+ * needs (16).
+ */
+static int cdb_len = 10;
+
+static void setup_cdb(unsigned char *cdb, int write, int len,
+		      uint64_t offset, unsigned int block_size)
 {
-	memset(scb, 0, scb_len);
+	if (cdb_len == 16)
+		setup_rw_scb16(cdb, write ? WRITE_16 : READ_16, len, offset,
+			       block_size);
+	else
+		setup_rw_scb(cdb, 10, write ? WRITE_10 : READ_10, len, offset,
+			     block_size);
+}
 
-	scb[0] = cmd;
-	scb[7] = (unsigned char)(((len / SECTOR_SIZE) >> 8) & 0xff);
-	scb[8] = (unsigned char)((len / SECTOR_SIZE) & 0xff);
+/*
+ * One command buffer per slot, allocated once. A v2 read reply puts
+ * the data right after sg_header while a write wants it after the
+ * header and the CDB, so the read command is built cdb_len bytes into
+ * the slot: the data of both ends up at the same place and a block
+ * goes from one device to the other without a copy.
+ */
+struct dd_slot {
+	char *buf;
+	uint64_t blk;		/* index of the block it carries */
+	int writing;
+};
 
-	*((uint32_t *) &scb[2]) = htonl(offset / SECTOR_SIZE);
+static char *slot_rbuf(struct dd_slot *s)
+{
+	return s->buf + cdb_len;
 }
 
-static int sgv2_read(int fd, char *p, int len, unsigned offset)
+static char *slot_wbuf(struct dd_slot *s)
 {
-	unsigned char *cmd;
-	struct sg_header *hdr;
-	unsigned char *buf;
-	int cmd_len = 10;
-	int total_len = len + sizeof(*hdr) + cmd_len;
-	int ret;
+	return s->buf;
+}
 
-	printf("%s %d len %d off %u\n", __func__, __LINE__, len, offset);
+static char *slot_data(struct dd_slot *s)
+{
+	return sgv2_dout(s->buf, cdb_len);
+}
 
-	buf = malloc(total_len);
-	memset(buf, 0, total_len);
+/* pack_id is the slot index, so a reply leads straight to its slot */
+static int sgv2_submit(int fd, struct dd_slot *s, int id, int write, int len,
+		       uint64_t offset, unsigned int block_size)
+{
+	unsigned char cdb[RW_CDB_MAX];
+	int ret;
 
-	hdr = (struct sg_header *)buf;
-	cmd = buf + sizeof(*hdr);
+	setup_cdb(cdb, write, len, offset, block_size);
 
-	setup_rw_scb10(cmd, cmd_len, READ_10, len, offset);
+	if (write)
+		ret = sgv2_send(fd, slot_wbuf(s), cdb, cdb_len, len, 0, id);
+	else
+		ret = sgv2_send(fd, slot_rbuf(s), cdb, cdb_len, 0, len, id);
+	if (ret)
+		printf("%s %d fail, %s\n", __func__, __LINE__, strerror(-ret));
 
-	hdr->reply_len = sizeof(*hdr) + len;
+	return ret;
+}
+
+/* waits for the read in slot id, FORCE_PACK_ID is on */
+static int sgv2_reap_read(int fd, struct dd_slot *s, int id, int len)
+{
+	int ret;
 
-	ret = write(fd, hdr, cmd_len + sizeof(*hdr));
-	if (ret != sizeof(*hdr) + cmd_len) {
-		printf("%s %d fail, %d\n", __func__, __LINE__, ret);
+	ret = sgv2_recv(fd, slot_rbuf(s), len, &id);
+	if (ret >= 0 && (ret != len || sgv2_check(slot_rbuf(s))))
+		ret = -EIO;
+	if (ret < 0) {
+		printf("%s %d fail, %s\n", __func__, __LINE__, strerror(-ret));
 		return ret;
 	}
 
-	memset(hdr, 0, sizeof(*hdr));
+	return 0;
+}
 
-	ret = read(fd, buf, sizeof(*hdr) + len);
-	if (ret <= 0) {
-		printf("%s %d fail, %d\n", __func__, __LINE__, ret);
+/* any write; the reply carries no data, the header will do */
+static int sgv2_reap_write(int fd, int *id)
+{
+	struct sg_header hdr;
+	int ret;
+
+	*id = -1;
+	ret = sgv2_recv(fd, (char *) &hdr, 0, id);
+	if (!ret && sgv2_check((char *) &hdr))
+		ret = -EIO;
+	if (ret < 0) {
+		printf("%s %d fail, %s\n", __func__, __LINE__, strerror(-ret));
 		return ret;
 	}
-	if (hdr->result) {
-		printf("%s %d fail, %d\n", __func__, __LINE__, hdr->result);
-		return ret;
+
+	return 0;
+}
+
+static int pread_full(int fd, char *buf, int len, uint64_t offset)
+{
+	int ret = pread(fd, buf, len, offset);
+
+	if (ret != len) {
+		printf("%s %d: %d\n", __func__, __LINE__, ret);
+		return ret < 0 ? -errno : -EIO;
 	}
 
-	memcpy(p, buf + sizeof(*hdr), len);
+	return 0;
+}
 
-	free(buf);
+static int pwrite_full(int fd, char *buf, int len, uint64_t offset)
+{
+	int ret = pwrite(fd, buf, len, offset);
+
+	if (ret != len) {
+		printf("%s %d: %d\n", __func__, __LINE__, ret);
+		return ret < 0 ? -errno : -EIO;
+	}
 
 	return 0;
 }
 
-static int sgv2_write(int fd, char *p, int len, unsigned offset)
+/*
+ * Up to qdepth blocks in flight: reads are queued on if and reaped in
+ * order by pack_id, each goes out as a write on of as soon as it's
+ * in, and a slot is reused once its write is done. Finished writes
+ * are picked up on every pass, so the reads keep the slots busy.
+ */
+static int copy(int in_fd, int if_sg, int of_fd, int of_sg, int bs,
+		uint64_t count, struct dd_slot *slots)
 {
-	unsigned char *cmd;
-	struct sg_header *hdr;
-	unsigned char *buf;
-	int cmd_len = 10;
-	int total_len = len + sizeof(*hdr) + cmd_len;
-	int ret;
+	int *free_slots, *fifo, nr_free, head = 0, tail = 0, writes = 0;
+	uint64_t next = 0, done = 0;
+	struct dd_slot *s;
+	int i, id, ret = 0;
+
+	free_slots = calloc(qdepth, sizeof(*free_slots));
+	fifo = calloc(qdepth, sizeof(*fifo));
+	if (!free_slots || !fifo) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	printf("%s %d len %d off %u\n", __func__, __LINE__, len, offset);
+	for (i = 0; i < qdepth; i++)
+		free_slots[i] = qdepth - 1 - i;
+	nr_free = qdepth;
+
+	while (done < count) {
+		/*
+		 * the writes that are done free their slots for more reads;
+		 * left alone they'd wait until the reads run dry
+		 */
+		while (writes && sgv2_ready(of_fd, 0) > 0) {
+			ret = sgv2_reap_write(of_fd, &id);
+			if (ret)
+				goto out;
+			writes--;
+			free_slots[nr_free++] = id;
+			done++;
+		}
+
+		while (nr_free && next < count) {
+			id = free_slots[--nr_free];
+			s = &slots[id];
+			s->blk = next++;
+
+			if (if_sg)
+				ret = sgv2_submit(in_fd, s, id, 0, bs,
+						  s->blk * bs, if_lbs);
+			else
+				ret = pread_full(in_fd, slot_data(s), bs,
+						 s->blk * bs);
+			if (ret)
+				goto out;
+
+			fifo[tail++ % qdepth] = id;
+		}
 
-	buf = malloc(total_len);
-	memset(buf, 0, total_len);
+		if (head != tail) {
+			id = fifo[head++ % qdepth];
+			s = &slots[id];
 
-	hdr = (struct sg_header *)buf;
-	cmd = buf + sizeof(*hdr);
+			if (if_sg) {
+				ret = sgv2_reap_read(in_fd, s, id, bs);
+				if (ret)
+					goto out;
+			}
 
-	setup_rw_scb10(cmd, cmd_len, WRITE_10, len, offset);
+			if (of_sg) {
+				ret = sgv2_submit(of_fd, s, id, 1, bs,
+						  s->blk * bs, of_lbs);
+				if (ret)
+					goto out;
+				writes++;
+			} else {
+				ret = pwrite_full(of_fd, slot_data(s), bs,
+						  s->blk * bs);
+				if (ret)
+					goto out;
+				free_slots[nr_free++] = id;
+				done++;
+			}
+		}
 
-	hdr->reply_len = sizeof(*hdr);
+		/* every slot is waiting for its write, or we are draining */
+		if (writes && head == tail && (!nr_free || next == count)) {
+			ret = sgv2_reap_write(of_fd, &id);
+			if (ret)
+				goto out;
+			writes--;
+			free_slots[nr_free++] = id;
+			done++;
+		}
+	}
+out:
+	free(free_slots);
+	free(fifo);
 
-	memcpy(buf + sizeof(*hdr) + cmd_len, p, len);
+	return ret;
+}
 
-	ret = write(fd, hdr, total_len);
-	if (ret != total_len) {
-		printf("%s %d fail, %d\n", __func__, __LINE__, ret);
+static int sgv3_rw(int fd, int write, char *data, int len, uint64_t offset,
+		   unsigned int block_size, int flags)
+{
+	unsigned char cdb[RW_CDB_MAX], sense[SGV3_SENSE_LEN];
+	struct sg_io_hdr hdr;
+	int ret, len_cdb;
+
+	len_cdb = setup_rw_cdb(cdb, write, len, offset, block_size);
+	sgv3_setup_hdr(&hdr, cdb, len_cdb, sense, sizeof(sense),
+		       write ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV, data, len);
+	hdr.flags = flags;
+
+	ret = sgv3_exec(fd, &hdr);
+	if (!ret && sgv3_check(&hdr))
+		ret = -EIO;
+	if (ret) {
+		printf("%s %d fail, %s\n", __func__, __LINE__, strerror(-ret));
 		return ret;
 	}
 
-	memset(hdr, 0, sizeof(*hdr));
+	if ((flags & SG_FLAG_DIRECT_IO) && !sgv3_direct_done(&hdr))
+		indirect_ios++;
+
+	return 0;
+}
 
-	ret = read(fd, buf, sizeof(*hdr));
-	if (ret <= 0) {
-		printf("%s %d fail, %d\n", __func__, __LINE__, ret);
+/*
+ * The v3 engines, a block at a time. With v3-mmap the data stays in
+ * the reserved buffer of the sg device and the file side reads or
+ * writes the mapping in place. From sg to sg the write goes out of
+ * the input's mapping, that leaves the one copy into the output's
+ * kernel buffer.
+ */
+static int copy_v3(int in_fd, int if_sg, int of_fd, int of_sg, int bs,
+		   uint64_t count, char *buf)
+{
+	int rflags = 0, wflags = 0, map_fd = -1;
+	void *map = NULL;
+	char *data = buf;
+	uint64_t blk;
+	int ret;
+
+	if (engine == ENGINE_V3_DIRECT)
+		rflags = wflags = SG_FLAG_DIRECT_IO;
+	else if (engine == ENGINE_V3_MMAP) {
+		map_fd = if_sg ? in_fd : of_fd;
+		ret = sgv3_map_reserved(map_fd, bs, &map);
+		if (ret) {
+			printf("can't map the reserved buffer, %s\n",
+			       strerror(-ret));
+			return ret;
+		}
+		data = map;
+		if (if_sg)
+			rflags = SG_FLAG_MMAP_IO;
+		else
+			wflags = SG_FLAG_MMAP_IO;
+	}
+
+	for (blk = 0; blk < count; blk++) {
+		if (if_sg)
+			ret = sgv3_rw(in_fd, 0, data, bs, blk * bs, if_lbs,
+				      rflags);
+		else
+			ret = pread_full(in_fd, data, bs, blk * bs);
+		if (ret)
+			break;
+
+		if (of_sg)
+			ret = sgv3_rw(of_fd, 1, data, bs, blk * bs, of_lbs,
+				      wflags);
+		else
+			ret = pwrite_full(of_fd, data, bs, blk * bs);
+		if (ret)
+			break;
+	}
+
+	if (map)
+		sgv3_unmap_reserved(map, bs);
+
+	return ret;
+}
+
+/*
+ * bs has to be whole logical blocks of the device, and the copy has
+ * to fit. Picks the CDB length the v2 engine needs for the last block.
+ */
+static int check_capacity(int fd, int bs, uint64_t count, char *name,
+			  unsigned int *block_size)
+{
+	unsigned char cdb[RW_CDB_MAX];
+	uint64_t nr_blocks;
+	int ret, len;
+
+	ret = sgv3_read_capacity(fd, &nr_blocks, block_size);
+	if (ret) {
+		printf("can't get the capacity of %s, %s\n", name,
+		       strerror(-ret));
 		return ret;
 	}
-	if (hdr->result) {
-		printf("%s %d fail, %d\n", __func__, __LINE__, hdr->result);
-		return hdr->result;
+
+	if (!*block_size || bs % *block_size) {
+		printf("bs must be a multiple of %u, the block size of %s\n",
+		       *block_size, name);
+		return -EINVAL;
 	}
 
-	free(buf);
+	if (count * bs > nr_blocks * *block_size) {
+		printf("%s has only %" PRIu64 " blocks of %u bytes\n", name,
+		       nr_blocks, *block_size);
+		return -EINVAL;
+	}
+
+	len = setup_rw_cdb(cdb, 0, bs, (count - 1) * bs, *block_size);
+	if (len > cdb_len)
+		cdb_len = len;
 
 	return 0;
 }
 
+static double tv_sec(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
 int main(int argc, char **argv)
 {
 	int longindex, ch;
-	int in_fd, of_fd, i;
+	int in_fd, of_fd, i, one = 1;
 	char *p;
 	char *if_file, *of_file;
-	int count, bs;
+	int bs;
+	uint64_t count;
 	int ret = -EINVAL;
-	void *buf;
-	unsigned if_offset, of_offset;
+	struct dd_slot *slots;
+	char *buf = NULL;
+	size_t slot_size;
+	long pgsize = sysconf(_SC_PAGESIZE);
+	struct timeval start, end;
+	struct rusage ru0, ru1;
+	double sec, user, sys, gb;
 	int if_sg, of_sg;
 
-	while ((ch = getopt_long(argc, argv, "h", long_options,
+	while ((ch = getopt_long(argc, argv, "q:e:h", long_options,
 				 &longindex)) >= 0) {
 		switch (ch) {
+		case 'q':
+			qdepth = atoi(optarg);
+			break;
+		case 'e':
+			for (engine = 0; engine < ENGINE_NR; engine++)
+				if (!strcmp(optarg, engine_name[engine]))
+					break;
+			if (engine == ENGINE_NR) {
+				printf("unknown engine, %s\n", optarg);
+				usage(1);
+			}
+			break;
 		case 'h':
 			usage(0);
 			break;
@@ -169,7 +467,6 @@ int main(int argc, char **argv)
 	if_file = of_file = NULL;
 	count = 1;
 	bs = 0;
-	if_offset = of_offset = 0;
 	if_sg = of_sg = 0;
 
 	for (i = optind; i < argc; i++) {
@@ -186,7 +483,7 @@ int main(int argc, char **argv)
 		else if (!strcmp(argv[i], "of"))
 			of_file = p;
 		else if (!strcmp(argv[i], "count"))
-			count = strtod(p, NULL);
+			count = strtoull(p, NULL, 0);
 		else if (!strcmp(argv[i], "bs")) {
 			bs = strtod(p, &q);
 			if (!*q)
@@ -219,8 +516,6 @@ int main(int argc, char **argv)
 	if_sg = !!strstr(if_file, "/dev/sg");
 	of_sg = !!strstr(of_file, "/dev/sg");
 
-	printf("%d %d\n", if_sg, of_sg);
-
 	if (!if_sg && !of_sg) {
 		printf("if (%s) or of (%s) must not a sg device\n",
 		       if_file, of_file);
@@ -237,57 +532,89 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	ret = 0;
+	/* the sg driver queues at most SG_MAX_QUEUE commands per fd */
+	if (qdepth < 1 || qdepth > SG_MAX_QUEUE) {
+		printf("qdepth must be between 1 and %d\n", SG_MAX_QUEUE);
+		goto out;
+	}
 
-	buf = malloc(bs);
-	if (!buf) {
+	if (qdepth > 1 && engine != ENGINE_V2) {
+		printf("only the v2 engine queues, -q needs -e v2\n");
+		goto out;
+	}
+
+	slots = calloc(qdepth, sizeof(*slots));
+	slot_size = (sgv2_buf_len(RW_CDB_MAX, bs) + RW_CDB_MAX + pgsize - 1) &
+		~(pgsize - 1);
+	if (!slots || posix_memalign((void **) &buf, pgsize,
+				     slot_size * qdepth)) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
+	for (i = 0; i < qdepth; i++)
+		slots[i].buf = buf + slot_size * i;
+
 	in_fd = open(if_file, O_RDWR);
 	if (in_fd < 0) {
 		printf("can't open if, %s %s\n", strerror(errno), if_file);
-		goto out;
+		goto free_buf;
 	}
 
-	of_fd = open(of_file, O_RDWR |O_CREAT);
+	of_fd = open(of_file, O_RDWR | O_CREAT, 0644);
 	if (of_fd < 0) {
 		printf("can't open of, %s %s\n", strerror(errno), of_file);
-		goto out;
+		goto close_in;
 	}
 
-	for (i = 0; i < count; i++) {
-		if (if_sg) {
-			ret = sgv2_read(in_fd, buf, bs, if_offset);
-			if (ret)
-				break;
-		} else {
-			ret = pread(in_fd, buf, bs, if_offset);
-			if (ret != bs) {
-				printf("%s %d: %d\n", __func__, __LINE__, ret);
-				goto out;
-			}
-		}
+	if (if_sg) {
+		ret = check_capacity(in_fd, bs, count, if_file, &if_lbs);
+		if (ret)
+			goto close_of;
+	}
 
-		if (of_sg) {
-			ret = sgv2_write(of_fd, buf, bs, of_offset);
-			if (ret)
-				break;
-		} else {
-			ret = pwrite(of_fd, buf, bs, of_offset);
-			if (ret != bs) {
-				printf("%s %d: %d\n", __func__, __LINE__, ret);
-				goto out;
-			}
-		}
+	if (of_sg) {
+		ret = check_capacity(of_fd, bs, count, of_file, &of_lbs);
+		if (ret)
+			goto close_of;
+	}
 
-		if_offset += bs;
-		of_offset += bs;
+	/* reads are reaped in order by their pack_id */
+	if (if_sg && ioctl(in_fd, SG_SET_FORCE_PACK_ID, &one)) {
+		printf("can't force pack_id, %s\n", strerror(errno));
+		goto close_of;
 	}
 
-	free(buf);
+	getrusage(RUSAGE_SELF, &ru0);
+	gettimeofday(&start, NULL);
+	if (engine == ENGINE_V2)
+		ret = copy(in_fd, if_sg, of_fd, of_sg, bs, count, slots);
+	else
+		ret = copy_v3(in_fd, if_sg, of_fd, of_sg, bs, count, buf);
+	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_SELF, &ru1);
+
+	if (!ret) {
+		sec = tv_sec(&end) - tv_sec(&start);
+		user = tv_sec(&ru1.ru_utime) - tv_sec(&ru0.ru_utime);
+		sys = tv_sec(&ru1.ru_stime) - tv_sec(&ru0.ru_stime);
+		gb = count * bs / 1e9;
+		printf("%s: %.3f s, %.2f MB/s, cpu %.3f s/GB (user %.3f, sys %.3f)\n",
+		       engine_name[engine], sec, count * bs / sec / 1000000,
+		       (user + sys) / gb, user / gb, sys / gb);
+		if (indirect_ios)
+			printf("%" PRIu64 " commands fell back to indirect "
+			       "I/O, is /proc/scsi/sg/allow_dio 1?\n",
+			       indirect_ios);
+	}
 
+close_of:
+	close(of_fd);
+close_in:
+	close(in_fd);
+free_buf:
+	free(buf);
+	free(slots);
 out:
 	return ret;
 }
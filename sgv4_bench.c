@@ -7,6 +7,8 @@
  */
 
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -18,17 +20,21 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/mount.h>
 #include <scsi/scsi.h>
 #include <scsi/sg.h>
 #include <sys/time.h>
 #include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <signal.h>
 #include <byteswap.h>
 
 #include "libbsg.h"
-
-#define MAX_DEVICE_NR 8
+#include "libcrc.h"
+#include "libhist.h"
+#include "libpi.h"
 
 static char pname[] = "sgv4_bench";
 
@@ -38,6 +44,23 @@ static struct option const long_options[] =
 	{"count", required_argument, 0, 'c'},
 	{"write", no_argument, 0, 'w'},
 	{"outstanding", required_argument, 0, 'o'},
+	{"batch", required_argument, 0, 'q'},
+	{"hugepage", no_argument, 0, 'H'},
+	{"mlock", no_argument, 0, 'L'},
+	{"align", required_argument, 0, 'A'},
+	{"threads", required_argument, 0, 't'},
+	{"pin", no_argument, 0, 'p'},
+	{"pattern", required_argument, 0, 'P'},
+	{"seed", required_argument, 0, 's'},
+	{"rwmix", required_argument, 0, 'M'},
+	{"verify", no_argument, 0, 'V'},
+	{"pi", no_argument, 0, 'T'},
+	{"bsmix", required_argument, 0, 'B'},
+	{"runtime", required_argument, 0, 'r'},
+	{"interval", required_argument, 0, 'i'},
+	{"log", required_argument, 0, 'l'},
+	{"offset", required_argument, 0, 'O'},
+	{"size", required_argument, 0, 'S'},
 	{"help", no_argument, 0, 'h'},
 	{0, 0, 0, 0},
 };
@@ -51,212 +74,1230 @@ static void usage(int status)
 		printf("\
   -b, --blksize           I/O size.\n\
   -c, --count             number of I/O requests. Default is 1\n\
+  -r, --runtime           run for the given seconds. Without --count the\n\
+                          number of I/O requests is unlimited\n\
+  -i, --interval          report IOPS, bandwidth and latency every given\n\
+                          seconds\n\
+  -l, --log               write the interval reports to FILE as CSV\n\
   -w, --write             Do write I/Os.\n\
+  -V, --verify            write stamped data, read every write back and\n\
+                          check it. Exits with 1 on a mismatch\n\
+  -T, --pi                move T10 PI with the data (WRPROTECT/RDPROTECT\n\
+                          1): generate the tuples of every write, check\n\
+                          the ones of every read. Exits with 1 on a bad\n\
+                          tuple. The devices have to be formatted with PI\n\
+  -M, --rwmix             percentage of read I/Os, the rest are writes\n\
+  -B, --bsmix             weighted I/O sizes, e.g. 4k:60,64k:30,1m:10\n\
   -o, --outstanding       number of outstanding I/O requests. Default is 1\n\
+  -q, --batch             max number of requests pushed with one write().\n\
+                          Default is 1\n\
+  -H, --hugepage          back the I/O buffers with 2MB pages\n\
+  -L, --mlock             lock the I/O buffers in memory\n\
+  -A, --align             alignment of the I/O buffers. Default is the\n\
+                          page size\n\
+  -t, --threads           number of worker threads, the devices are spread\n\
+                          across them. 0 means one thread per device.\n\
+                          Default is 1\n\
+  -p, --pin               pin each worker thread to its own CPU\n\
+  -P, --pattern           access pattern: seq, rand, zipf[:THETA],\n\
+                          pareto[:H] or hotcold[:HOT:ACCESS] (ACCESS%% of\n\
+                          the I/Os go to HOT%% of the range). Default is seq\n\
+  -s, --seed              seed of the random patterns\n\
+  -O, --offset            start of the range to access, in bytes\n\
+  -S, --size              size of the range to access, in bytes\n\
   -h, --help              display this help and exit\n\
+\n\
+A DEVICE is /sys/class/bsg/NAME, /dev/bsg/NAME or emu:SPEC, an emulated\n\
+disk, e.g. emu:ram,size=4g,lat=100,qd=64 (see libemu.h)\n\
 ");
 	}
 	exit(status);
 }
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-#define __be32_to_cpu(x) bswap_32(x)
-#else
-#define __be32_to_cpu(x) (x)
-#endif
+enum {
+	PATTERN_SEQ,
+	PATTERN_RAND,
+	PATTERN_ZIPF,
+	PATTERN_PARETO,
+	PATTERN_HOTCOLD,
+};
 
-static int get_capacity(int fd, uint64_t *size)
-{
-	unsigned char scb[10], sense[32];
-	unsigned int buf[2];
-	int ret;
-	struct sg_io_v4 hdr;
+static const char *pattern_name[] = {
+	"seq", "rand", "zipf", "pareto", "hotcold",
+};
 
-	memset(scb, 0, sizeof(scb));
-	memset(buf, 0, sizeof(buf));
-	memset(&hdr, 0, sizeof(hdr));
+struct zipf_state {
+	uint64_t n;
+	double theta;
+	double h_x1;
+	double h_n;
+	double s;
+};
 
-	scb[0] = READ_CAPACITY;
+enum {
+	DIR_READ,
+	DIR_WRITE,
+	DIR_NR,
+};
 
-	setup_sgv4_hdr(&hdr, scb, sizeof(scb), sense, sizeof(sense),
-		       (char *)buf, sizeof(buf), NULL, 0);
+static const char *dir_name[] = {
+	"read", "write",
+};
 
-	ret = ioctl(fd, SG_IO, &hdr);
-	if (ret) {
-		fprintf(stderr, "%m\n");
-		return ret;
-	}
+#define MAX_BS_MIX 16
 
-	*size = (uint64_t)__be32_to_cpu(buf[0]) * (uint64_t)__be32_to_cpu(buf[1]);
+struct bench_stat {
+	unsigned long long done;
+	unsigned long long bytes;
+	struct lat_hist lat;
+};
 
-	return 0;
-}
+/* what we keep per queue request, indexed by its tag */
+struct bench_req {
+	uint64_t submit_ns;
+	int dir;
+	int len;
+	uint64_t offset;
+	char *buf;
+};
 
 struct bsg_dev_info {
 	int fd;
 	uint64_t size;
+	struct bsg_capacity cap;
+	unsigned long long misaligned;
+
+	unsigned long long done;
 
-	int done;
-	int outstanding;
+	struct bsg_queue q;
+	struct bench_req *reqs;
+	struct bsg_req **readback_reqs;
+	int nr_readback;
+	struct bsg_arena arena;
+
+	unsigned long long verified;
+	unsigned long long verify_errors;
+
+	/* --pi, the host side of it */
+	unsigned long long pi_blocks;
+	unsigned long long pi_errors;
+	uint64_t pi_ns;
+
+	uint64_t start;
+	uint64_t nr_blocks;
+	uint64_t cursor;
+	uint64_t scramble;
+	struct zipf_state zipf;
+
+	struct bench_stat stat[DIR_NR];
 };
 
-static struct bsg_dev_info bi[MAX_DEVICE_NR];
+struct bench_worker {
+	pthread_t thread;
+	int id;
+	int cpu;
+
+	int nr;
+	struct bsg_dev_info **bi;
+
+	/* the requests of the batch being built, for the timestamps */
+	struct bench_req **batch;
+	uint64_t rand[4];
+
+	unsigned long long submit_calls;
+	unsigned long long reap_calls;
+	unsigned long long wakeups;
+	unsigned long long events;
+
+	long double elapsed_sec;
+	long double cpu_sec;
 
-static void loop(int nr, int total, int max_outstanding, int bs, int rw)
+	size_t buf_mem;
+	int arena_flags;
+};
+
+static struct bsg_dev_info *bi;
+
+static unsigned long long total = 1;
+static int max_outstanding = 32;
+static int batch = 1;
+static int buf_align;
+static int arena_flags = BSG_ARENA_PREFAULT;
+static int bs = SECTOR_SIZE;
+static int max_bs;
+static int read_pct = 100;
+static char *bsmix;
+static int bs_nr;
+static int bs_size[MAX_BS_MIX];
+static unsigned int bs_weight[MAX_BS_MIX];
+static unsigned int bs_weight_sum;
+static int pin_cpu;
+static int pattern = PATTERN_SEQ;
+static double zipf_theta, pareto_pow;
+static unsigned int hot_size_pct, hot_access_pct;
+static uint64_t seed;
+static uint64_t range_offset, range_size;
+static double runtime, interval;
+static FILE *log_fp;
+
+static int verify;
+static uint64_t verify_gen;
+
+static int pi;
+
+static volatile sig_atomic_t stop;
+static int interrupted;
+
+static pthread_barrier_t start_barrier;
+
+static pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t running_cond;
+static int nr_running;
+
+static long double tv_diff_sec(struct timeval *a, struct timeval *b)
 {
-	int i, ret, no_more_submit = 0;
-	char *buf;
-	unsigned char scb[10], sense[32];
-	struct sg_io_v4 *hdrs, hdr;
-	struct timeval a, b;
 	unsigned long long aa, bb;
-	long double elasped_sec;
-	unsigned long long sent_bytes;
-	unsigned long long total_sent_bytes;
-	struct pollfd pfd[MAX_DEVICE_NR];
+
+	aa = a->tv_sec * 1000 * 1000 + a->tv_usec;
+	bb = b->tv_sec * 1000 * 1000 + b->tv_usec;
+
+	return (bb - aa) / (1000 * 1000.0);
+}
+
+static long double thread_cpu_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / (1000 * 1000 * 1000.0);
+}
+
+/*
+ * xoshiro256** seeded with splitmix64: a few shifts and multiplies per
+ * offset, so the generator doesn't show up next to the I/O path.
+ */
+static uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t rand_next(uint64_t *s)
+{
+	uint64_t r = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return r;
+}
+
+static void rand_seed(uint64_t *s, uint64_t seed)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		s[i] = z ^ (z >> 31);
+	}
+}
+
+/* uniform in [0, n) without a division */
+static uint64_t rand_below(uint64_t *s, uint64_t n)
+{
+	return ((unsigned __int128)rand_next(s) * n) >> 64;
+}
+
+/* uniform in [0, 1) */
+static double rand_double(uint64_t *s)
+{
+	return (rand_next(s) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Zipf by rejection-inversion (Hormann and Derflinger), which needs no
+ * per-element table, so it works for billions of blocks.
+ */
+static double zipf_helper1(double x)
+{
+	if (fabs(x) > 1e-8)
+		return log1p(x) / x;
+	return 1 - x * (0.5 - x * (1 / 3.0 - 0.25 * x));
+}
+
+static double zipf_helper2(double x)
+{
+	if (fabs(x) > 1e-8)
+		return expm1(x) / x;
+	return 1 + x * 0.5 * (1 + x * (1 / 3.0) * (1 + 0.25 * x));
+}
+
+static double zipf_h(struct zipf_state *z, double x)
+{
+	return exp(-z->theta * log(x));
+}
+
+static double zipf_h_integral(struct zipf_state *z, double x)
+{
+	double log_x = log(x);
+
+	return zipf_helper2((1 - z->theta) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inv(struct zipf_state *z, double x)
+{
+	double t = x * (1 - z->theta);
+
+	if (t < -1)
+		t = -1;
+
+	return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(struct zipf_state *z, uint64_t n, double theta)
+{
+	z->n = n;
+	z->theta = theta;
+	z->h_x1 = zipf_h_integral(z, 1.5) - 1;
+	z->h_n = zipf_h_integral(z, n + 0.5);
+	z->s = 2 - zipf_h_integral_inv(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+/* returns a rank in [1, n] */
+static uint64_t zipf_next(struct zipf_state *z, uint64_t *s)
+{
+	double u, x;
+	uint64_t k;
+
+	while (1) {
+		u = z->h_n + rand_double(s) * (z->h_x1 - z->h_n);
+		x = zipf_h_integral_inv(z, u);
+		k = x + 0.5;
+		if (k < 1)
+			k = 1;
+		else if (k > z->n)
+			k = z->n;
+
+		if (k - x <= z->s ||
+		    u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k))
+			return k;
+	}
+}
+
+/*
+ * The skewed patterns pick a popularity rank; spread the ranks over
+ * the range so that the hot blocks aren't all at the start.
+ */
+static uint64_t scramble(struct bsg_dev_info *dev, uint64_t rank)
+{
+	return ((unsigned __int128)rank * dev->scramble) % dev->nr_blocks;
+}
+
+/*
+ * Offsets are multiples of the smallest block size (bs) and every
+ * block of nr_blocks can take the largest I/O of the mix.
+ */
+static uint64_t next_offset(struct bench_worker *w, struct bsg_dev_info *dev,
+			    int len)
+{
+	uint64_t blk, hot;
+
+	switch (pattern) {
+	case PATTERN_RAND:
+		blk = rand_below(w->rand, dev->nr_blocks);
+		break;
+	case PATTERN_ZIPF:
+		blk = scramble(dev, zipf_next(&dev->zipf, w->rand) - 1);
+		break;
+	case PATTERN_PARETO:
+		blk = dev->nr_blocks * pow(rand_double(w->rand), pareto_pow);
+		blk = scramble(dev, blk);
+		break;
+	case PATTERN_HOTCOLD:
+		hot = dev->nr_blocks * hot_size_pct / 100;
+		if (!hot)
+			hot = 1;
+		if (hot < dev->nr_blocks &&
+		    rand_below(w->rand, 100) >= hot_access_pct)
+			blk = hot + rand_below(w->rand, dev->nr_blocks - hot);
+		else
+			blk = rand_below(w->rand, hot);
+		blk = scramble(dev, blk);
+		break;
+	default:
+		if (dev->cursor >= dev->nr_blocks)
+			dev->cursor = 0;
+		blk = dev->cursor;
+		dev->cursor += (len + bs - 1) / bs;
+		break;
+	}
+
+	return dev->start + blk * bs;
+}
+
+static int next_bs(struct bench_worker *w)
+{
+	unsigned int r;
+	int i;
+
+	if (bs_nr == 1)
+		return bs_size[0];
+
+	r = rand_below(w->rand, bs_weight_sum);
+	for (i = 0; r >= bs_weight[i]; i++)
+		r -= bs_weight[i];
+
+	return bs_size[i];
+}
+
+static int next_dir(struct bench_worker *w)
+{
+	if (read_pct == 100)
+		return DIR_READ;
+	if (!read_pct)
+		return DIR_WRITE;
+
+	return rand_below(w->rand, 100) < read_pct ? DIR_READ : DIR_WRITE;
+}
+
+/*
+ * --verify stamps every 512 bytes written with its sector number, the
+ * generation of the run and a pattern derived from the seed, closed by
+ * a crc32c. Every write is then read back into the same buffer and
+ * checked, which only costs a crc32c pass over the data.
+ */
+#define STAMP_CRC_OFF	(SECTOR_SIZE - 4)
+#define STAMP_BATCH	8
+#define MAX_VERIFY_LOG	16
+
+static unsigned char stamp_template[SECTOR_SIZE];
+
+static void stamp_init(void)
+{
+	uint64_t s[4], v;
+	int i;
+
+	rand_seed(s, seed ^ verify_gen);
+	for (i = 16; i + 8 <= STAMP_CRC_OFF; i += 8) {
+		v = rand_next(s);
+		memcpy(stamp_template + i, &v, sizeof(v));
+	}
+}
+
+static void stamp_fill(char *buf, int len, uint64_t offset)
+{
+	uint64_t lba = offset / SECTOR_SIZE;
+	uint32_t crc[STAMP_BATCH];
+	int i, j, n, nr = len / SECTOR_SIZE;
+	char *p;
+
+	for (i = 0; i < nr; i += n) {
+		n = nr - i < STAMP_BATCH ? nr - i : STAMP_BATCH;
+		p = buf + i * SECTOR_SIZE;
+
+		for (j = 0; j < n; j++, lba++) {
+			memcpy(p + j * SECTOR_SIZE, stamp_template, SECTOR_SIZE);
+			memcpy(p + j * SECTOR_SIZE, &lba, sizeof(lba));
+			memcpy(p + j * SECTOR_SIZE + 8, &verify_gen,
+			       sizeof(verify_gen));
+		}
+
+		crc32c_blocks(p, SECTOR_SIZE, STAMP_CRC_OFF, n, crc);
+
+		for (j = 0; j < n; j++)
+			memcpy(p + j * SECTOR_SIZE + STAMP_CRC_OFF, &crc[j],
+			       sizeof(crc[j]));
+	}
+}
+
+/* so that a read which transfers nothing can't pass the check */
+static void stamp_poison(char *buf, int len)
+{
+	uint64_t bad = ~verify_gen;
+	char *p;
+
+	for (p = buf; p < buf + len; p += SECTOR_SIZE)
+		memcpy(p + 8, &bad, sizeof(bad));
+}
+
+static void stamp_check(struct bsg_dev_info *dev, char *buf, int len,
+			uint64_t offset)
+{
+	uint64_t lba = offset / SECTOR_SIZE, got_lba, got_gen;
+	uint32_t crc[STAMP_BATCH], got_crc;
+	int i, j, n, nr = len / SECTOR_SIZE;
+	char *p;
+
+	for (i = 0; i < nr; i += n) {
+		n = nr - i < STAMP_BATCH ? nr - i : STAMP_BATCH;
+		p = buf + i * SECTOR_SIZE;
+
+		crc32c_blocks(p, SECTOR_SIZE, STAMP_CRC_OFF, n, crc);
+
+		for (j = 0; j < n; j++, lba++) {
+			memcpy(&got_lba, p + j * SECTOR_SIZE, sizeof(got_lba));
+			memcpy(&got_gen, p + j * SECTOR_SIZE + 8, sizeof(got_gen));
+			memcpy(&got_crc, p + j * SECTOR_SIZE + STAMP_CRC_OFF,
+			       sizeof(got_crc));
+
+			if (got_crc == crc[j] && got_lba == lba &&
+			    got_gen == verify_gen)
+				continue;
+
+			if (dev->verify_errors++ < MAX_VERIFY_LOG)
+				fprintf(stderr, "verify error: sector %" PRIu64
+					", got sector %" PRIu64 " gen %" PRIx64
+					" crc %s\n", lba, got_lba, got_gen,
+					got_crc == crc[j] ? "ok" : "bad");
+		}
+	}
+
+	dev->verified += nr;
+}
+
+/*
+ * --pi: the buffers hold the data interleaved with the tuples, and the
+ * ref tags count the logical blocks. The time of the CRCs is what PI
+ * costs the host.
+ */
+static void pi_fill(struct bsg_dev_info *dev, struct bench_req *br)
+{
+	unsigned int lbs = dev->cap.block_size;
+	int nr = br->len / lbs;
+	uint64_t t = lat_now_ns();
+
+	pi_generate(br->buf, lbs, nr, dev->cap.pi_type, br->offset / lbs, 0);
+
+	dev->pi_ns += lat_now_ns() - t;
+	dev->pi_blocks += nr;
+}
+
+static void pi_check(struct bsg_dev_info *dev, struct bench_req *br)
+{
+	unsigned int lbs = dev->cap.block_size;
+	int ret, bad, nr = br->len / lbs;
+	uint64_t t = lat_now_ns();
+
+	ret = pi_verify(br->buf, lbs, nr, dev->cap.pi_type, br->offset / lbs,
+			&bad);
+
+	dev->pi_ns += lat_now_ns() - t;
+	dev->pi_blocks += nr;
+
+	if (ret && dev->pi_errors++ < MAX_VERIFY_LOG)
+		fprintf(stderr, "pi error: lba %" PRIu64 ", bad %s\n",
+			br->offset / lbs + bad,
+			ret == T10_PI_GUARD_ERR ? "guard" : "ref tag");
+}
+
+/*
+ * Push the queued requests with one write(). bsg takes as many of
+ * them as it can; the rest stay queued and go out with the next
+ * flush. Returns 0 when something was left behind.
+ */
+static int flush(struct bench_worker *w, struct bsg_dev_info *dev, int nr)
+{
+	uint64_t now;
+	int i, ret;
+
+	now = lat_now_ns();
+	for (i = 0; i < nr; i++)
+		w->batch[i]->submit_ns = now;
+
+	ret = bsg_queue_submit(&dev->q);
+	if (ret < 0) {
+		fprintf(stderr, "fail to write bsg dev, %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	return !dev->q.queued;
+}
+
+/*
+ * Every request in use will end up as one done, including the pending
+ * read backs of --verify, which hold on to their slot.
+ */
+static int can_start(struct bsg_dev_info *dev)
+{
+	return dev->q.nr_free &&
+		total > bsg_queue_busy(&dev->q) + dev->nr_readback + dev->done;
+}
+
+static void submit(struct bench_worker *w, struct bsg_dev_info *dev)
+{
+	struct bench_req *br;
+	struct bsg_req *req;
+	int nr;
+
+	/* left over from a short write */
+	if (dev->q.queued && !flush(w, dev, 0))
+		return;
+
+	while (!stop && (dev->nr_readback || can_start(dev))) {
+		for (nr = 0; nr < batch; nr++) {
+			if (dev->nr_readback) {
+				req = dev->readback_reqs[--dev->nr_readback];
+				br = &dev->reqs[req->tag];
+				br->dir = DIR_READ;
+				stamp_poison(br->buf, br->len);
+			} else if (can_start(dev)) {
+				req = bsg_get_req(&dev->q);
+				br = &dev->reqs[req->tag];
+				br->dir = verify ? DIR_WRITE : next_dir(w);
+				br->len = next_bs(w);
+				br->offset = next_offset(w, dev, br->len);
+				if (bsg_phys_misaligned(&dev->cap, br->len,
+							br->offset) &&
+				    !dev->misaligned++)
+					fprintf(stderr, "warning: %d bytes at %" PRIu64
+						" isn't aligned to the %u byte "
+						"physical block, writes will be "
+						"read-modify-write\n", br->len,
+						br->offset,
+						dev->cap.phys_block_size);
+				if (verify)
+					stamp_fill(br->buf, br->len,
+						   br->offset);
+				if (pi && br->dir == DIR_WRITE)
+					pi_fill(dev, br);
+			} else
+				break;
+
+			if (pi)
+				bsg_req_prep_rw_pi(req, br->dir == DIR_WRITE,
+						   br->buf, br->len, br->offset,
+						   dev->cap.block_size,
+						   dev->cap.pi_type);
+			else
+				bsg_req_prep_rw(req, br->dir == DIR_WRITE,
+						br->buf, br->len, br->offset,
+						dev->cap.block_size);
+			bsg_queue_rq(&dev->q, req);
+			w->batch[nr] = br;
+		}
+
+		if (!flush(w, dev, nr))
+			break;
+	}
+}
+
+static void bench_done(struct bsg_queue *q, struct bsg_req *req)
+{
+	struct bsg_dev_info *dev = req->priv;
+	struct bench_req *br = &dev->reqs[req->tag];
+	struct bench_stat *st;
+	int err = sgv4_rsp_check(&req->hdr);
+
+	st = &dev->stat[br->dir];
+	st->done++;
+	st->bytes += br->len;
+	hist_record(&st->lat, lat_now_ns() - br->submit_ns);
+
+	if (err)
+		fprintf(stderr, "error %u %u %u\n", req->hdr.driver_status,
+			req->hdr.transport_status, req->hdr.device_status);
+
+	if (verify && br->dir == DIR_WRITE && !err) {
+		dev->readback_reqs[dev->nr_readback++] = req;
+		return;
+	}
+
+	if (verify && !err)
+		stamp_check(dev, br->buf, br->len, br->offset);
+
+	if (pi && br->dir == DIR_READ && !err)
+		pi_check(dev, br);
+
+	dev->done++;
+	bsg_put_req(q, req);
+}
+
+/*
+ * The fds are registered edge-triggered, bsg_queue_reap() drains all
+ * the completed requests on the non-blocking fd.
+ */
+static void reap(struct bench_worker *w, struct bsg_dev_info *dev)
+{
+	int ret;
+
+	ret = bsg_queue_reap(&dev->q);
+	if (ret < 0) {
+		fprintf(stderr, "fail to read from bsg dev, %s\n",
+			strerror(-ret));
+		exit(1);
+	}
+}
+
+/*
+ * Called from the worker, so the buffers are faulted in on the node
+ * the worker runs on.
+ */
+static void init_reqs(struct bench_worker *w, struct bsg_dev_info *dev)
+{
+	int i, ret, align;
+	size_t slot_size = max_bs;
+
+	ret = bsg_queue_init(&dev->q, dev->fd, max_outstanding, 0);
+	if (ret) {
+		fprintf(stderr, "can't set up the queue, %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	dev->reqs = calloc(max_outstanding, sizeof(*dev->reqs));
+	dev->readback_reqs = malloc(sizeof(*dev->readback_reqs) *
+				    max_outstanding);
+	if (!dev->reqs || !dev->readback_reqs) {
+		fprintf(stderr, "oom %m\n");
+		exit(1);
+	}
+
+	align = buf_align;
+	if (align && align < dev->cap.block_size)
+		align = dev->cap.block_size;
+
+	if (pi)
+		slot_size = pi_xfer_len(max_bs, dev->cap.block_size);
+
+	ret = bsg_arena_init(&dev->arena, max_outstanding, slot_size, align,
+			     arena_flags);
+	if (ret) {
+		fprintf(stderr, "can't allocate the buffers, %s\n",
+			strerror(-ret));
+		exit(1);
+	}
+
+	w->buf_mem += dev->arena.map_len;
+	w->arena_flags |= dev->arena.flags;
+
+	for (i = 0; i < max_outstanding; i++) {
+		dev->reqs[i].buf = bsg_arena_slot(&dev->arena, i);
+		dev->q.reqs[i].priv = dev;
+		dev->q.reqs[i].done = bench_done;
+	}
+
+	for (i = 0; i < DIR_NR; i++)
+		hist_init(&dev->stat[i].lat);
+}
+
+static void exit_reqs(struct bsg_dev_info *dev)
+{
+	bsg_arena_exit(&dev->arena);
+	bsg_queue_exit(&dev->q);
+	free(dev->reqs);
+	free(dev->readback_reqs);
+}
+
+static void *loop(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct bsg_dev_info **bi = w->bi;
+	int i, ret, epfd, nr = w->nr, active = w->nr;
+	struct epoll_event ev, *events;
+	struct timeval a, b;
+	long double cpu;
+
+	rand_seed(w->rand, seed + w->id);
+
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret) {
+			fprintf(stderr, "can't pin worker %d to cpu %d, %s\n",
+				w->id, w->cpu, strerror(ret));
+			exit(1);
+		}
+	}
+
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		fprintf(stderr, "can't create epoll, %m\n");
+		exit(1);
+	}
 
 	for (i = 0; i < nr; i++) {
-		ret = fcntl(bi[i].fd, F_GETFL);
+		ret = fcntl(bi[i]->fd, F_GETFL);
 		if (ret < 0) {
 			fprintf(stderr, "can't set non-blocking %m\n");
 			exit(1);
 		}
 
-		ret = fcntl(bi[i].fd, F_SETFL, ret | O_NONBLOCK);
+		ret = fcntl(bi[i]->fd, F_SETFL, ret | O_NONBLOCK);
 		if (ret == -1) {
 			fprintf(stderr, "can't set non-blocking %m\n");
 			exit(1);
 		}
 
-		pfd[i].fd = bi[i].fd;
-		pfd[i].events = POLLIN;
-		pfd[i].revents = 0;
-	}
+		init_reqs(w, bi[i]);
 
-	buf = valloc(bs);
-	if (!buf) {
-		fprintf(stderr, "oom %m\n");
-		exit(1);
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = bi[i];
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, bi[i]->fd, &ev);
+		if (ret) {
+			fprintf(stderr, "can't add to epoll, %m\n");
+			exit(1);
+		}
 	}
 
-	hdrs = malloc(sizeof(hdr) * max_outstanding * nr);
-	if (!hdrs) {
+	w->batch = malloc(sizeof(*w->batch) * batch);
+	events = malloc(sizeof(*events) * nr);
+	if (!w->batch || !events) {
 		fprintf(stderr, "oom %m\n");
 		exit(1);
 	}
 
+	pthread_barrier_wait(&start_barrier);
+
 	gettimeofday(&a, NULL);
-	while (1) {
-		for (i = 0; i < nr && !no_more_submit; i++) {
+	cpu = thread_cpu_sec();
+
+	for (i = 0; i < nr; i++) {
+		submit(w, bi[i]);
+		if (!bsg_queue_busy(&bi[i]->q))
+			active--;
+	}
 
-			if (max_outstanding == bi[i].outstanding ||
-			    total == bi[i].outstanding + bi[i].done)
+	while (active) {
+		ret = epoll_wait(epfd, events, nr, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
 				continue;
-		again:
-			setup_rw_scb(scb, sizeof(scb), rw, bs,
-				     ((bs * (bi[i].done + bi[i].outstanding)) % bi[i].size));
+			fprintf(stderr, "failed to poll from bsg dev, %m\n");
+			exit(1);
+		}
 
-			if (rw == READ_10)
-				setup_sgv4_hdr(&hdr, scb, sizeof(scb), sense,
-					       sizeof(sense), buf, bs, NULL, 0);
-			else
-				setup_sgv4_hdr(&hdr, scb, sizeof(scb), sense,
-					       sizeof(sense), NULL, 0, buf, bs);
+		w->wakeups++;
+		w->events += ret;
 
-			hdr.flags |= BSG_FLAG_Q_AT_TAIL;
+		for (i = 0; i < ret; i++) {
+			struct bsg_dev_info *dev = events[i].data.ptr;
 
-			ret = write(bi[i].fd, &hdr, sizeof(hdr));
-			if (ret < 0) {
-				fprintf(stderr, "fail to write bsg dev, %m\n");
-				exit(1);
-			}
+			reap(w, dev);
+			submit(w, dev);
+
+			/* finished, or stopped by --runtime or a signal */
+			if (!bsg_queue_busy(&dev->q))
+				active--;
+		}
+	}
+
+	w->cpu_sec = thread_cpu_sec() - cpu;
+	gettimeofday(&b, NULL);
 
-			bi[i].outstanding++;
+	w->elapsed_sec = tv_diff_sec(&a, &b);
+
+	for (i = 0; i < nr; i++) {
+		w->submit_calls += bi[i]->q.submit_calls;
+		w->reap_calls += bi[i]->q.reap_calls;
+		exit_reqs(bi[i]);
+	}
+
+	close(epfd);
+	free(events);
+	free(w->batch);
+
+	pthread_mutex_lock(&running_lock);
+	nr_running--;
+	pthread_cond_signal(&running_cond);
+	pthread_mutex_unlock(&running_lock);
+
+	return NULL;
+}
 
-			if (max_outstanding > bi[i].outstanding &&
-			    total > bi[i].outstanding + bi[i].done)
-				goto again;
+static void print_stat(const char *prefix, int dir, struct bench_stat *st,
+		       long double elapsed_sec)
+{
+	char buf[32];
+
+	if (!st->done)
+		return;
+
+	snprintf(buf, sizeof(buf), "%s%s ", prefix, dir_name[dir]);
+
+	printf("%sdone : %llu\n", buf, st->done);
+	printf("%sbandwidth : %Lf [MB/s]\n", buf,
+	       st->bytes / elapsed_sec / 1024.0 / 1024.0);
+	printf("%siops : %Lf\n", buf, st->done / elapsed_sec);
+	hist_print(stdout, buf, &st->lat);
+}
+
+/*
+ * The workers update their counters without any locking, so this is
+ * a racy snapshot; the numbers of an interval may be off by a few
+ * in-flight completions, which is fine for reporting.
+ */
+static void report_interval(int nr, long double t, long double dt)
+{
+	static struct bench_stat prev[DIR_NR], cur[DIR_NR];
+	static struct lat_hist lat;
+	static int initialized;
+	unsigned long long done, bytes;
+	int i, d;
+
+	if (!initialized) {
+		for (d = 0; d < DIR_NR; d++)
+			hist_init(&prev[d].lat);
+		initialized = 1;
+	}
+
+	for (d = 0; d < DIR_NR; d++) {
+		cur[d].done = cur[d].bytes = 0;
+		hist_init(&cur[d].lat);
+
+		for (i = 0; i < nr; i++) {
+			cur[d].done += bi[i].stat[d].done;
+			cur[d].bytes += bi[i].stat[d].bytes;
+			hist_merge(&cur[d].lat, &bi[i].stat[d].lat);
 		}
 
-		ret = poll(pfd, nr, -1);
-		if (ret < 0) {
-			fprintf(stderr, "failed to poll from bsg dev, %m\n");
-			exit(1);
+		done = cur[d].done - prev[d].done;
+		bytes = cur[d].bytes - prev[d].bytes;
+		hist_sub(&lat, &cur[d].lat, &prev[d].lat);
+
+		if (log_fp)
+			fprintf(log_fp, "%.3Lf,%s,%.1Lf,%.3Lf,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+				t, dir_name[d], done / dt,
+				bytes / dt / 1024.0 / 1024.0,
+				hist_percentile(&lat, 50) / 1000.0,
+				hist_percentile(&lat, 99) / 1000.0,
+				hist_percentile(&lat, 99.9) / 1000.0,
+				hist_percentile(&lat, 99.99) / 1000.0,
+				lat.nr ? lat.max / 1000.0 : 0);
+		else if (done || (d == DIR_READ && read_pct) ||
+			 (d == DIR_WRITE && read_pct != 100))
+			printf("[%.1Lfs] %s : %.0Lf iops, %.2Lf MB/s, "
+			       "lat p50/p99/p99.9/p99.99 %.1f/%.1f/%.1f/%.1f [us]\n",
+			       t, dir_name[d], done / dt,
+			       bytes / dt / 1024.0 / 1024.0,
+			       hist_percentile(&lat, 50) / 1000.0,
+			       hist_percentile(&lat, 99) / 1000.0,
+			       hist_percentile(&lat, 99.9) / 1000.0,
+			       hist_percentile(&lat, 99.99) / 1000.0);
+
+		memcpy(&prev[d], &cur[d], sizeof(cur[d]));
+	}
+
+	fflush(log_fp ? log_fp : stdout);
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+/* sleep until the workers finish, reporting the intervals meanwhile */
+static void wait_workers(int nr)
+{
+	uint64_t start, now, last, next_tick = 0, end = 0, deadline;
+	struct timespec ts;
+
+	start = last = lat_now_ns();
+	if (interval)
+		next_tick = start + interval * 1000000000ULL;
+	if (runtime)
+		end = start + runtime * 1000000000ULL;
+
+	pthread_mutex_lock(&running_lock);
+	while (nr_running) {
+		now = lat_now_ns();
+
+		if (end && now >= end) {
+			stop = 1;
+			end = 0;
 		}
 
-		for (i = 0; i < nr; i++) {
-			int j, done;
+		if (next_tick && now >= next_tick) {
+			pthread_mutex_unlock(&running_lock);
+			report_interval(nr, (now - start) / 1000000000.0L,
+					(now - last) / 1000000000.0L);
+			pthread_mutex_lock(&running_lock);
 
-			if (!(pfd[i].revents & POLLIN))
-				continue;
+			last = now;
+			while (next_tick <= now)
+				next_tick += interval * 1000000000ULL;
 
-			pfd[i].revents = 0;
+			/* the last worker may have gone while we were unlocked */
+			continue;
+		}
 
-			done = read(bi[i].fd, hdrs,
-				    sizeof(hdr) * max_outstanding * nr);
-			if (done < 0) {
-				fprintf(stderr, "fail to read from bsg dev, %m\n");
-				exit(1);
-			}
+		deadline = next_tick;
+		if (end && (!deadline || end < deadline))
+			deadline = end;
 
-			done /= sizeof(hdr);
+		if (deadline) {
+			ns_to_timespec(deadline, &ts);
+			pthread_cond_timedwait(&running_cond, &running_lock, &ts);
+		} else
+			pthread_cond_wait(&running_cond, &running_lock);
+	}
+	pthread_mutex_unlock(&running_lock);
+}
 
-			bi[i].outstanding -= done;
-			bi[i].done += done;
+static void sigint_handler(int sig)
+{
+	stop = 1;
+	interrupted = 1;
+}
 
-			if (bi[i].done == total) {
-				pfd[i].events = 0;
-				no_more_submit++;
-			}
+static void print_syscalls(const char *prefix, unsigned long long submit_calls,
+			   unsigned long long reap_calls,
+			   unsigned long long wakeups, unsigned long long done)
+{
+	if (!done)
+		return;
+
+	printf("%ssyscalls per I/O : %Lf (write %Lf, read %Lf, epoll_wait %Lf)\n",
+	       prefix,
+	       (long double)(submit_calls + reap_calls + wakeups) / done,
+	       (long double)submit_calls / done,
+	       (long double)reap_calls / done,
+	       (long double)wakeups / done);
+}
 
-			for (j = 0; j < done; j++) {
-				if (sgv4_rsp_check(&hdr))
-					fprintf(stderr, "error %u %u %u\n",
-						hdrs[j].driver_status,
-						hdrs[j].transport_status,
-						hdrs[j].device_status);
-			}
+static void print_pi(const char *prefix, unsigned long long blocks,
+		     unsigned long long bytes, unsigned long long errors,
+		     uint64_t ns, unsigned long long done)
+{
+	printf("%spi : %llu [blocks] generated or checked, %llu errors\n",
+	       prefix, blocks, errors);
+	printf("%spi cpu per I/O : %Lf [us], %Lf [GB/s]\n", prefix,
+	       done ? (long double)ns / 1000 / done : 0,
+	       ns ? (long double)bytes / ns : 0);
+}
+
+/* returns the number of verify and PI errors */
+static unsigned long long run(int nr, int nr_workers)
+{
+	int i, ret, nr_cpus = 0, *cpus = NULL;
+	struct bench_worker *workers;
+	struct timeval a, b;
+	long double elasped_sec;
+	unsigned long long sent_bytes;
+	unsigned long long total_sent_bytes;
+	unsigned long long total_done;
+	unsigned long long total_verified = 0, total_verify_errors = 0;
+	unsigned long long total_pi_blocks = 0, total_pi_errors = 0;
+	unsigned long long total_pi_bytes = 0;
+	uint64_t total_pi_ns = 0;
+	long double total_cpu_sec = 0;
+	unsigned long long total_submit_calls = 0, total_reap_calls = 0;
+	unsigned long long total_wakeups = 0;
+	size_t total_buf_mem = 0;
+	int total_arena_flags = 0;
+	static struct bench_stat total_stat[DIR_NR];
+	int d;
+
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "oom %m\n");
+		exit(1);
+	}
+
+	if (pin_cpu) {
+		cpu_set_t set;
+
+		ret = sched_getaffinity(0, sizeof(set), &set);
+		if (ret) {
+			fprintf(stderr, "can't get the cpu affinity, %m\n");
+			exit(1);
 		}
 
-		if (no_more_submit) {
-			int outstanding = 0;
-			for (i = 0; i < nr; i++)
-				outstanding += bi[i].outstanding;
+		cpus = malloc(sizeof(*cpus) * CPU_COUNT(&set));
+		if (!cpus) {
+			fprintf(stderr, "oom %m\n");
+			exit(1);
+		}
 
-			if (!outstanding)
-				break;
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &set))
+				cpus[nr_cpus++] = i;
+	}
+
+	/* spread the devices across the workers in round-robin */
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].id = i;
+		workers[i].cpu = pin_cpu ? cpus[i % nr_cpus] : -1;
+		workers[i].bi = malloc(sizeof(*workers[i].bi) *
+				       (nr / nr_workers + 1));
+		if (!workers[i].bi) {
+			fprintf(stderr, "oom %m\n");
+			exit(1);
 		}
 	}
 
-	gettimeofday(&b, NULL);
+	for (i = 0; i < nr; i++) {
+		struct bench_worker *w = &workers[i % nr_workers];
 
-	aa = a.tv_sec * 1000 * 1000 + a.tv_usec;
-	bb = b.tv_sec * 1000 * 1000 + b.tv_usec;
+		w->bi[w->nr++] = &bi[i];
+	}
+
+	nr_running = nr_workers;
+
+	ret = pthread_barrier_init(&start_barrier, NULL, nr_workers + 1);
+	if (ret) {
+		fprintf(stderr, "can't init the barrier, %s\n", strerror(ret));
+		exit(1);
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		ret = pthread_create(&workers[i].thread, NULL, loop, &workers[i]);
+		if (ret) {
+			fprintf(stderr, "can't create a worker, %s\n",
+				strerror(ret));
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	gettimeofday(&a, NULL);
+
+	wait_workers(nr);
+
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
 
-	elasped_sec = (bb - aa) / (1000 * 1000.0);
+	gettimeofday(&b, NULL);
+
+	elasped_sec = tv_diff_sec(&a, &b);
 
-	printf("block size : %u\n", bs);
+	if (interrupted)
+		printf("interrupted, partial results\n");
+	if (bsmix)
+		printf("block size : %s\n", bsmix);
+	else
+		printf("block size : %u\n", bs);
+	printf("read percentage : %d\n", read_pct);
 	printf("outstanding : %u\n", max_outstanding);
+	printf("batch : %u\n", batch);
+	printf("threads : %u\n", nr_workers);
+	printf("pattern : %s\n", pattern_name[pattern]);
+	printf("seed : %" PRIu64 "\n", seed);
+	if (verify)
+		printf("verify generation : %" PRIx64 "\n", verify_gen);
 	printf("elapsed time : %Lf[s]\n", elasped_sec);
 
 	total_sent_bytes = 0;
+	total_done = 0;
+	for (d = 0; d < DIR_NR; d++)
+		hist_init(&total_stat[d].lat);
 
 	for (i = 0; i < nr; i++) {
-		sent_bytes = (unsigned long long)bi[i].done * (unsigned long long)bs;
+		sent_bytes = 0;
+		for (d = 0; d < DIR_NR; d++)
+			sent_bytes += bi[i].stat[d].bytes;
 		total_sent_bytes += sent_bytes;
-
-		printf("\n%dth device\n", i);
-		printf("done : %u\n", bi[i].done);
+		total_done += bi[i].stat[DIR_READ].done +
+			bi[i].stat[DIR_WRITE].done;
+		total_verified += bi[i].verified;
+		total_verify_errors += bi[i].verify_errors;
+		total_pi_blocks += bi[i].pi_blocks;
+		total_pi_errors += bi[i].pi_errors;
+		total_pi_bytes += bi[i].pi_blocks * bi[i].cap.block_size;
+		total_pi_ns += bi[i].pi_ns;
+
+		printf("\n%dth device (worker %d)\n", i, i % nr_workers);
+		printf("block size : %u logical, %u physical\n",
+		       bi[i].cap.block_size, bi[i].cap.phys_block_size);
+		printf("done : %llu\n", bi[i].done);
+		if (bi[i].misaligned)
+			printf("misaligned to the physical block : %llu\n",
+			       bi[i].misaligned);
 		printf("totalbyte : %llu [bytes]\n", sent_bytes);
 		printf("bandwidht : %Lf [KB/s], %Lf [MB/s]\n",
 		       sent_bytes / elasped_sec / 1024.0,
 		       sent_bytes / elasped_sec / 1024.0 / 1024.0);
+
+		for (d = 0; d < DIR_NR; d++) {
+			struct bench_stat *st = &bi[i].stat[d];
+
+			print_stat("", d, st, elasped_sec);
+
+			total_stat[d].done += st->done;
+			total_stat[d].bytes += st->bytes;
+			hist_merge(&total_stat[d].lat, &st->lat);
+		}
+
+		if (verify)
+			printf("verified : %llu [sectors], %llu errors\n",
+			       bi[i].verified, bi[i].verify_errors);
+		if (pi)
+			print_pi("", bi[i].pi_blocks,
+				 bi[i].pi_blocks * bi[i].cap.block_size,
+				 bi[i].pi_errors, bi[i].pi_ns,
+				 bi[i].stat[DIR_READ].done +
+				 bi[i].stat[DIR_WRITE].done);
 	}
 
-	if (nr)
+	for (i = 0; i < nr_workers; i++) {
+		struct bench_worker *w = &workers[i];
+		unsigned long long done = 0;
+		int j;
+
+		for (j = 0; j < w->nr; j++)
+			done += w->bi[j]->stat[DIR_READ].done +
+				w->bi[j]->stat[DIR_WRITE].done;
+
+		printf("\n%dth worker (cpu %d)\n", i, w->cpu);
+		printf("devices : %d\n", w->nr);
+		printf("elapsed time : %Lf[s]\n", w->elapsed_sec);
+		printf("iops : %Lf\n", done / w->elapsed_sec);
+		printf("cpu per I/O : %Lf [us]\n",
+		       done ? w->cpu_sec * 1000 * 1000 / done : 0);
+		printf("ready devices per wakeup : %Lf\n",
+		       w->wakeups ? (long double)w->events / w->wakeups : 0);
+		print_syscalls("", w->submit_calls, w->reap_calls,
+			       w->wakeups, done);
+
+		total_buf_mem += w->buf_mem;
+		total_arena_flags |= w->arena_flags;
+		total_submit_calls += w->submit_calls;
+		total_reap_calls += w->reap_calls;
+		total_wakeups += w->wakeups;
+
+		total_cpu_sec += w->cpu_sec;
+
+		free(w->bi);
+	}
+
+	if (nr) {
 		printf("\ntotal bandwidht : %Lf [KB/s], %Lf [MB/s]\n",
 		       total_sent_bytes / elasped_sec / 1024.0,
 		       total_sent_bytes / elasped_sec / 1024.0 / 1024.0);
+		printf("total iops : %Lf\n", total_done / elasped_sec);
+		for (d = 0; d < DIR_NR; d++)
+			print_stat("total ", d, &total_stat[d], elasped_sec);
+		printf("total cpu per I/O : %Lf [us]\n",
+		       total_done ? total_cpu_sec * 1000 * 1000 / total_done : 0);
+		print_syscalls("total ", total_submit_calls, total_reap_calls,
+			       total_wakeups, total_done);
+		if (verify)
+			printf("total verified : %llu [sectors], %llu errors\n",
+			       total_verified, total_verify_errors);
+		if (pi)
+			print_pi("total ", total_pi_blocks, total_pi_bytes,
+				 total_pi_errors, total_pi_ns, total_done);
+		printf("buffer memory : %.1f [MB] (%s%s)\n",
+		       total_buf_mem / 1024.0 / 1024.0,
+		       total_arena_flags & BSG_ARENA_HUGETLB ? "hugetlb" :
+		       total_arena_flags & BSG_ARENA_HUGEPAGE ? "thp" : "4k pages",
+		       total_arena_flags & BSG_ARENA_MLOCK ? ", locked" : "");
+	}
+
+	free(cpus);
+	free(workers);
+
+	return total_verify_errors + total_pi_errors;
 }
 
 static int parse_blocksize(char *str)
@@ -276,27 +1317,241 @@ static int parse_blocksize(char *str)
 	return v;
 }
 
+static uint64_t parse_size(char *str)
+{
+	uint64_t v;
+	char *p;
+
+	v = strtoull(str, &p, 0);
+	switch (*p) {
+	case 't':
+		v <<= 10;
+		/* fall through */
+	case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'k':
+		v <<= 10;
+		break;
+	}
+
+	return v;
+}
+
+/* "4k:60,64k:30,1m:10", a size without a weight counts as 1 */
+static int parse_bsmix(char *str)
+{
+	char *p, *w, *save = NULL;
+	int weight, ret = 0;
+
+	str = strdup(str);
+	if (!str)
+		return -ENOMEM;
+
+	for (p = strtok_r(str, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+		if (bs_nr == MAX_BS_MIX) {
+			ret = -EINVAL;
+			break;
+		}
+
+		w = strchr(p, ':');
+		if (w)
+			*w++ = '\0';
+
+		weight = w ? atoi(w) : 1;
+		if (weight < 0) {
+			ret = -EINVAL;
+			break;
+		}
+		if (!weight)
+			continue;
+
+		bs_size[bs_nr] = parse_blocksize(p);
+		bs_weight[bs_nr] = weight;
+		bs_weight_sum += bs_weight[bs_nr++];
+	}
+
+	free(str);
+
+	return ret ? ret : bs_nr ? 0 : -EINVAL;
+}
+
+static int parse_pattern(char *str)
+{
+	char *arg = strchr(str, ':');
+	double h;
+
+	if (arg)
+		*arg++ = '\0';
+
+	if (!strcmp(str, "seq"))
+		pattern = PATTERN_SEQ;
+	else if (!strcmp(str, "rand"))
+		pattern = PATTERN_RAND;
+	else if (!strcmp(str, "zipf")) {
+		pattern = PATTERN_ZIPF;
+		zipf_theta = arg ? atof(arg) : 1.2;
+		if (zipf_theta <= 0)
+			return -EINVAL;
+	} else if (!strcmp(str, "pareto")) {
+		pattern = PATTERN_PARETO;
+		h = arg ? atof(arg) : 0.2;
+		if (h <= 0 || h >= 1)
+			return -EINVAL;
+		pareto_pow = log(h) / log(1 - h);
+	} else if (!strcmp(str, "hotcold")) {
+		pattern = PATTERN_HOTCOLD;
+		hot_size_pct = 10;
+		hot_access_pct = 90;
+		if (arg && sscanf(arg, "%u:%u", &hot_size_pct,
+				  &hot_access_pct) != 2)
+			return -EINVAL;
+		if (!hot_size_pct || hot_size_pct > 100 ||
+		    hot_access_pct > 100)
+			return -EINVAL;
+	} else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int check_block_size(struct bsg_dev_info *dev)
+{
+	int i;
+
+	if (range_offset % dev->cap.block_size)
+		return -EINVAL;
+
+	for (i = 0; i < bs_nr; i++)
+		if (bs_size[i] % dev->cap.block_size)
+			return -EINVAL;
+
+	return 0;
+}
+
+static int setup_range(struct bsg_dev_info *dev)
+{
+	uint64_t len;
+
+	if (range_offset >= dev->size)
+		return -EINVAL;
+
+	len = dev->size - range_offset;
+	if (range_size && range_size < len)
+		len = range_size;
+
+	if (len < max_bs)
+		return -EINVAL;
+
+	dev->start = range_offset;
+	dev->nr_blocks = (len - max_bs) / bs + 1;
+
+	/* 2^31 - 1 is prime, so this is a permutation of the blocks */
+	dev->scramble = 2147483647ULL;
+	if (!(dev->nr_blocks % dev->scramble))
+		dev->scramble = 1;
+
+	if (pattern == PATTERN_ZIPF)
+		zipf_init(&dev->zipf, dev->nr_blocks, zipf_theta);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int longindex, ch;
-	int bs = SECTOR_SIZE, count = 1, i;
-	int rw = READ_10, max_outstanding = 32, ret;
+	int i, nr, nr_workers = 1, ret, has_seed = 0, has_count = 0;
+	int *fds;
+	struct sigaction sa;
+	pthread_condattr_t attr;
 
-	while ((ch = getopt_long(argc, argv, "b:c:wo:h", long_options,
+	while ((ch = getopt_long(argc, argv, "b:c:r:i:l:wVTM:B:o:q:HLA:t:pP:s:O:S:h", long_options,
 				 &longindex)) >= 0) {
 		switch (ch) {
 		case 'b':
 			bs = parse_blocksize(optarg);
 			break;
 		case 'c':
-			count = atoi(optarg);
+			total = strtoull(optarg, NULL, 0);
+			has_count = 1;
+			break;
+		case 'r':
+			runtime = atof(optarg);
+			break;
+		case 'i':
+			interval = atof(optarg);
+			break;
+		case 'l':
+			log_fp = fopen(optarg, "w");
+			if (!log_fp) {
+				fprintf(stderr, "can't open %s, %m\n", optarg);
+				exit(1);
+			}
+			fprintf(log_fp, "time,dir,iops,MB/s,p50,p99,p99.9,p99.99,max\n");
 			break;
 		case 'w':
-			rw = WRITE_10;
+			read_pct = 0;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		case 'T':
+			pi = 1;
+			break;
+		case 'M':
+			read_pct = atoi(optarg);
+			if (read_pct < 0 || read_pct > 100) {
+				fprintf(stderr, "The read percentage should be between 0 and 100\n");
+				exit(1);
+			}
+			break;
+		case 'B':
+			bsmix = optarg;
 			break;
 		case 'o':
 			max_outstanding = atoi(optarg);
 			break;
+		case 'q':
+			batch = atoi(optarg);
+			break;
+		case 'H':
+			arena_flags |= BSG_ARENA_HUGEPAGE;
+			break;
+		case 'L':
+			arena_flags |= BSG_ARENA_MLOCK;
+			break;
+		case 'A':
+			buf_align = parse_blocksize(optarg);
+			if (buf_align <= 0 || (buf_align & (buf_align - 1))) {
+				fprintf(stderr, "The alignment should be a power of 2\n");
+				exit(1);
+			}
+			break;
+		case 't':
+			nr_workers = atoi(optarg);
+			break;
+		case 'p':
+			pin_cpu = 1;
+			break;
+		case 'P':
+			if (parse_pattern(optarg)) {
+				fprintf(stderr, "invalid pattern\n");
+				exit(1);
+			}
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			has_seed = 1;
+			break;
+		case 'O':
+			range_offset = parse_size(optarg);
+			break;
+		case 'S':
+			range_size = parse_size(optarg);
+			break;
 		case 'h':
 			usage(0);
 			break;
@@ -306,49 +1561,162 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (bs % SECTOR_SIZE) {
-		fprintf(stderr, "The I/O size should be a multiple of %d\n",
+	if (runtime < 0 || interval < 0) {
+		fprintf(stderr, "The runtime and interval shouldn't be negative\n");
+		exit(1);
+	}
+
+	if (verify && pi) {
+		fprintf(stderr, "--verify and --pi can't be used together\n");
+		exit(1);
+	}
+
+	if (verify) {
+		read_pct = 0;
+		verify_gen = lat_now_ns();
+	}
+
+	if (runtime && !has_count)
+		total = ULLONG_MAX;
+
+	if (!has_seed)
+		seed = time(NULL) ^ getpid();
+
+	if (verify)
+		stamp_init();
+
+	if (range_offset % SECTOR_SIZE) {
+		fprintf(stderr, "The offset should be a multiple of %d\n",
 			SECTOR_SIZE);
 		exit(1);
 	}
 
+	if (bsmix) {
+		if (parse_bsmix(bsmix)) {
+			fprintf(stderr, "invalid block size mix\n");
+			exit(1);
+		}
+	} else {
+		bs_nr = 1;
+		bs_size[0] = bs;
+		bs_weight[0] = bs_weight_sum = 1;
+	}
+
+	max_bs = bs = bs_size[0];
+	for (i = 0; i < bs_nr; i++) {
+		if (bs_size[i] <= 0 || bs_size[i] % SECTOR_SIZE) {
+			fprintf(stderr, "The I/O size should be a multiple of %d\n",
+				SECTOR_SIZE);
+			exit(1);
+		}
+		if (bs_size[i] < bs)
+			bs = bs_size[i];
+		if (bs_size[i] > max_bs)
+			max_bs = bs_size[i];
+	}
+
 	if (!max_outstanding) {
 		fprintf(stderr, "The number outstanding shouldn't be zero\n");
 		exit(1);
 	}
 
-	if (!count) {
+	if (!total) {
 		fprintf(stderr, "The number requests shouldn't be zero\n");
 		exit(1);
 	}
 
-	if (max_outstanding > count)
-		max_outstanding = count;
+	if (nr_workers < 0) {
+		fprintf(stderr, "The number of threads shouldn't be negative\n");
+		exit(1);
+	}
+
+	if (max_outstanding > total)
+		max_outstanding = total;
+
+	if (batch <= 0) {
+		fprintf(stderr, "The batch size should be positive\n");
+		exit(1);
+	}
+
+	if (batch > max_outstanding)
+		batch = max_outstanding;
 
 	if (argc == optind) {
 		fprintf(stderr, "specify a bsg device\n");
 		usage(1);
 	}
 
-	if (argc - optind > MAX_DEVICE_NR) {
-		fprintf(stderr, "too many devices, the max is %d\n",
-			MAX_DEVICE_NR);
+	nr = argc - optind;
+
+	bi = calloc(nr, sizeof(*bi));
+	if (!bi) {
+		fprintf(stderr, "oom %m\n");
 		exit(1);
 	}
 
-	for (i = 0; i < argc - optind; i++) {
-		bi[i].fd = open_bsg_dev(argv[optind + i]);
-		if (bi[i].fd < 0)
+	if (!nr_workers || nr_workers > nr)
+		nr_workers = nr;
+
+	fds = malloc(sizeof(*fds) * nr);
+	if (!fds) {
+		fprintf(stderr, "oom %m\n");
+		exit(1);
+	}
+
+	open_bsg_devs(argv + optind, nr, fds);
+
+	for (i = 0; i < nr; i++) {
+		bi[i].fd = fds[i];
+		if (bi[i].fd < 0) {
+			fprintf(stderr, "can't open %s, %s\n", argv[optind + i],
+				strerror(-bi[i].fd));
 			exit(1);
+		}
 
-		ret = get_capacity(bi[i].fd, &(bi[i].size));
+		ret = bsg_read_capacity(bi[i].fd, &bi[i].cap);
 		if (ret) {
 			fprintf(stderr, "can't get the capacity\n");
 			exit(1);
 		}
+		bi[i].size = bi[i].cap.nr_blocks * bi[i].cap.block_size;
+
+		if (pi && !bi[i].cap.pi_type) {
+			fprintf(stderr, "%s isn't formatted with PI\n",
+				argv[optind + i]);
+			exit(1);
+		}
+
+		ret = check_block_size(&bi[i]);
+		if (ret) {
+			fprintf(stderr, "The I/O sizes and the offset should be "
+				"multiples of the %u byte blocks of %s\n",
+				bi[i].cap.block_size, argv[optind + i]);
+			exit(1);
+		}
+
+		ret = setup_range(&bi[i]);
+		if (ret) {
+			fprintf(stderr, "the range doesn't fit %s\n",
+				argv[optind + i]);
+			exit(1);
+		}
 	}
+	free(fds);
 
-	loop(argc - optind, count, max_outstanding, bs, rw);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&running_cond, &attr);
 
-	return 0;
+	/* the first ^C stops the run, the second one kills it */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler;
+	sa.sa_flags = SA_RESETHAND;
+	sigaction(SIGINT, &sa, NULL);
+
+	ret = run(nr, nr_workers) ? 1 : 0;
+
+	if (log_fp)
+		fclose(log_fp);
+
+	return ret;
 }
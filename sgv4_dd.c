@@ -9,26 +9,53 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <scsi/scsi.h>
 #include <scsi/sg.h>
 
 #include "libbsg.h"
+#include "libring.h"
+#include "libbuf.h"
+#include "libhist.h"
+#include "libpi.h"
 
 static char pname[] = "sgv4_dd";
 static int sgio;
 static int align;
+static int arena_flags;
+static int qdepth;
+static int threads = 1;
+static int interleave;
+static int use_mmap;
+static int direct;
+static int sparse;
+static int pi;
 
 static struct option const long_options[] =
 {
 	{"sgio", no_argument, 0, 's'},
 	{"align", required_argument, 0, 'a'},
+	{"hugepage", no_argument, 0, 'H'},
+	{"mlock", no_argument, 0, 'L'},
+	{"qdepth", required_argument, 0, 'q'},
+	{"threads", required_argument, 0, 't'},
+	{"interleave", no_argument, 0, 'i'},
+	{"mmap", no_argument, 0, 'm'},
+	{"direct", no_argument, 0, 'D'},
+	{"sparse", no_argument, 0, 'S'},
+	{"pi", no_argument, 0, 'p'},
 	{"help", no_argument, 0, 'h'},
 	{0, 0, 0, 0},
 };
@@ -41,122 +68,1281 @@ static void usage(int status)
 		printf("Usage: %s [OPTIONS]...\n", pname);
 		printf("\
   -s, --sgio              Use SG_IO (ioctl) instead of read/write interface\n\
+  -a, --align             offset the buffer by the given bytes from a page\n\
+                          boundary\n\
+  -H, --hugepage          back the buffer with 2MB pages\n\
+  -L, --mlock             lock the buffer in memory\n\
+  -q, --qdepth            pipeline the copy with up to the given number of\n\
+                          reads and writes in flight on the read/write\n\
+                          interface\n\
+  -t, --threads           split the copy into the given number of LBA\n\
+                          ranges and copy them in parallel threads\n\
+  -i, --interleave        interleave the ranges of the threads block by\n\
+                          block instead of splitting count contiguously\n\
+  -m, --mmap              map the file side and transfer to and from the\n\
+                          page cache directly instead of pread/pwrite\n\
+  -D, --direct            open the file side with O_DIRECT and overlap its\n\
+                          reads and writes with the bsg commands through\n\
+                          io_uring (needs --qdepth)\n\
+  -S, --sparse            don't transfer all-zero blocks; use WRITE SAME or\n\
+                          UNMAP on a bsg of, punch holes in a file of\n\
+  -p, --pi                move T10 PI on the bsg sides formatted with it:\n\
+                          check the tuples read, pass them through to an\n\
+                          of with PI, or strip them for one without, and\n\
+                          generate them for an if without PI\n\
   -h, --help              display this help and exit\n\
+");
+		printf("\n\
+Operands:\n\
+  if=FILE, of=FILE, bs=BYTES, count=BLOCKS\n\
+  skip=BLOCKS             skip bs sized blocks at the start of if\n\
+  seek=BLOCKS             skip bs sized blocks at the start of of\n\
+\n\
+if and of are bsg devices when given as /sys/class/bsg/NAME, /dev/bsg/NAME\n\
+or emu:SPEC, an emulated disk (see libemu.h).\n\
 ");
 		printf("\n\
 Examples:\n\
   $ sgv4_dd if=/sys/class/bsg/0:0:0:0 of=/dev/null count=1 bs=4k\n\
+  $ sgv4_dd if=/sys/class/bsg/0:0:0:0 of=/sys/class/bsg/1:0:0:0 \\\n\
+        skip=1048576 seek=1048576 count=1048576 bs=1m\n\
+  $ sgv4_dd -q 8 if=/sys/class/bsg/0:0:0:0 of=/sys/class/bsg/1:0:0:0 \\\n\
+        count=4096 bs=128k\n\
+  $ sgv4_dd -t 4 -q 8 if=/sys/class/bsg/0:0:0:0 of=/sys/class/bsg/1:0:0:0 \\\n\
+        count=65536 bs=1m\n\
+  $ sgv4_dd -q 32 if=emu:ram,size=4g,lat=50 of=/dev/null \\\n\
+        count=65536 bs=64k\n\
 ");
 	}
 	exit(status);
 }
 
-static int sgv4_read(int fd, char *p, int len, unsigned offset)
+/* report how a synchronous command went and put its req back */
+static int sgv4_done(struct bsg_queue *q, struct bsg_req *req, int ret)
+{
+	struct sg_io_v4 *hdr = &req->hdr;
+
+	if (ret)
+		fprintf(stderr, "fail to %s, %s\n",
+			sgio ? "sgio" : "send the command", strerror(-ret));
+	else if (sgv4_rsp_check(hdr)) {
+		fprintf(stderr, "error %x %x %x %u\n",
+			hdr->driver_status, hdr->transport_status,
+			hdr->device_status, hdr->din_resid);
+		ret = -EIO;
+	}
+
+	bsg_put_req(q, req);
+	return ret;
+}
+
+/* one command, synchronously on either interface */
+static int sgv4_exec(struct bsg_queue *q, struct bsg_req *req)
+{
+	return sgv4_done(q, req, bsg_queue_exec(q, req));
+}
+
+static int sgv4_read(struct bsg_queue *q, char *p, int len, uint64_t offset,
+		     unsigned int block_size, int pi_type)
+{
+	struct bsg_req *req = bsg_get_req(q);
+
+	if (pi_type)
+		bsg_req_prep_rw_pi(req, 0, p, len, offset, block_size, pi_type);
+	else
+		bsg_req_prep_rw(req, 0, p, len, offset, block_size);
+
+	return sgv4_exec(q, req);
+}
+
+static int sgv4_write(struct bsg_queue *q, char *p, int len, uint64_t offset,
+		      unsigned int block_size, int pi_type)
+{
+	struct bsg_req *req = bsg_get_req(q);
+
+	if (pi_type)
+		bsg_req_prep_rw_pi(req, 1, p, len, offset, block_size, pi_type);
+	else
+		bsg_req_prep_rw(req, 1, p, len, offset, block_size);
+
+	return sgv4_exec(q, req);
+}
+
+/*
+ * with -S, an all-zero block goes out as one of these instead of a
+ * full write
+ */
+enum {
+	ZERO_WRITE,		/* not sparse */
+	ZERO_WRITE_SAME,
+	ZERO_WS_UNMAP,
+	ZERO_UNMAP,
+	ZERO_HOLE,		/* punch a hole in the output file */
+};
+
+static char *zero_method_name[] = {
+	"write", "WRITE SAME(16)", "WRITE SAME(16) with UNMAP", "UNMAP",
+	"hole",
+};
+
+/*
+ * bs bytes of zeros, the data out of WRITE SAME and what a refused zero
+ * command or a file without hole punching gets written
+ */
+static char *zero_block;
+
+/*
+ * a device may skip the part of an UNMAP that doesn't cover whole
+ * granules and leave the old data there, so every block of the copy,
+ * starting at lba, has to line up with them
+ */
+static int unmap_aligned(struct bsg_lbp *lbp, uint64_t lba, uint64_t nr)
+{
+	uint32_t gran = lbp->unmap_gran;
+
+	return gran && !(nr % gran) && lba % gran == lbp->unmap_align % gran;
+}
+
+/* bs blocks of nr lbas that fit in one command of at most max lbas */
+static uint64_t zero_run_max(uint64_t max, uint64_t nr)
+{
+	/* the NUMBER OF LOGICAL BLOCKS fields are 32 bits */
+	if (max > UINT32_MAX)
+		max = UINT32_MAX;
+
+	return max / nr ? max / nr : 1;
+}
+
+/*
+ * WRITE SAME with UNMAP is safe on any thin device: it either unmaps
+ * or writes zeros. A bare UNMAP is only used when unmapped blocks are
+ * guaranteed to read back as zeros and the copy is granule aligned.
+ * Plain WRITE SAME isn't optional in LBP terms, so it takes a Block
+ * Limits page that gives its maximum length. *max is set to the most
+ * bs blocks a command may cover, 1 when Block Limits doesn't say.
+ */
+static int pick_zero_method(int fd, struct bsg_capacity *cap, int bs,
+			    uint64_t offset, uint64_t *max)
+{
+	struct bsg_lbp lbp;
+	uint64_t nr = bs / cap->block_size;
+	uint64_t lba = offset / cap->block_size;
+
+	bsg_read_lbp(fd, &lbp);
+	*max = zero_run_max(lbp.max_ws_len, nr);
+
+	if (cap->lbpme && lbp.lbpws &&
+	    (!lbp.max_ws_len || nr <= lbp.max_ws_len))
+		return ZERO_WS_UNMAP;
+
+	if (cap->lbpme && cap->lbprz && lbp.lbpu &&
+	    unmap_aligned(&lbp, lba, nr) &&
+	    (!lbp.max_unmap_lbas || nr <= lbp.max_unmap_lbas)) {
+		*max = zero_run_max(lbp.max_unmap_lbas, nr);
+		return ZERO_UNMAP;
+	}
+
+	if (lbp.max_ws_len && nr <= lbp.max_ws_len)
+		return ZERO_WRITE_SAME;
+
+	*max = 1;
+	return ZERO_WRITE;
+}
+
+static void prep_zero_req(struct bsg_req *req, int method,
+			  unsigned char *param, uint64_t offset, uint64_t len,
+			  unsigned int block_size)
+{
+	uint64_t lba = offset / block_size;
+	uint32_t nr = len / block_size;
+	int cdb_len;
+
+	if (method == ZERO_UNMAP) {
+		cdb_len = setup_unmap(req->cdb, param, lba, nr);
+		bsg_req_prep(req, cdb_len, NULL, 0, (char *)param,
+			     UNMAP_PARAM_LEN);
+	} else {
+		setup_write_same16_scb(req->cdb, lba, nr,
+				       method == ZERO_WS_UNMAP);
+		bsg_req_prep(req, 16, NULL, 0, zero_block, block_size);
+	}
+}
+
+/* file systems without hole punching get the zeros written, bs at a time */
+static int punch_hole(int fd, uint64_t len, uint64_t offset, int bs)
+{
+	int ret;
+
+	if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       offset, len))
+		return 0;
+
+	if (errno != EOPNOTSUPP) {
+		fprintf(stderr, "fail to punch a hole in of, %m\n");
+		return -EIO;
+	}
+
+	for (; len; len -= bs, offset += bs) {
+		ret = pwrite(fd, zero_block, bs, offset);
+		if (ret != bs) {
+			fprintf(stderr, "fail to write of, %d\n", ret);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+static int check_block_size(int fd, struct bsg_capacity *cap, int bs,
+			    uint64_t end, char *name)
 {
-	struct sg_io_v4 hdr;
-	unsigned char scb[10];
-	unsigned char sense[32];
 	int ret;
 
-	setup_rw_scb(scb, sizeof(scb), READ_10, len, offset);
+	ret = bsg_read_capacity(fd, cap);
+	if (ret) {
+		printf("can't get the capacity of %s, %s\n", name,
+		       strerror(-ret));
+		return ret;
+	}
+
+	if (bs % cap->block_size) {
+		printf("bs must be a multiple of %u, the block size of %s\n",
+		       cap->block_size, name);
+		return -EINVAL;
+	}
+
+	if (end > cap->nr_blocks * cap->block_size) {
+		printf("%s has only %" PRIu64 " blocks of %u bytes\n", name,
+		       cap->nr_blocks, cap->block_size);
+		return -EINVAL;
+	}
+
+	if (bsg_phys_misaligned(cap, bs, 0))
+		printf("warning: bs %d isn't aligned to the %u byte physical "
+		       "block of %s, writes will be read-modify-write\n", bs,
+		       cap->phys_block_size, name);
+
+	return 0;
+}
+
+/* the file side is mapped this much at a time with -m */
+#define DD_MAP_WINDOW	(64UL << 20)
+
+struct dd_map {
+	char *addr;
+	uint64_t start;
+	size_t len;
+	/* slots with a transfer pointing into this window */
+	int users;
+};
+
+/*
+ * pipelined copy: up to qdepth reads and qdepth writes are in flight
+ * on the bsg async interface, with a ring of 2 * qdepth buffers
+ * carrying the data from the read stage to the write stage. A file
+ * side is done with pread/pwrite, through the mapping (-m) or through
+ * io_uring (-D).
+ */
+enum {
+	SLOT_FREE,
+	SLOT_READING,
+	SLOT_READ_DONE,
+	SLOT_WRITING,
+};
+
+struct dd_slot {
+	int state;
+	char *buf;
+	/* what the transfer uses, buf or the mapped file */
+	char *data;
+	/* with -p, the data interleaved with the tuples for a PI side */
+	char *pibuf;
+	struct dd_map *map;
+	uint64_t if_offset;
+	uint64_t of_offset;
+	/* bs blocks the write covers, more than one for a run of zeros */
+	uint64_t nr;
+	/* the write is a WRITE SAME, UNMAP or hole instead of the data */
+	int zero;
+	unsigned char param[UNMAP_PARAM_LEN];
+	struct dd_pipe *pipe;
+};
+
+struct dd_pipe {
+	int if_fd, of_fd;
+	int if_sg, of_sg;
+	struct bsg_queue if_q, of_q;
+	unsigned int if_lbs, of_lbs;
+	int bs;
+	/* distance in bytes between two consecutive blocks of the stream */
+	uint64_t stride;
+	int qdepth;
+
+	/*
+	 * with -m, the file side is accessed through two windows, the
+	 * current one and the previous one still in use by slots.
+	 */
+	int map_fd;
+	int map_write;
+	size_t map_window;
+	struct dd_map maps[2];
+	int map_cur;
+
+	/* with -D, the file side goes through io_uring on the slot buffers */
+	int use_ring;
+	struct io_ring ring;
+	int ring_pending;
+
+	int nr_slots;
+	struct dd_slot *slots;
+	struct dd_slot **free_slots;
+	int nr_free;
+	/* slots read and waiting for the write stage, in read order */
+	struct dd_slot **ready;
+	int ready_head, nr_ready;
+
+	int zero_method;
+	uint64_t zero_blocks;
+	/* the most bs blocks one zero command covers */
+	uint64_t zero_max;
+	/* with -S, the slot carrying the zero blocks not sent out yet */
+	struct dd_slot *zero_run;
+
+	/* with -p, the PI type of a side that moves the tuples, or 0 */
+	int if_pi, of_pi;
+	uint64_t pi_blocks;
+	uint64_t pi_ns;
+
+	int reads, writes;
+	uint64_t written;
+	int err;
+};
+
+/*
+ * return the address of the file data at offset, NULL when the window
+ * has to move but the previous one is still busy, or MAP_FAILED.
+ */
+static char *pipe_map(struct dd_pipe *p, uint64_t offset, struct dd_map **mp)
+{
+	struct dd_map *m = &p->maps[p->map_cur];
+	long pgsize = sysconf(_SC_PAGESIZE);
+
+	if (m->addr && offset >= m->start &&
+	    offset + p->bs <= m->start + m->len)
+		goto found;
+
+	m = &p->maps[!p->map_cur];
+	if (m->addr) {
+		if (m->users)
+			return NULL;
+		munmap(m->addr, m->len);
+		m->addr = NULL;
+	}
+
+	m->start = offset & ~((uint64_t) pgsize - 1);
+	m->len = p->map_window;
+	m->addr = mmap(NULL, m->len, p->map_write ? PROT_READ | PROT_WRITE :
+		       PROT_READ, MAP_SHARED, p->map_fd, m->start);
+	if (m->addr == MAP_FAILED) {
+		fprintf(stderr, "fail to map the file, %m\n");
+		m->addr = NULL;
+		return MAP_FAILED;
+	}
+
+	madvise(m->addr, m->len, MADV_SEQUENTIAL);
+	if (!p->map_write)
+		madvise(m->addr, m->len, MADV_WILLNEED);
+
+	p->map_cur = !p->map_cur;
+found:
+	m->users++;
+	*mp = m;
+	return m->addr + (offset - m->start);
+}
+
+static void pipe_unmap(struct dd_pipe *p)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (p->maps[i].addr)
+			munmap(p->maps[i].addr, p->maps[i].len);
+}
+
+static void pipe_put_free(struct dd_pipe *p, struct dd_slot *slot)
+{
+	if (slot->map) {
+		slot->map->users--;
+		slot->map = NULL;
+	}
+	slot->state = SLOT_FREE;
+	slot->zero = 0;
+	p->free_slots[p->nr_free++] = slot;
+}
+
+static void pipe_put_ready(struct dd_pipe *p, struct dd_slot *slot)
+{
+	slot->state = SLOT_READ_DONE;
+	p->ready[(p->ready_head + p->nr_ready++) % p->nr_slots] = slot;
+}
+
+static struct dd_slot *pipe_get_ready(struct dd_pipe *p)
+{
+	struct dd_slot *slot = p->ready[p->ready_head];
 
-	setup_sgv4_hdr(&hdr, scb, sizeof(scb), sense,
-		       sizeof(sense), p, len, NULL, 0);
+	p->ready_head = (p->ready_head + 1) % p->nr_slots;
+	p->nr_ready--;
+	return slot;
+}
+
+static void pipe_req_done(struct bsg_queue *q, struct bsg_req *req);
+
+/* at most qdepth of each kind are in flight, so there's always a req */
+static void pipe_submit(struct dd_pipe *p, struct bsg_queue *q,
+			struct dd_slot *slot, int write_cmd, uint64_t offset,
+			unsigned int block_size)
+{
+	struct bsg_req *req = bsg_get_req(q);
+	int pi_type = write_cmd ? p->of_pi : p->if_pi;
+
+	req->priv = slot;
+	req->done = pipe_req_done;
+	if (pi_type)
+		bsg_req_prep_rw_pi(req, write_cmd, slot->pibuf, p->bs, offset,
+				   block_size, pi_type);
+	else
+		bsg_req_prep_rw(req, write_cmd, slot->data, p->bs, offset,
+				block_size);
+	bsg_queue_rq(q, req);
+}
 
-	if (sgio) {
-		ret = ioctl(fd, SG_IO, &hdr);
+/*
+ * -p, between the read and the write of a block: check the tuples that
+ * came in, then make the ones that go out. pibuf is the transfer of the
+ * PI side(s), data the one of a side without PI.
+ */
+static int pipe_pi(struct dd_pipe *p, char *pibuf, char *data,
+		   uint64_t if_offset, uint64_t of_offset)
+{
+	unsigned int lbs = p->if_pi ? p->if_lbs : p->of_lbs;
+	int ret = 0, bad, nr = p->bs / lbs;
+	uint64_t t = lat_now_ns();
+
+	if (p->if_pi) {
+		ret = pi_verify(pibuf, lbs, nr, p->if_pi, if_offset / lbs,
+				&bad);
 		if (ret) {
-			fprintf(stderr, "fail to sgio, %m\n");
+			fprintf(stderr, "bad PI %s at lba %" PRIu64 " of if\n",
+				ret == T10_PI_GUARD_ERR ? "guard" : "ref tag",
+				if_offset / lbs + bad);
+			ret = -EIO;
 			goto out;
 		}
+	}
+
+	if (p->if_pi && p->of_pi)
+		pi_remap_ref(pibuf, lbs, nr, p->of_pi, of_offset / lbs);
+	else if (p->if_pi)
+		pi_strip(data, pibuf, lbs, nr);
+	else {
+		pi_interleave(pibuf, data, lbs, nr);
+		pi_generate(pibuf, lbs, nr, p->of_pi, of_offset / lbs, 0);
+	}
+out:
+	p->pi_ns += lat_now_ns() - t;
+	p->pi_blocks += nr;
+	return ret;
+}
+
+/*
+ * Block Limits can promise a WRITE SAME the target then refuses. From
+ * the first ILLEGAL REQUEST on, zero blocks are written out like any
+ * other. Returns 1 when that is what failed the nr blocks of hdr.
+ */
+static int zero_rejected(struct dd_pipe *p, struct sg_io_v4 *hdr,
+			 uint64_t nr)
+{
+	if (sgv4_sense_key(hdr) != ILLEGAL_REQUEST)
+		return 0;
+
+	if (p->zero_method != ZERO_WRITE) {
+		fprintf(stderr, "of rejected %s, writing the zero blocks\n",
+			zero_method_name[p->zero_method]);
+		p->zero_method = ZERO_WRITE;
+	}
+	p->zero_blocks -= nr;
+
+	return 1;
+}
+
+/*
+ * the target refused a zero command: the req goes back out as a write
+ * of zero_block, once for each block of the run
+ */
+static void pipe_rewrite_zero(struct dd_pipe *p, struct bsg_queue *q,
+			      struct bsg_req *req)
+{
+	struct dd_slot *slot = req->priv;
+
+	bsg_req_prep_rw(req, 1, zero_block, p->bs, slot->of_offset,
+			p->of_lbs);
+	bsg_queue_rq(q, req);
+}
+
+/*
+ * send out the run of zero blocks the slot carries. Returns the blocks
+ * done already, 0 when it's queued, or -errno.
+ */
+static int pipe_write_zero(struct dd_pipe *p, struct dd_slot *slot)
+{
+	struct bsg_req *req;
+	int ret;
+
+	if (p->zero_method == ZERO_HOLE) {
+		ret = punch_hole(p->of_fd, slot->nr * p->bs, slot->of_offset,
+				 p->bs);
+		if (ret)
+			return ret;
+		ret = slot->nr;
+		pipe_put_free(p, slot);
+		return ret;
+	}
+
+	req = bsg_get_req(&p->of_q);
+	req->priv = slot;
+	req->done = pipe_req_done;
+	slot->state = SLOT_WRITING;
+	p->writes++;
+
+	/* refused while the run waited */
+	if (p->zero_method == ZERO_WRITE) {
+		p->zero_blocks -= slot->nr;
+		pipe_rewrite_zero(p, &p->of_q, req);
+		return 0;
+	}
+
+	prep_zero_req(req, p->zero_method, slot->param, slot->of_offset,
+		      slot->nr * p->bs, p->of_lbs);
+	slot->zero = 1;
+	bsg_queue_rq(&p->of_q, req);
+
+	return 0;
+}
+
+/* the run is over, send it out */
+static int pipe_end_zero_run(struct dd_pipe *p)
+{
+	struct dd_slot *run = p->zero_run;
+	int ret;
+
+	p->zero_run = NULL;
+	ret = pipe_write_zero(p, run);
+	if (ret < 0)
+		pipe_put_free(p, run);
+
+	return ret;
+}
+
+/*
+ * -S: a zero block right after the run joins it, otherwise it starts a
+ * new one. Ending the old run and ending a full one never happen in the
+ * same call, so the room for one write the caller checked is enough.
+ * Returns the blocks done, or -errno.
+ */
+static int pipe_add_zero(struct dd_pipe *p, struct dd_slot *slot)
+{
+	struct dd_slot *run = p->zero_run;
+	int ret = 0, nr;
+
+	p->zero_blocks++;
+
+	if (run && run->nr < p->zero_max &&
+	    slot->of_offset == run->of_offset + run->nr * p->bs) {
+		run->nr++;
+		pipe_put_free(p, slot);
 	} else {
-		ret = write(fd, &hdr, sizeof(hdr));
-		if (ret != sizeof(hdr)) {
-			fprintf(stderr, "fail to write bsg dev, %m\n");
-			goto out;
+		if (run) {
+			ret = pipe_end_zero_run(p);
+			if (ret < 0) {
+				pipe_put_free(p, slot);
+				return ret;
+			}
 		}
 
-		memset(&hdr, 0, sizeof(hdr));
-		ret = read(fd, &hdr, sizeof(hdr));
-		if (ret != sizeof(hdr)) {
-			fprintf(stderr, "fail to wait for the response, %m\n");
-			goto out;
+		/* the run needs no data, don't hold the window */
+		if (slot->map) {
+			slot->map->users--;
+			slot->map = NULL;
 		}
+		slot->state = SLOT_WRITING;
+		p->zero_run = run = slot;
 	}
 
-	if (sgv4_rsp_check(&hdr)) {
-		fprintf(stderr, "error %x %x %x %u\n",
-			hdr.driver_status, hdr.transport_status,
-			hdr.device_status, hdr.din_resid);
-		ret = -EIO;
-		goto out;
+	if (run->nr == p->zero_max) {
+		nr = pipe_end_zero_run(p);
+		if (nr < 0)
+			return nr;
+		ret += nr;
 	}
 
-	ret = 0;
-out:
 	return ret;
 }
 
-static int sgv4_write(int fd, char *p, int len, unsigned offset)
+/* move a finished slot on */
+static void pipe_complete(struct dd_pipe *p, struct dd_slot *slot)
+{
+	if (slot->state == SLOT_READING) {
+		p->reads--;
+		if (p->err)
+			pipe_put_free(p, slot);
+		else
+			pipe_put_ready(p, slot);
+		return;
+	}
+
+	p->writes--;
+	p->written += slot->nr;
+	pipe_put_free(p, slot);
+}
+
+static void pipe_req_done(struct bsg_queue *q, struct bsg_req *req)
+{
+	struct dd_slot *slot = req->priv;
+	struct dd_pipe *p = slot->pipe;
+	struct sg_io_v4 *hdr = &req->hdr;
+
+	if (slot->zero && sgv4_rsp_check(hdr) &&
+	    zero_rejected(p, hdr, slot->nr)) {
+		slot->zero = 0;
+		pipe_rewrite_zero(p, q, req);
+		return;
+	}
+
+	if (sgv4_rsp_check(hdr)) {
+		fprintf(stderr, "error %x %x %x %u\n", hdr->driver_status,
+			hdr->transport_status, hdr->device_status,
+			hdr->din_resid);
+		p->err = -EIO;
+	}
+
+	/* the next block of a refused run */
+	if (!slot->zero && slot->nr > 1 && !p->err) {
+		slot->nr--;
+		slot->of_offset += p->bs;
+		p->written++;
+		pipe_rewrite_zero(p, q, req);
+		return;
+	}
+
+	bsg_put_req(q, req);
+	pipe_complete(p, slot);
+}
+
+static void pipe_reap_ring(struct dd_pipe *p)
+{
+	struct io_uring_cqe *cqe;
+	struct dd_slot *slot;
+	int res;
+
+	while ((cqe = io_ring_peek_cqe(&p->ring))) {
+		slot = (struct dd_slot *) (unsigned long) cqe->user_data;
+		res = cqe->res;
+		io_ring_cqe_seen(&p->ring);
+		p->ring_pending--;
+
+		if (res != p->bs) {
+			fprintf(stderr, "fail to %s the file, %s\n",
+				slot->state == SLOT_READING ? "read" : "write",
+				res < 0 ? strerror(-res) : "short transfer");
+			p->err = -EIO;
+		}
+
+		pipe_complete(p, slot);
+	}
+}
+
+static void pipe_queue_ring(struct dd_pipe *p, struct dd_slot *slot, int op,
+			    int fd, uint64_t offset)
+{
+	struct io_uring_sqe *sqe;
+
+	/* the ring has room for every slot */
+	sqe = io_ring_get_sqe(&p->ring);
+	io_ring_prep_rw(sqe, op, fd, slot->data, p->bs, offset, 0,
+			(unsigned long) slot);
+	p->ring_pending++;
+}
+
+/* drain all the responses the bsg fd has for us */
+static void pipe_reap(struct dd_pipe *p, struct bsg_queue *q)
 {
-	struct sg_io_v4 hdr;
-	unsigned char scb[10];
-	unsigned char sense[32];
 	int ret;
 
-	setup_rw_scb(scb, sizeof(scb), WRITE_10, len, offset);
+	ret = bsg_queue_reap(q);
+	if (ret < 0) {
+		fprintf(stderr, "fail to wait for the response, %s\n",
+			strerror(-ret));
+		p->err = -EIO;
+	}
+}
 
-	setup_sgv4_hdr(&hdr, scb, sizeof(scb), sense,
-		       sizeof(sense), NULL, 0, p, len);
+static void pipe_flush(struct dd_pipe *p, struct bsg_queue *q)
+{
+	int ret;
 
-	printf("%s %d len %d off %u\n", __func__, __LINE__, len, offset);
+	ret = bsg_queue_submit(q);
+	if (ret < 0) {
+		fprintf(stderr, "fail to write bsg dev, %s\n", strerror(-ret));
+		p->err = -EIO;
+	}
+}
 
-	if (sgio) {
-		ret = ioctl(fd, SG_IO, &hdr);
-		if (ret) {
-			fprintf(stderr, "fail to sgio, %m\n");
-			goto out;
+static int pipe_init(struct dd_pipe *p, struct bsg_arena *arena,
+		     struct bsg_arena *pi_arena)
+{
+	int i, ret;
+
+	p->nr_slots = p->qdepth * 2;
+	p->slots = calloc(p->nr_slots, sizeof(*p->slots));
+	p->free_slots = calloc(p->nr_slots, sizeof(*p->free_slots));
+	p->ready = calloc(p->nr_slots, sizeof(*p->ready));
+	if (!p->slots || !p->free_slots || !p->ready)
+		return -ENOMEM;
+
+	for (i = p->nr_slots - 1; i >= 0; i--) {
+		p->slots[i].buf = bsg_arena_slot(arena, i) + align;
+		p->slots[i].pibuf = bsg_arena_slot(pi_arena, i);
+		p->slots[i].pipe = p;
+		pipe_put_free(p, &p->slots[i]);
+	}
+
+	if (p->use_ring) {
+		struct iovec iov = {
+			.iov_base = arena->base,
+			.iov_len = arena->slot_size * arena->nr_slots,
+		};
+
+		ret = io_ring_init(&p->ring, p->nr_slots);
+		if (ret)
+			return ret;
+
+		/* one fixed buffer covering every slot, buf_index 0 */
+		ret = io_ring_register_buffers(&p->ring, &iov, 1);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void pipe_exit(struct dd_pipe *p)
+{
+	free(p->slots);
+	free(p->free_slots);
+	free(p->ready);
+	if (p->ring.sq_map)
+		io_ring_exit(&p->ring);
+}
+
+static int copy_pipelined(struct dd_pipe *p, uint64_t count,
+			  uint64_t if_offset, uint64_t of_offset)
+{
+	struct pollfd pfd[3];
+	struct dd_slot *slot;
+	uint64_t next = 0;
+	int i, ret, nr_pfd, timeout, progress;
+
+	while (p->written < count) {
+		progress = 0;
+
+		/* read stage */
+		while (!p->err && next < count && p->reads < p->qdepth &&
+		       p->nr_free) {
+			slot = p->free_slots[p->nr_free - 1];
+			slot->if_offset = if_offset + next * p->stride;
+			slot->of_offset = of_offset + next * p->stride;
+			slot->nr = 1;
+			slot->data = slot->buf;
+
+			if (p->map_fd >= 0) {
+				slot->data = pipe_map(p, p->map_write ?
+						      slot->of_offset :
+						      slot->if_offset,
+						      &slot->map);
+				/* wait for the old window to drain */
+				if (!slot->data)
+					break;
+				if (slot->data == MAP_FAILED) {
+					p->err = -EIO;
+					break;
+				}
+			}
+
+			p->nr_free--;
+			next++;
+			progress++;
+
+			if (p->if_sg) {
+				slot->state = SLOT_READING;
+				pipe_submit(p, &p->if_q, slot, 0,
+					    slot->if_offset, p->if_lbs);
+				p->reads++;
+			} else if (slot->map)
+				pipe_put_ready(p, slot);
+			else if (p->use_ring) {
+				slot->state = SLOT_READING;
+				pipe_queue_ring(p, slot, IORING_OP_READ_FIXED,
+						p->if_fd, slot->if_offset);
+				p->reads++;
+			} else {
+				ret = pread(p->if_fd, slot->data, p->bs,
+					    slot->if_offset);
+				if (ret != p->bs) {
+					fprintf(stderr, "fail to read if, %d\n",
+						ret);
+					pipe_put_free(p, slot);
+					p->err = -EIO;
+					break;
+				}
+				pipe_put_ready(p, slot);
+			}
 		}
-	} else {
-		ret = write(fd, &hdr, sizeof(hdr));
-		if (ret != sizeof(hdr)) {
-			fprintf(stderr, "fail to write bsg dev, %m\n");
-			goto out;
+
+		/* write stage */
+		while (!p->err && p->nr_ready && p->writes < p->qdepth) {
+			slot = pipe_get_ready(p);
+			progress++;
+
+			if ((p->if_pi || p->of_pi) &&
+			    pipe_pi(p, slot->pibuf, slot->data, slot->if_offset,
+				    slot->of_offset)) {
+				pipe_put_free(p, slot);
+				p->err = -EIO;
+				break;
+			}
+
+			if (p->zero_method && buf_is_zero(slot->data, p->bs)) {
+				ret = pipe_add_zero(p, slot);
+				if (ret < 0) {
+					p->err = ret;
+					break;
+				}
+				p->written += ret;
+			} else if (p->of_sg) {
+				slot->state = SLOT_WRITING;
+				pipe_submit(p, &p->of_q, slot, 1,
+					    slot->of_offset, p->of_lbs);
+				p->writes++;
+			} else if (slot->map) {
+				/* read straight into the page cache */
+				pipe_put_free(p, slot);
+				p->written++;
+			} else if (p->use_ring) {
+				slot->state = SLOT_WRITING;
+				pipe_queue_ring(p, slot, IORING_OP_WRITE_FIXED,
+						p->of_fd, slot->of_offset);
+				p->writes++;
+			} else {
+				ret = pwrite(p->of_fd, slot->data, p->bs,
+					     slot->of_offset);
+				if (ret != p->bs) {
+					fprintf(stderr, "fail to write of, %d\n",
+						ret);
+					pipe_put_free(p, slot);
+					p->err = -EIO;
+					break;
+				}
+				pipe_put_free(p, slot);
+				p->written++;
+			}
 		}
 
-		memset(&hdr, 0, sizeof(hdr));
-		ret = read(fd, &hdr, sizeof(hdr));
-		if (ret != sizeof(hdr)) {
-			fprintf(stderr, "fail to wait for the response, %m\n");
-			goto out;
+		/* no more blocks to join the run */
+		if (!p->err && p->zero_run && next == count && !p->reads &&
+		    !p->nr_ready && p->writes < p->qdepth) {
+			ret = pipe_end_zero_run(p);
+			if (ret < 0)
+				p->err = ret;
+			else
+				p->written += ret;
+			progress++;
+		}
+
+		if (!p->reads && !p->writes) {
+			if (p->err)
+				break;
+			continue;
+		}
+
+		/* one write() per bsg fd for everything queued above */
+		if (p->if_sg)
+			pipe_flush(p, &p->if_q);
+		if (p->of_sg)
+			pipe_flush(p, &p->of_q);
+
+		if (p->use_ring) {
+			ret = io_ring_submit(&p->ring);
+			if (ret < 0) {
+				fprintf(stderr, "fail to submit to io_uring, %s\n",
+					strerror(-ret));
+				p->err = ret;
+				break;
+			}
+		}
+
+		/* what's still queued would never complete */
+		if (p->err && ((p->if_sg && p->if_q.queued) ||
+			       (p->of_sg && p->of_q.queued)))
+			break;
+
+		/* wait for completions unless there is more to issue */
+		nr_pfd = 0;
+		if (p->if_sg && p->if_q.inflight) {
+			pfd[nr_pfd].fd = p->if_fd;
+			pfd[nr_pfd++].events = POLLIN;
+		}
+		if (p->of_sg && p->of_q.inflight) {
+			pfd[nr_pfd].fd = p->of_fd;
+			pfd[nr_pfd++].events = POLLIN;
+		}
+		if (p->ring_pending) {
+			pfd[nr_pfd].fd = p->ring.fd;
+			pfd[nr_pfd++].events = POLLIN;
+		}
+
+		timeout = progress && !p->err ? 0 : -1;
+		if (p->ring_pending && io_ring_peek_cqe(&p->ring))
+			timeout = 0;
+
+		ret = poll(pfd, nr_pfd, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "fail to poll, %m\n");
+			p->err = -EIO;
+			break;
+		}
+
+		for (i = 0; i < nr_pfd; i++) {
+			if (pfd[i].fd == p->ring.fd && p->ring_pending)
+				pipe_reap_ring(p);
+			else if (pfd[i].fd == p->if_fd && pfd[i].revents)
+				pipe_reap(p, &p->if_q);
+			else if (pfd[i].fd == p->of_fd && pfd[i].revents)
+				pipe_reap(p, &p->of_q);
 		}
 	}
 
-	if (sgv4_rsp_check(&hdr)) {
-		fprintf(stderr, "error %x %x %x %u\n",
-			hdr.driver_status, hdr.transport_status,
-			hdr.device_status, hdr.din_resid);
-		ret = -EIO;
-		goto out;
+	return p->err;
+}
+
+struct dd_worker {
+	pthread_t thread;
+	int id;
+	struct dd_pipe pipe;
+	struct bsg_arena arena;
+	struct bsg_arena pi_arena;
+	uint64_t count;
+	uint64_t if_offset;
+	uint64_t of_offset;
+	double sec;
+	int ret;
+};
+
+/* the nr zero blocks at offset, as one command */
+static int write_zero(struct dd_pipe *p, uint64_t offset, uint64_t nr)
+{
+	unsigned char param[UNMAP_PARAM_LEN];
+	struct bsg_req *req;
+	int ret;
+
+	if (p->zero_method == ZERO_HOLE)
+		return punch_hole(p->of_fd, nr * p->bs, offset, p->bs);
+
+	req = bsg_get_req(&p->of_q);
+	prep_zero_req(req, p->zero_method, param, offset, nr * p->bs,
+		      p->of_lbs);
+
+	ret = bsg_queue_exec(&p->of_q, req);
+	if (ret || !sgv4_rsp_check(&req->hdr) ||
+	    !zero_rejected(p, &req->hdr, nr))
+		return sgv4_done(&p->of_q, req, ret);
+
+	bsg_put_req(&p->of_q, req);
+	for (; nr; nr--, offset += p->bs) {
+		ret = sgv4_write(&p->of_q, zero_block, p->bs, offset,
+				 p->of_lbs, 0);
+		if (ret)
+			return ret;
 	}
-	ret = 0;
-out:
+
+	return 0;
+}
+
+static int copy_lockstep(struct dd_worker *w)
+{
+	struct dd_pipe *p = &w->pipe;
+	char *buf = bsg_arena_slot(&w->arena, 0) + align;
+	char *pibuf = bsg_arena_slot(&w->pi_arena, 0);
+	uint64_t i, if_offset = w->if_offset, of_offset = w->of_offset;
+	uint64_t zero_offset = 0, zero_nr = 0;
+	struct dd_map *map = NULL;
+	int ret;
+
+	for (i = 0; i < w->count; i++) {
+		if (p->map_fd >= 0) {
+			buf = pipe_map(p, p->map_write ? of_offset : if_offset,
+				       &map);
+			if (buf == MAP_FAILED)
+				return -EIO;
+		}
+
+		if (p->if_sg) {
+			ret = sgv4_read(&p->if_q, p->if_pi ? pibuf : buf, p->bs,
+					if_offset, p->if_lbs, p->if_pi);
+			if (ret)
+				return ret;
+		} else if (!map) {
+			ret = pread(p->if_fd, buf, p->bs, if_offset);
+			if (ret != p->bs) {
+				printf("%s %d: %d\n", __func__, __LINE__, ret);
+				return -EIO;
+			}
+		}
+
+		if (p->if_pi || p->of_pi) {
+			ret = pipe_pi(p, pibuf, buf, if_offset, of_offset);
+			if (ret)
+				return ret;
+		}
+
+		/* a run of zero blocks goes out once it can't grow */
+		if (p->zero_method && buf_is_zero(buf, p->bs)) {
+			p->zero_blocks++;
+			if (zero_nr && of_offset != zero_offset + zero_nr * p->bs) {
+				ret = write_zero(p, zero_offset, zero_nr);
+				if (ret)
+					return ret;
+				zero_nr = 0;
+			}
+			if (!zero_nr++)
+				zero_offset = of_offset;
+			if (zero_nr == p->zero_max) {
+				ret = write_zero(p, zero_offset, zero_nr);
+				if (ret)
+					return ret;
+				zero_nr = 0;
+			}
+		} else if (p->of_sg) {
+			ret = sgv4_write(&p->of_q, p->of_pi ? pibuf : buf, p->bs,
+					 of_offset, p->of_lbs, p->of_pi);
+			if (ret)
+				return ret;
+		} else if (!map) {
+			ret = pwrite(p->of_fd, buf, p->bs, of_offset);
+			if (ret != p->bs) {
+				printf("%s %d: %d\n", __func__, __LINE__, ret);
+				return -EIO;
+			}
+		}
+
+		if (map) {
+			map->users--;
+			map = NULL;
+		}
+
+		if_offset += p->stride;
+		of_offset += p->stride;
+	}
+
+	return zero_nr ? write_zero(p, zero_offset, zero_nr) : 0;
+}
+
+static void *dd_worker_fn(void *arg)
+{
+	struct dd_worker *w = arg;
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+
+	if (qdepth)
+		w->ret = copy_pipelined(&w->pipe, w->count, w->if_offset,
+					w->of_offset);
+	else
+		w->ret = copy_lockstep(w);
+
+	gettimeofday(&end, NULL);
+	w->sec = end.tv_sec - start.tv_sec +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+
+	return NULL;
+}
+
+/* the pipeline polls, lockstep waits in read() or SG_IO */
+static int dd_queue_init(struct bsg_queue *q, int fd)
+{
+	int ret;
+
+	if (qdepth)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	ret = bsg_queue_init(q, fd, qdepth ? qdepth : 1,
+			     sgio ? BSG_QUEUE_SGIO : 0);
+	if (ret)
+		printf("can't set up the queue, %s\n", strerror(-ret));
+
 	return ret;
 }
 
+static int dd_worker_init(struct dd_worker *w, char *if_file, int if_sg,
+			  char *of_file, int of_sg, int bs)
+{
+	struct dd_pipe *p = &w->pipe;
+	int ret;
+
+	p->if_fd = p->of_fd = p->map_fd = -1;
+	p->if_sg = if_sg;
+	p->of_sg = of_sg;
+	p->bs = bs;
+	p->qdepth = qdepth;
+	p->use_ring = direct;
+
+	ret = bsg_arena_init(&w->arena, qdepth ? qdepth * 2 : 1, bs + align, 0,
+			     arena_flags | BSG_ARENA_PREFAULT);
+	if (ret) {
+		printf("can't allocate the buffer, %s\n", strerror(-ret));
+		return ret;
+	}
+
+	if (if_sg)
+		p->if_fd = open_bsg_dev(if_file);
+	else
+		p->if_fd = open(if_file, O_RDWR | (direct ? O_DIRECT : 0));
+	if (p->if_fd < 0) {
+		/* open_bsg_dev() returns -errno */
+		ret = if_sg ? p->if_fd : -errno;
+		printf("can't open if, %s %s\n", strerror(-ret), if_file);
+		return ret;
+	}
+
+	if (of_sg)
+		p->of_fd = open_bsg_dev(of_file);
+	else
+		p->of_fd = open(of_file, O_RDWR | O_CREAT |
+				(direct ? O_DIRECT : 0), 0644);
+	if (p->of_fd < 0) {
+		ret = of_sg ? p->of_fd : -errno;
+		printf("can't open of, %s %s\n", strerror(-ret), of_file);
+		return ret;
+	}
+
+	if (if_sg) {
+		ret = dd_queue_init(&p->if_q, p->if_fd);
+		if (ret)
+			return ret;
+	}
+
+	if (of_sg) {
+		ret = dd_queue_init(&p->of_q, p->of_fd);
+		if (ret)
+			return ret;
+	}
+
+	if (use_mmap)
+		p->map_fd = if_sg ? p->of_fd : p->if_fd;
+	p->map_write = if_sg;
+
+	return 0;
+}
+
+/* big enough for everything in flight plus one block */
+static size_t dd_map_window(struct dd_pipe *p)
+{
+	long pgsize = sysconf(_SC_PAGESIZE);
+	uint64_t len;
+
+	len = (uint64_t) (qdepth ? qdepth * 2 : 1) * p->stride + p->bs + pgsize;
+	if (len < DD_MAP_WINDOW)
+		len = DD_MAP_WINDOW;
+
+	return (len + pgsize - 1) & ~((uint64_t) pgsize - 1);
+}
+
+/*
+ * the file must cover the copy before it can be mapped, and a sparse
+ * copy that ends in a hole still has to set the size
+ */
+static int check_file_size(int fd, int write_file, uint64_t size)
+{
+	struct stat st;
+	int ret;
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		printf("can't stat the file, %s\n", strerror(-ret));
+		return ret;
+	}
+
+	if (!S_ISREG(st.st_mode))
+		return 0;
+
+	if (st.st_size >= size)
+		return 0;
+
+	if (!write_file) {
+		printf("if is smaller than (skip + count) * bs\n");
+		return -EINVAL;
+	}
+
+	if (ftruncate(fd, size)) {
+		ret = -errno;
+		printf("can't extend of, %s\n", strerror(-ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+static void dd_worker_exit(struct dd_worker *w)
+{
+	if (w->pipe.if_fd >= 0) {
+		if (w->pipe.if_sg)
+			close_bsg_dev(w->pipe.if_fd);
+		else
+			close(w->pipe.if_fd);
+	}
+	if (w->pipe.of_fd >= 0) {
+		if (w->pipe.of_sg)
+			close_bsg_dev(w->pipe.of_fd);
+		else
+			close(w->pipe.of_fd);
+	}
+	pipe_exit(&w->pipe);
+	pipe_unmap(&w->pipe);
+	bsg_queue_exit(&w->pipe.if_q);
+	bsg_queue_exit(&w->pipe.of_q);
+	bsg_arena_exit(&w->arena);
+	bsg_arena_exit(&w->pi_arena);
+}
+
 int main(int argc, char **argv)
 {
 	int longindex, ch;
-	int if_fd, of_fd, i;
+	int i, nr_workers = 0, zero_method = ZERO_WRITE;
 	char *p;
 	char *if_file, *of_file;
-	int count, bs;
+	uint64_t count, skip, seek, first, zero_blocks, zero_max = 1;
+	uint64_t pi_blocks, pi_ns;
+	int bs;
 	int ret = -EINVAL;
-	void *buf;
-	unsigned if_offset, of_offset;
-	int if_sg, of_sg;
+	int if_sg, of_sg, if_pi = 0, of_pi = 0;
+	unsigned int pi_lbs;
+	struct bsg_capacity if_cap, of_cap;
+	struct dd_worker *workers, *w;
+	struct timeval start, end;
+	double sec;
 
-	while ((ch = getopt_long(argc, argv, "a:sh", long_options,
+	while ((ch = getopt_long(argc, argv, "a:sHLq:t:imDSph", long_options,
 				 &longindex)) >= 0) {
 		switch (ch) {
 		case 'a':
@@ -165,6 +1351,41 @@ int main(int argc, char **argv)
 		case 's':
 			sgio = 1;
 			break;
+		case 'H':
+			arena_flags |= BSG_ARENA_HUGEPAGE;
+			break;
+		case 'L':
+			arena_flags |= BSG_ARENA_MLOCK;
+			break;
+		case 'q':
+			qdepth = strtol(optarg, NULL, 10);
+			if (qdepth <= 0) {
+				printf("invalid qdepth, %s\n", optarg);
+				goto out;
+			}
+			break;
+		case 't':
+			threads = strtol(optarg, NULL, 10);
+			if (threads <= 0) {
+				printf("invalid threads, %s\n", optarg);
+				goto out;
+			}
+			break;
+		case 'i':
+			interleave = 1;
+			break;
+		case 'm':
+			use_mmap = 1;
+			break;
+		case 'D':
+			direct = 1;
+			break;
+		case 'S':
+			sparse = 1;
+			break;
+		case 'p':
+			pi = 1;
+			break;
 		case 'h':
 			usage(0);
 			break;
@@ -176,8 +1397,8 @@ int main(int argc, char **argv)
 
 	if_file = of_file = NULL;
 	count = 1;
+	skip = seek = 0;
 	bs = 0;
-	if_offset = of_offset = 0;
 	if_sg = of_sg = 0;
 
 	for (i = optind; i < argc; i++) {
@@ -194,7 +1415,11 @@ int main(int argc, char **argv)
 		else if (!strcmp(argv[i], "of"))
 			of_file = p;
 		else if (!strcmp(argv[i], "count"))
-			count = strtod(p, NULL);
+			count = strtoull(p, NULL, 0);
+		else if (!strcmp(argv[i], "skip"))
+			skip = strtoull(p, NULL, 0);
+		else if (!strcmp(argv[i], "seek"))
+			seek = strtoull(p, NULL, 0);
 		else if (!strcmp(argv[i], "bs")) {
 			bs = strtod(p, &q);
 			if (!*q)
@@ -224,8 +1449,8 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	if_sg = !!strstr(if_file, "/sys/class/bsg/");
-	of_sg = !!strstr(of_file, "/sys/class/bsg/");
+	if_sg = is_bsg_dev(if_file);
+	of_sg = is_bsg_dev(of_file);
 
 	if (!if_sg && !of_sg) {
 		printf("if (%s) or of (%s) must not a sg device\n",
@@ -243,68 +1468,242 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	ret = 0;
+	if ((use_mmap || direct) && if_sg && of_sg) {
+		printf("%s needs if or of to be a file\n",
+		       use_mmap ? "mmap" : "direct");
+		goto out;
+	}
 
-	buf = malloc(bs + align);
-	if (!buf) {
-		ret = -ENOMEM;
+	if (sparse && use_mmap && !of_sg) {
+		printf("sparse can't be used with a mapped of\n");
 		goto out;
 	}
 
-	buf += align;
+	if (direct && (use_mmap || !qdepth)) {
+		printf("direct needs qdepth and can't be used with mmap\n");
+		goto out;
+	}
 
-	if (if_sg)
-		if_fd = open_bsg_dev(if_file);
-	else
-		if_fd = open(if_file, O_RDWR);
-	if (if_fd < 0) {
-		printf("can't open if, %s %s\n", strerror(errno), if_file);
+	if (direct && align % SECTOR_SIZE) {
+		printf("align must be a multiple of %d with direct\n",
+		       SECTOR_SIZE);
 		goto out;
 	}
 
-	if (of_sg)
-		of_fd = open_bsg_dev(of_file);
-	else
-		of_fd = open(of_file, O_RDWR |O_CREAT);
-	if (of_fd < 0) {
-		printf("can't open of, %s %s\n", strerror(errno), of_file);
+	if (qdepth && sgio) {
+		printf("qdepth needs the read/write interface\n");
 		goto out;
 	}
 
-	printf("%s %d: %d %d align %d\n", __func__, __LINE__, if_sg, of_sg, align);
+	if (pi && sparse) {
+		printf("pi can't be used with sparse\n");
+		goto out;
+	}
 
-	for (i = 0; i < count; i++) {
-		if (if_sg) {
-			ret = sgv4_read(if_fd, buf, bs, if_offset);
-			if (ret)
-				break;
-		} else {
-			ret = pread(if_fd, buf, bs, if_offset);
-			if (ret != bs) {
-				printf("%s %d: %d\n", __func__, __LINE__, ret);
-				goto out;
-			}
+	if (threads > count)
+		threads = count;
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers) {
+		printf("can't allocate the workers\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* open everything up front so a failure stops us before the copy */
+	for (i = 0; i < threads; i++) {
+		w = &workers[i];
+		w->id = i;
+		ret = dd_worker_init(w, if_file, if_sg, of_file, of_sg, bs);
+		if (ret) {
+			nr_workers = i + 1;
+			goto free_workers;
 		}
+	}
+	nr_workers = threads;
+
+	if (if_sg) {
+		ret = check_block_size(workers[0].pipe.if_fd, &if_cap, bs,
+				       (uint64_t) bs * (skip + count), if_file);
+		if (ret)
+			goto free_workers;
+	}
+
+	if (of_sg) {
+		ret = check_block_size(workers[0].pipe.of_fd, &of_cap, bs,
+				       (uint64_t) bs * (seek + count), of_file);
+		if (ret)
+			goto free_workers;
+	}
 
+	if (pi) {
+		if_pi = if_sg ? if_cap.pi_type : 0;
+		of_pi = of_sg ? of_cap.pi_type : 0;
+		if (!if_pi && !of_pi) {
+			printf("neither if nor of is formatted with PI\n");
+			ret = -EINVAL;
+			goto free_workers;
+		}
+		if (if_pi && of_pi && if_cap.block_size != of_cap.block_size) {
+			printf("PI passes through between the same block sizes "
+			       "only\n");
+			ret = -EINVAL;
+			goto free_workers;
+		}
+		printf("PI is %s\n", if_pi && of_pi ? "passed through" :
+		       if_pi ? "checked and stripped" : "generated");
+	}
+
+	if (use_mmap) {
+		ret = check_file_size(workers[0].pipe.map_fd, !of_sg,
+				      (uint64_t) bs * ((of_sg ? skip : seek) +
+						       count));
+		if (ret)
+			goto free_workers;
+	}
+
+	if (sparse) {
 		if (of_sg) {
-			ret = sgv4_write(of_fd, buf, bs, of_offset);
-			if (ret)
-				break;
+			zero_method = pick_zero_method(workers[0].pipe.of_fd,
+						       &of_cap, bs,
+						       (uint64_t) bs * seek,
+						       &zero_max);
 		} else {
-			ret = pwrite(of_fd, buf, bs, of_offset);
-			if (ret != bs) {
-				printf("%s %d: %d\n", __func__, __LINE__, ret);
-				goto out;
+			zero_method = ZERO_HOLE;
+			zero_max = INT_MAX;
+		}
+
+		zero_block = calloc(1, bs);
+		if (!zero_block) {
+			ret = -ENOMEM;
+			goto free_workers;
+		}
+
+		printf("zero blocks go out as %s\n",
+		       zero_method_name[zero_method]);
+	}
+
+	for (i = 0, first = 0; i < threads; i++) {
+		w = &workers[i];
+		w->pipe.zero_method = zero_method;
+		w->pipe.zero_max = zero_max;
+		w->pipe.if_lbs = if_sg ? if_cap.block_size : 0;
+		w->pipe.of_lbs = of_sg ? of_cap.block_size : 0;
+		w->pipe.if_pi = if_pi;
+		w->pipe.of_pi = of_pi;
+		w->count = count / threads + (i < count % threads);
+		w->pipe.map_window = dd_map_window(&w->pipe);
+
+		if (interleave) {
+			w->pipe.stride = (uint64_t) bs * threads;
+			w->if_offset = (uint64_t) bs * (skip + i);
+			w->of_offset = (uint64_t) bs * (seek + i);
+		} else {
+			w->pipe.stride = bs;
+			w->if_offset = (uint64_t) bs * (skip + first);
+			w->of_offset = (uint64_t) bs * (seek + first);
+			first += w->count;
+		}
+
+		if (if_pi || of_pi) {
+			pi_lbs = if_pi ? if_cap.block_size : of_cap.block_size;
+			ret = bsg_arena_init(&w->pi_arena,
+					     qdepth ? qdepth * 2 : 1,
+					     pi_xfer_len(bs, pi_lbs), 0,
+					     arena_flags | BSG_ARENA_PREFAULT);
+			if (ret) {
+				printf("can't allocate the PI buffer, %s\n",
+				       strerror(-ret));
+				goto free_workers;
+			}
+		}
+
+		if (qdepth) {
+			ret = pipe_init(&w->pipe, &w->arena, &w->pi_arena);
+			if (ret) {
+				printf("can't set up the pipeline, %s\n",
+				       strerror(-ret));
+				goto free_workers;
+			}
+		}
+	}
+
+	gettimeofday(&start, NULL);
+
+	if (threads == 1)
+		dd_worker_fn(&workers[0]);
+	else {
+		for (i = 0; i < threads; i++) {
+			ret = pthread_create(&workers[i].thread, NULL,
+					     dd_worker_fn, &workers[i]);
+			if (ret) {
+				fprintf(stderr, "can't create a thread, %s\n",
+					strerror(ret));
+				exit(1);
 			}
 		}
 
-		if_offset += bs;
-		of_offset += bs;
+		for (i = 0; i < threads; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	gettimeofday(&end, NULL);
+
+	for (i = 0; i < threads; i++)
+		if (workers[i].ret && !ret)
+			ret = workers[i].ret;
+
+	if (ret)
+		goto free_workers;
+
+	if (zero_method == ZERO_HOLE) {
+		ret = check_file_size(workers[0].pipe.of_fd, 1,
+				      (uint64_t) bs * (seek + count));
+		if (ret)
+			goto free_workers;
+	}
+
+	sec = end.tv_sec - start.tv_sec +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("succeeded (%s)\n", sgio ? "SG_IO" :
+	       qdepth ? "pipelined read/write interface" :
+	       "read/write interface");
+
+	if (threads > 1)
+		for (i = 0; i < threads; i++) {
+			w = &workers[i];
+			printf("worker %d: %" PRIu64 " blocks, %.3f s, "
+			       "%.2f MB/s\n",
+			       w->id, w->count, w->sec, w->sec > 0 ?
+			       (double) bs * w->count / w->sec / 1000000 : 0);
+		}
+
+	if (sparse) {
+		for (i = 0, zero_blocks = 0; i < threads; i++)
+			zero_blocks += workers[i].pipe.zero_blocks;
+		printf("%" PRIu64 " of %" PRIu64 " blocks were zero\n",
+		       zero_blocks, count);
+	}
+
+	if (if_pi || of_pi) {
+		for (i = 0, pi_blocks = pi_ns = 0; i < threads; i++) {
+			pi_blocks += workers[i].pipe.pi_blocks;
+			pi_ns += workers[i].pipe.pi_ns;
+		}
+		printf("PI: %" PRIu64 " blocks, %.3f ms on the host, "
+		       "%.2f GB/s\n", pi_blocks, pi_ns / 1000000.0,
+		       pi_ns ? (double) bs * count / pi_ns : 0);
 	}
 
-	free(buf - align);
+	if (sec > 0)
+		printf("%.3f s, %.2f MB/s\n", sec,
+		       (double) bs * count / sec / 1000000);
 
-	printf("succeeded (%s)\n", sgio ? "SG_IO" : "read/write interface");
+free_workers:
+	for (i = 0; i < nr_workers; i++)
+		dd_worker_exit(&workers[i]);
+	free(workers);
+	free(zero_block);
 out:
 	return ret;
 }
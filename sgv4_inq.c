@@ -44,42 +44,37 @@ Examples:\n\
 
 static void sgv4_inq_cmd(int fd)
 {
-	struct sg_io_v4 hdr;
-	unsigned char cmd[6];
-	unsigned char sense[32];
+	struct bsg_queue q;
+	struct bsg_req *req;
 	char buf[64];
 	int ret;
 
+	ret = bsg_queue_init(&q, fd, 1, sgio ? BSG_QUEUE_SGIO : 0);
+	if (ret) {
+		fprintf(stderr, "can't set up the queue, %s\n", strerror(-ret));
+		exit(1);
+	}
+
 	memset(buf, 0, sizeof(buf));
-	memset(cmd, 0, sizeof(cmd));
 
-	cmd[0] = 0x12;
-	cmd[4] = 64;
+	req = bsg_get_req(&q);
+	memset(req->cdb, 0, 6);
+	req->cdb[0] = 0x12;
+	req->cdb[4] = 64;
 
-	setup_sgv4_hdr(&hdr, cmd, sizeof(cmd), sense, sizeof(sense), buf, sizeof(buf),
-		       NULL, 0);
+	bsg_req_prep(req, 6, buf, sizeof(buf), NULL, 0);
 
-	if (sgio) {
-		ret = ioctl(fd, SG_IO, &hdr);
-		if (ret) {
-			fprintf(stderr, "fail to sgio, %m\n");
-			exit(1);
-		}
-	} else {
-		ret = write(fd, &hdr, sizeof(hdr));
-		if (ret != sizeof(hdr)) {
-			printf("%d: %d\n", __LINE__, ret);
-			exit(1);
-		}
-		memset(&hdr, 0, sizeof(hdr));
-		ret = read(fd, &hdr, sizeof(hdr));
-		if (ret != sizeof(hdr)) {
-			fprintf(stderr, "fail to wait for the response, %m\n");
-			exit(1);
-		}
+	ret = bsg_queue_exec(&q, req);
+	if (ret) {
+		fprintf(stderr, "fail to send the command, %s\n",
+			strerror(-ret));
+		exit(1);
 	}
 
 	printf("%d: %s\n", __LINE__, buf + 8);
+
+	bsg_put_req(&q, req);
+	bsg_queue_exit(&q);
 }
 
 int main(int argc, char **argv)
@@ -1,5 +1,6 @@
 /*
- * makeshift tool to send XDWRITEREAD_10 requests via bsg
+ * XDWRITEREAD_10/32 engine via bsg: queued bidirectional commands,
+ * the XOR data checked on the host
  *
  * Copyright (C) 2007 FUJITA Tomonori <tomof@acm.org>
  *
@@ -9,34 +10,39 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <scsi/scsi.h>
 #include <scsi/sg.h>
 
 #include "libbsg.h"
-
-#ifndef XDWRITEREAD_10
-#define XDWRITEREAD_10 0x53
-#endif
-
-#ifndef VARIABLE_LENGTH_CMD
-#define VARIABLE_LENGTH_CMD 0x7f
-#endif
+#include "libbuf.h"
+#include "libhist.h"
 
 static char pname[] = "sgv4_xdwriteread";
 
-int xdwriteread_32 = 0;
-
 static struct option const long_options[] =
 {
 	{"length", required_argument, 0, 'l'},
 	{"outfile", required_argument, 0, 'o'},
+	{"extended", no_argument, 0, 'e'},
+	{"qdepth", required_argument, 0, 'q'},
+	{"count", required_argument, 0, 'c'},
+	{"runtime", required_argument, 0, 'r'},
+	{"pattern", required_argument, 0, 'P'},
+	{"seed", required_argument, 0, 's'},
+	{"offset", required_argument, 0, 'O'},
+	{"size", required_argument, 0, 'S'},
+	{"host", no_argument, 0, 'H'},
+	{"no-verify", no_argument, 0, 'n'},
 	{"help", no_argument, 0, 'h'},
 	{0, 0, 0, 0},
 };
@@ -46,110 +52,430 @@ static void usage(int status)
 	if (status)
 		fprintf(stderr, "Try `%s --help' for more information.\n", pname);
 	else {
-		printf("Usage: %s [DEVICE]\n", pname);
+		printf("Usage: %s [OPTIONS]... [DEVICE]\n", pname);
 		printf("\
-  -l, --length            number of bytes. Default is 8192.\n\
-  -o, --outfile           write to FILE.\n\
-  -e, --extended	  use XDWRITEREAD_32.\n\
+  -l, --length            number of bytes per command. Default is 8192.\n\
+  -o, --outfile           write the XOR data of the first command to FILE.\n\
+  -e, --extended          use XDWRITEREAD_32.\n\
+  -q, --qdepth            commands in flight. Default is 1\n\
+  -c, --count             number of commands. Default is 1\n\
+  -r, --runtime           run for the given seconds. Without --count the\n\
+                          number of commands is unlimited\n\
+  -P, --pattern           seq or rand. Default is seq\n\
+  -s, --seed              seed of the rand pattern\n\
+  -O, --offset            start of the range to access, in bytes\n\
+  -S, --size              size of the range to access, in bytes. Default\n\
+                          is up to the end of the device\n\
+  -H, --host              do READ, the XOR on the host and WRITE instead,\n\
+                          the same work without the offload\n\
+  -n, --no-verify         don't check the XOR data\n\
   -h, --help              display this help and exit\n\
+\n\
+Each command writes a pattern stamped with its LBA and a generation, so\n\
+the old data, and the XOR that should come back, are known on the host.\n\
+The first command on an LBA can't be checked.\n\
+\n\
+A DEVICE is /sys/class/bsg/NAME, /dev/bsg/NAME or emu:SPEC, an emulated\n\
+disk, e.g. emu:ram,size=1g,lat=50 (see libemu.h)\n\
 ");
 	}
 	exit(status);
 }
 
-static int xdwriteread(int bsg_fd, int bufsize, char *outfile)
+static int xdwriteread_32;
+static int length = 8192;
+static int qdepth = 1;
+static uint64_t count = 1;
+static int has_count;
+static double runtime;
+static int rand_io;
+static uint64_t seed = 1;
+static uint64_t range_offset, range_size;
+static int host_xor;
+static int verify = 1;
+static char *outfile;
+
+/*
+ * The range is cut into units of length bytes. A unit has at most one
+ * command in flight, so what is on the disk is always the pattern of
+ * the generation the last command wrote there.
+ */
+struct xd_slot {
+	char *dout;
+	char *din;
+	char *old;		/* the expected old data */
+	uint64_t unit;
+	uint32_t gen;		/* of the data in dout */
+	int checked;		/* old is known */
+	int reading;		/* --host: the READ is out, the WRITE is next */
+	uint64_t start;
+};
+
+struct xd_run {
+	struct bsg_queue q;
+	struct xd_slot *slots;
+	uint32_t block_size;
+
+	uint64_t nr_units;
+	uint32_t *gen;		/* per unit, 0 when unknown */
+	unsigned char *busy;
+	uint64_t next;
+	uint64_t rand;
+	uint64_t issued;
+	uint64_t end_ns;
+	int stop;
+
+	uint64_t done;
+	uint64_t verified;
+	uint64_t mismatches;
+	uint64_t errors;
+	uint64_t xor_ns;	/* --host: in buf_xor() */
+	uint64_t check_ns;	/* in buf_xor_equal() */
+	int out_done;
+	struct lat_hist lat;
+};
+
+static uint64_t xorshift64(uint64_t *s)
 {
-	struct sg_io_v4 hdr;
-	unsigned int blocks;
-	unsigned char scb[32], sense[32];
-	char *in, *out;
-	int ret;
+	uint64_t x = *s;
 
-	bufsize &= ~(1024 - 1);
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*s = x;
 
-	in = valloc(bufsize);
-	out = valloc(bufsize + 1024);
+	return x;
+}
 
-	if (!in || !out) {
-		printf("out of memory\n");
-		exit(1);
+static void fill_pattern(char *buf, int len, uint64_t unit, uint32_t gen)
+{
+	uint64_t v = ((unit << 32) | gen) * 0x9e3779b97f4a7c15ULL;
+	uint64_t *p = (uint64_t *) buf;
+	int i;
+
+	for (i = 0; i < len / 8; i++)
+		p[i] = v ^ (i * 0xbf58476d1ce4e5b9ULL);
+}
+
+/* 0 once the run is over */
+static int next_unit(struct xd_run *r, uint64_t *unit)
+{
+	uint64_t u;
+
+	if (r->stop)
+		return 0;
+
+	if ((count && r->issued >= count) ||
+	    (runtime && lat_now_ns() >= r->end_ns)) {
+		r->stop = 1;
+		return 0;
 	}
 
-	memset(in, 0, bufsize);
-	memset(out, 0, bufsize + 1024);
-	memset(scb, 0, 32);
+	u = rand_io ? xorshift64(&r->rand) % r->nr_units : r->next;
+
+	/* there are more units than slots, so a free one turns up */
+	while (r->busy[u])
+		u = (u + 1) % r->nr_units;
+
+	r->busy[u] = 1;
+	r->next = (u + 1) % r->nr_units;
+	r->issued++;
+	*unit = u;
+
+	return 1;
+}
+
+static uint64_t unit_offset(uint64_t unit)
+{
+	return range_offset + unit * length;
+}
+
+static void xd_prep(struct bsg_req *req, struct xd_slot *s, uint64_t offset,
+		    uint32_t block_size)
+{
+	unsigned char *scb = req->cdb;
 
 	if (xdwriteread_32) {
-		setup_sgv4_hdr(&hdr, scb, 32, sense, sizeof(sense),
-			in, bufsize, out + 1024, bufsize);
+		bsg_req_prep(req, 32, s->din, length, s->dout, length);
 
+		memset(scb, 0, 32);
 		scb[0] = VARIABLE_LENGTH_CMD;
 		scb[7] = 0x18; /* Additional CDB length */
-		scb[9] = 0x07; /* XDWRITEREAD_32 */
-		/*
-		 * Assume LBA = 0 for now..
-		 */
-		blocks = (bufsize / 512);
-		scb[28] = (blocks >> 24) & 0xff;
-		scb[29] = (blocks >> 16) & 0xff;
-		scb[30] = (blocks >> 8) & 0xff;
-		scb[31] = blocks & 0xff;
+		put_be16(&scb[8], XDWRITEREAD_32);
+		put_be64(&scb[12], offset / block_size);
+		put_be32(&scb[28], length / block_size);
 	} else {
-		setup_sgv4_hdr(&hdr, scb, 10, sense, sizeof(sense),
-		       in, bufsize, out + 1024, bufsize);
+		bsg_req_prep(req, 10, s->din, length, s->dout, length);
+
+		setup_rw_scb(scb, 10, XDWRITEREAD_10, length, offset,
+			     block_size);
+	}
+}
+
+static void xd_queue(struct xd_run *r, struct bsg_req *req, uint64_t unit)
+{
+	struct xd_slot *s = &r->slots[req->tag];
+	uint32_t old_gen = r->gen[unit];
+
+	s->unit = unit;
+	s->gen = old_gen + 1 ? old_gen + 1 : 1;
+	s->checked = verify && old_gen;
+
+	if (verify) {
+		fill_pattern(s->dout, length, unit, s->gen);
+		if (s->checked)
+			fill_pattern(s->old, length, unit, old_gen);
+	}
+
+	s->start = lat_now_ns();
+	s->reading = host_xor;
 
-		setup_rw_scb(scb, sizeof(scb), XDWRITEREAD_10, bufsize, 0);
+	if (host_xor)
+		bsg_req_prep_rw(req, 0, s->din, length, unit_offset(unit),
+				r->block_size);
+	else
+		xd_prep(req, s, unit_offset(unit), r->block_size);
+
+	bsg_queue_rq(&r->q, req);
+}
+
+static void write_outfile(char *buf)
+{
+	int fd, ret;
+
+	fd = open(outfile, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("can't open %s, %m\n", outfile);
+		return;
 	}
 
-	ret = write(bsg_fd, &hdr, sizeof(hdr));
-	if (ret != sizeof(hdr)) {
-		fprintf(stderr, "Can't send a bsg request, %m\n");
+	ret = write(fd, buf, length);
+	if (ret == length)
+		printf("writes %d bytes to %s\n", length, outfile);
+	else
+		printf("failed to write %d bytes to %s\n", length, outfile);
+
+	close(fd);
+}
+
+static void xd_done(struct bsg_queue *q, struct bsg_req *req)
+{
+	struct xd_run *r = req->priv;
+	struct xd_slot *s = &r->slots[req->tag];
+	struct sg_io_v4 *hdr = &req->hdr;
+	uint64_t t;
+	int ok;
+
+	if (sgv4_rsp_check(hdr) || hdr->dout_resid) {
+		if (!r->errors++)
+			fprintf(stderr, "LBA %" PRIu64 " failed, driver:%u, "
+				"transport:%u, device:%u, din_resid: %d, "
+				"dout_resid: %d\n",
+				unit_offset(s->unit) / r->block_size,
+				hdr->driver_status, hdr->transport_status,
+				hdr->device_status, hdr->din_resid,
+				hdr->dout_resid);
+		/* what is on the disk now is anyone's guess */
+		r->gen[s->unit] = 0;
 		goto out;
 	}
 
-	ret = read(bsg_fd, &hdr, sizeof(hdr));
-	if (ret != sizeof(hdr))
-		fprintf(stderr, "Can't get a bsg response, %m\n");
+	if (s->reading) {
+		/* the parity work XDWRITEREAD does on the target */
+		t = lat_now_ns();
+		buf_xor(s->din, s->dout, length);
+		r->xor_ns += lat_now_ns() - t;
+
+		s->reading = 0;
+		bsg_req_prep_rw(req, 1, s->dout, length, unit_offset(s->unit),
+				r->block_size);
+		bsg_queue_rq(q, req);
+		return;
+	}
 
-	printf("%s driver:%u, transport:%u, device:%u, din_resid: %d, dout_resid: %d\n",
-	       (xdwriteread_32) ? "XDWRITEREAD_32" : "XDWRITEREAD_10", hdr.driver_status,
-		hdr.transport_status, hdr.device_status, hdr.din_resid, hdr.dout_resid);
+	hist_record(&r->lat, lat_now_ns() - s->start);
+	r->done++;
+	r->gen[s->unit] = s->gen;
 
-	if (outfile) {
-		int fd = open(outfile, O_RDWR|O_CREAT);
+	if (s->checked) {
+		t = lat_now_ns();
+		ok = buf_xor_equal(s->old, s->dout, s->din, length);
+		r->check_ns += lat_now_ns() - t;
 
-		ret = write(fd, in, bufsize);
-		if (ret == bufsize)
-			printf("writes %d bytes to %s\n", bufsize, outfile);
-		else
-			printf("failed to write %d bytes to %s\n", bufsize,
-			       outfile);
+		r->verified++;
+		if (!ok && r->mismatches++ < 10)
+			fprintf(stderr, "LBA %" PRIu64 ": the XOR data is "
+				"wrong\n",
+				unit_offset(s->unit) / r->block_size);
 	}
 
+	if (outfile && !r->out_done) {
+		write_outfile(s->din);
+		r->out_done = 1;
+	}
 out:
-	free(in);
-	free(out);
-	return 0;
+	r->busy[s->unit] = 0;
+	bsg_put_req(q, req);
+}
+
+static int xd_run(struct xd_run *r, int fd)
+{
+	struct bsg_req *req;
+	struct pollfd pfd;
+	uint64_t unit;
+	int ret;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	r->end_ns = lat_now_ns() + runtime * 1e9;
+
+	for (;;) {
+		while (r->q.nr_free && next_unit(r, &unit)) {
+			req = bsg_get_req(&r->q);
+			xd_queue(r, req, unit);
+		}
+
+		ret = bsg_queue_submit(&r->q);
+		if (ret < 0) {
+			fprintf(stderr, "Can't send a bsg request, %s\n",
+				strerror(-ret));
+			return ret;
+		}
+
+		if (!bsg_queue_busy(&r->q))
+			return 0;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -errno;
+
+		ret = bsg_queue_reap(&r->q);
+		if (ret < 0) {
+			fprintf(stderr, "Can't reap bsg requests, %s\n",
+				strerror(-ret));
+			return ret;
+		}
+	}
+}
+
+static double tv_usec(struct timeval *tv)
+{
+	return tv->tv_sec * 1e6 + tv->tv_usec;
+}
+
+static void print_stats(struct xd_run *r, double secs, struct rusage *ru0,
+			struct rusage *ru1)
+{
+	double cpu_us;
+
+	cpu_us = tv_usec(&ru1->ru_utime) - tv_usec(&ru0->ru_utime) +
+		tv_usec(&ru1->ru_stime) - tv_usec(&ru0->ru_stime);
+
+	printf("commands : %" PRIu64 " in %.3f s, %.0f per sec\n", r->done,
+	       secs, r->done / secs);
+	printf("bandwidth : out %.2f, in %.2f, total %.2f [MB/s]\n",
+	       r->done * length / secs / 1e6, r->done * length / secs / 1e6,
+	       2.0 * r->done * length / secs / 1e6);
+	hist_print(stdout, "", &r->lat);
+
+	if (!r->done)
+		return;
+
+	printf("cpu : %.2f us per command\n", cpu_us / r->done);
+	if (r->xor_ns)
+		printf("host XOR : %.2f us per command, %.2f GB/s\n",
+		       r->xor_ns / 1e3 / r->done,
+		       (double) r->done * length / r->xor_ns);
+	if (r->verified)
+		printf("check : %.2f us per command, %.2f GB/s\n",
+		       r->check_ns / 1e3 / r->verified,
+		       (double) r->verified * length / r->check_ns);
+	printf("verified : %" PRIu64 ", mismatches : %" PRIu64
+	       ", errors : %" PRIu64 "\n", r->verified, r->mismatches,
+	       r->errors);
+}
+
+static uint64_t parse_size(char *str)
+{
+	uint64_t v;
+	char *p;
+
+	v = strtoull(str, &p, 0);
+	switch (*p) {
+	case 't':
+		v <<= 10;
+		/* fall through */
+	case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'k':
+		v <<= 10;
+		break;
+	}
+
+	return v;
 }
 
 int main(int argc, char **argv)
 {
-	int longindex, ch;
+	int longindex, ch, i, ret;
 	int bsg_fd;
-	int length = 8192;
-	char *out = NULL;
+	struct bsg_capacity cap;
+	struct bsg_arena arena;
+	struct xd_run r;
+	struct rusage ru0, ru1;
+	uint64_t start, max_blocks;
+	double secs;
 
-	while ((ch = getopt_long(argc, argv, "l:eh", long_options,
-				 &longindex)) >= 0) {
+	while ((ch = getopt_long(argc, argv, "l:o:eq:c:r:P:s:O:S:Hnh",
+				 long_options, &longindex)) >= 0) {
 		switch (ch) {
 		case 'l':
-			length = atoi(optarg);
+			length = parse_size(optarg);
 			break;
 		case 'o':
-			out = optarg;
+			outfile = optarg;
 			break;
 		case 'e':
-			xdwriteread_32 = 1;		
+			xdwriteread_32 = 1;
+			break;
+		case 'q':
+			qdepth = atoi(optarg);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 10);
+			has_count = 1;
+			break;
+		case 'r':
+			runtime = atof(optarg);
+			break;
+		case 'P':
+			if (!strcmp(optarg, "rand"))
+				rand_io = 1;
+			else if (strcmp(optarg, "seq")) {
+				fprintf(stderr, "unknown pattern, %s\n",
+					optarg);
+				usage(1);
+			}
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'O':
+			range_offset = parse_size(optarg);
+			break;
+		case 'S':
+			range_size = parse_size(optarg);
+			break;
+		case 'H':
+			host_xor = 1;
+			break;
+		case 'n':
+			verify = 0;
 			break;
 		case 'h':
 			usage(0);
@@ -160,14 +486,113 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (optind >= argc) {
+		fprintf(stderr, "no device is given\n");
+		usage(1);
+	}
+
+	if (runtime < 0 || qdepth < 1 || (has_count && !count)) {
+		fprintf(stderr, "bad runtime, qdepth or count\n");
+		exit(1);
+	}
+	if (runtime && !has_count)
+		count = 0;
+
 	bsg_fd = open_bsg_dev(argv[optind]);
 	if (bsg_fd < 0) {
 		fprintf(stderr, "Can't open %s's bsg device.\n", argv[optind]);
+		exit(1);
+	}
+
+	ret = bsg_read_capacity(bsg_fd, &cap);
+	if (ret) {
+		fprintf(stderr, "Can't get the capacity, %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	if (length <= 0 || length % cap.block_size ||
+	    range_offset % cap.block_size) {
+		fprintf(stderr, "The length and the offset should be "
+			"multiples of the %u byte blocks\n", cap.block_size);
+		exit(1);
+	}
+
+	if (range_offset >= cap.nr_blocks * cap.block_size) {
+		fprintf(stderr, "the offset is past the end of the device\n");
+		exit(1);
 	}
+	if (!range_size ||
+	    range_size > cap.nr_blocks * cap.block_size - range_offset)
+		range_size = cap.nr_blocks * cap.block_size - range_offset;
+
+	memset(&r, 0, sizeof(r));
+	r.block_size = cap.block_size;
+	r.nr_units = range_size / length;
+	if (r.nr_units < (uint64_t) qdepth) {
+		fprintf(stderr, "the range holds fewer than %d commands\n",
+			qdepth);
+		exit(1);
+	}
+
+	/* XDWRITEREAD_10 has a 32 bit LBA and a 16 bit length */
+	max_blocks = (range_offset + r.nr_units * length) / cap.block_size;
+	if (!xdwriteread_32 && (max_blocks > 0xffffffffULL ||
+				length / cap.block_size > 0xffff)) {
+		fprintf(stderr, "the range or the length is too big for "
+			"XDWRITEREAD_10, try -e\n");
+		exit(1);
+	}
+
+	r.gen = calloc(r.nr_units, sizeof(*r.gen));
+	r.busy = calloc(r.nr_units, 1);
+	r.slots = calloc(qdepth, sizeof(*r.slots));
+	if (!r.gen || !r.busy || !r.slots) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	r.rand = seed ? seed : 1;
+	hist_init(&r.lat);
+
+	ret = bsg_arena_init(&arena, qdepth, 3 * (size_t) length, 0,
+			     BSG_ARENA_PREFAULT);
+	if (ret) {
+		fprintf(stderr, "can't allocate the buffers, %s\n",
+			strerror(-ret));
+		exit(1);
+	}
+
+	ret = bsg_queue_init(&r.q, bsg_fd, qdepth, 0);
+	if (ret) {
+		fprintf(stderr, "Can't set up the queue, %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	for (i = 0; i < qdepth; i++) {
+		r.slots[i].dout = bsg_arena_slot(&arena, i);
+		r.slots[i].din = r.slots[i].dout + length;
+		r.slots[i].old = r.slots[i].din + length;
+		/* with --no-verify the data stays as it is */
+		fill_pattern(r.slots[i].dout, length, i, 1);
+		r.q.reqs[i].priv = &r;
+		r.q.reqs[i].done = xd_done;
+	}
+
+	printf("%s%s, %d bytes, queue depth %d, %" PRIu64 " bytes from %"
+	       PRIu64 "\n", xdwriteread_32 ? "XDWRITEREAD_32" :
+	       "XDWRITEREAD_10", host_xor ? " on the host" : "", length,
+	       qdepth, r.nr_units * length, range_offset);
+
+	getrusage(RUSAGE_SELF, &ru0);
+	start = lat_now_ns();
+	ret = xd_run(&r, bsg_fd);
+	secs = (lat_now_ns() - start) / 1e9;
+	getrusage(RUSAGE_SELF, &ru1);
 
-	xdwriteread(bsg_fd, length, out);
+	print_stats(&r, secs, &ru0, &ru1);
 
-	close(bsg_fd);
+	bsg_queue_exit(&r.q);
+	bsg_arena_exit(&arena);
+	close_bsg_dev(bsg_fd);
 
-	return 0;
+	return ret || r.errors || r.mismatches;
 }
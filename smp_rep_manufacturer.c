@@ -139,14 +139,14 @@ int main(int argc, char **argv)
 	hdr.dout_xfer_len = req_len;
 	hdr.dout_xferp = (unsigned long) req;
 
-	res = ioctl(bsg_fd, SG_IO, &hdr);
+	res = bsg_sg_io(bsg_fd, &hdr);
 
 	if (hdr.response_len)
 		printf("IOCStatus=0x%X IOCLogInfo=0x%X SASStatus=0x%X\n",
 		       smpreply.IOCStatus, smpreply.IOCLogInfo, smpreply.SASStatus);
 
 	if (res) {
-		printf("%d, %d\n", res, errno);
+		printf("%d, %s\n", res, strerror(-res));
 		exit(1);
 	}
 